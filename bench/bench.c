@@ -0,0 +1,1156 @@
+/*
+ * wtc - bench.c
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the primitives on wtc's hot paths.
+ *
+ * Usage: bench [-o output] [-c baseline] [-t tolerance] [filter]
+ *
+ * Every benchmark whose name contains filter (or every benchmark, if there
+ * is no filter) is run, and its best time per operation is written to
+ * output (stdout by default), one "name nanoseconds" line per benchmark.
+ * Log messages are discarded.
+ * If a baseline in the same format is given, each result is compared to
+ * it and the exit status is 1 if any benchmark is more than tolerance
+ * percent (default 25) slower than its baseline.
+ */
+
+#define _GNU_SOURCE
+
+#include "tmux_internal.h"
+
+#include "layout.h"
+#include "log.h"
+#include "shl_ring.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each benchmark is timed until a sample takes at least this long. */
+#define SAMPLE_MS 20
+#define SAMPLES 5
+
+#define LINES 1000
+#define ENTRIES 10000
+
+struct bench {
+	const char *name;
+	/* Perform n operations. Returns 0 on success. */
+	int (*fn)(size_t n);
+};
+
+static struct wtc_tmux *tmux;
+static struct shl_ring ring;
+static char chunk[4096];
+static int pfd[2] = { -1, -1 };
+
+static char *lines_is;
+static char *lines_iii;
+static char *lines_iiiii;
+static char *lines_iis;
+static char *layouts;
+static char *stream;
+static char *scratch;
+static size_t scratch_len;
+static int *ibuf;
+static size_t ibuf_len;
+static char *client_names[ENTRIES];
+
+/*
+ * A headless output for the layout engine: one client on a session of
+ * LAYOUT_WINDOWS windows, which share ENTRIES panes. Every eighth view is
+ * a popup of the pane view before it; the rest show a pane each.
+ */
+#define LAYOUT_WINDOWS 16
+static struct wtc_tmux_pane *lpanes;
+static struct wtc_tmux_window lwinds[LAYOUT_WINDOWS];
+static struct wtc_tmux_session lsess;
+static struct wtc_tmux_client lclient;
+static struct wtc_tmux_pane_ref *lrefs;
+static struct wtc_layout_output lout;
+static struct wtc_layout_view *lviews;
+static struct wtc_layout_result *lres;
+
+static const char LAYOUT[] = "5e5b,238x58,0,0{119x58,0,0[119x29,0,0,0,"
+	"119x14,0,30,1,119x13,0,45,2],118x58,120,0[118x29,120,0,3,"
+	"118x28,120,30{59x28,120,30,4,58x28,180,30,5}]}";
+
+/*
+ * A control client whose server is scripted: each reply is written to its
+ * output before the command is sent, and the commands go to /dev/null.
+ */
+static struct wtc_tmux_cc qcc;
+static int qfd[2] = { -1, -1 };
+
+static const char *const QUERY[] = { "list-sessions", "-F",
+	"#{session_id} #{session_name}", NULL };
+#define QUERY_OUT "$0 main\n$1 scratch\n"
+static const char QUERY_OK[] = "%begin 1 1 1\n" QUERY_OUT "%end 1 1 1\n";
+static const char QUERY_ERR[] = "%begin 1 1 1\nno server\n%error 1 1 1\n";
+
+/*
+ * A small model of one session showing a window of three panes, with a
+ * client attached, for the refresh benchmark. Its control client is
+ * answered by rserver, a thread standing in for tmux, and every other
+ * layout it reports has the window zoomed, so the panes keep leaving and
+ * rejoining the client's visible set.
+ */
+static struct wtc_tmux *rtmux;
+static struct wtc_tmux_cc rcc;
+static int rcmd[2] = { -1, -1 };
+static int rreply[2] = { -1, -1 };
+static int rrefresh[2] = { -1, -1 };
+static int rserver_fds[2];
+static pthread_t rthread;
+static bool rthread_started;
+static size_t rvisibility;
+static uint64_t rchanges;
+
+static const char RNOTE[] = "%layout-change @0 c1a1,80x24,0,0,1 "
+	"c1a1,80x24,0,0,1 *\n";
+static const char RPANES[] = "%0 @0 0 1000 0\n%1 @0 1 1001 0\n"
+	"%2 @0 0 1002 0\n";
+static const char RLAYOUT[] = "c1a1,80x24,0,0{40x24,0,0,0,"
+	"39x24,41,0[39x12,41,0,1,39x11,41,13,2]}\n";
+static const char RZOOMED[] = "c1a1,80x24,0,0,1\n";
+
+static const char *const KEYS[] = { "C-b", "M-Left", "F12", "C-S-Up",
+	"%", "Space", "BTab", "M-C-x", "PPage", "KP*", "Escape", "C-M-S-F5",
+	"q", "Enter", "IC", "Tab" };
+#define KEYS_LEN (sizeof(KEYS) / sizeof(KEYS[0]))
+
+/*
+ * Count the allocations made while alloc_counting is set by interposing on
+ * glibc's allocator, so the benchmarks of paths which mustn't allocate can
+ * check that they don't.
+ */
+static bool alloc_counting;
+static size_t alloc_count;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	alloc_count += alloc_counting;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count += alloc_counting;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count += alloc_counting;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Copy src into the scratch buffer (which the parsers may modify) and
+ * return it.
+ */
+static char *fresh(const char *src)
+{
+	size_t len = strlen(src) + 1;
+	if (len > scratch_len) {
+		char *tmp = realloc(scratch, len);
+		if (!tmp)
+			return NULL;
+		scratch = tmp;
+		scratch_len = len;
+	}
+
+	return memcpy(scratch, src, len);
+}
+
+/*
+ * Build LINES lines of the given format, which is passed the line number
+ * three times, into a newly allocated *out.
+ */
+static int gen_lines(const char *fmt, char **out)
+{
+	size_t off = 0;
+	char *str = malloc(LINES * 128);
+	if (!str)
+		return -ENOMEM;
+
+	for (int i = 0; i < LINES; ++i)
+		off += sprintf(str + off, fmt, i, i, i);
+
+	*out = str;
+	return 0;
+}
+
+static int bench_ring_push_pop(size_t n)
+{
+	struct iovec vec[2];
+	for (size_t i = 0; i < n; ++i) {
+		if (shl_ring_push(&ring, chunk, 64) < 0)
+			return -ENOMEM;
+		if (!shl_ring_peek(&ring, vec))
+			return -EINVAL;
+		shl_ring_pop(&ring, 64);
+	}
+
+	return 0;
+}
+
+static int bench_ring_iterate_4k(size_t n)
+{
+	struct iovec vecs[2];
+	size_t size, pos;
+	size_t count = 0;
+	char val;
+
+	shl_ring_pop(&ring, SIZE_MAX);
+	if (shl_ring_push(&ring, chunk, sizeof(chunk)) < 0)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < n; ++i)
+		SHL_RING_ITERATE(&ring, val, vecs, size, pos)
+			count += val == '\n';
+
+	shl_ring_pop(&ring, SIZE_MAX);
+	return count == n * 64 ? 0 : -EINVAL;
+}
+
+static int bench_read_available_4k(size_t n)
+{
+	int size;
+	for (size_t i = 0; i < n; ++i) {
+		if (write(pfd[1], chunk, sizeof(chunk)) != sizeof(chunk))
+			return -errno;
+
+		size = 0;
+		int r = read_available(pfd[0], WTC_RDAVL_RING, &size, &ring);
+		if (r < 0)
+			return r;
+		shl_ring_pop(&ring, size);
+	}
+
+	return 0;
+}
+
+static int bench_parselnis(size_t n)
+{
+	int *is, len;
+	char **ss;
+	for (size_t i = 0; i < n; ++i) {
+		int r = parselnis("$%u %n", fresh(lines_is), &len, &is, &ss);
+		if (r < 0)
+			return r;
+
+		for (int j = 0; j < len; ++j)
+			free(ss[j]);
+		free(ss);
+		free(is);
+	}
+
+	return 0;
+}
+
+static int bench_parselniii(size_t n)
+{
+	int *is, *is2, *is3, len;
+	for (size_t i = 0; i < n; ++i) {
+		int r = parselniii("$%u @%u %u%n", fresh(lines_iii), &len, &is,
+		                   &is2, &is3);
+		if (r < 0)
+			return r;
+
+		free(is);
+		free(is2);
+		free(is3);
+	}
+
+	return 0;
+}
+
+static int bench_parselniiiii_buf(size_t n)
+{
+	int *is, *is2, *is3, *is4, *is5, len;
+	for (size_t i = 0; i < n; ++i) {
+		int r = parselniiiii_buf("%%%u @%u %u %u %u%n", fresh(lines_iiiii),
+		                         1, &ibuf, &ibuf_len, &len, &is, &is2,
+		                         &is3, &is4, &is5);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int bench_parselniis(size_t n)
+{
+	int *is, *is2, len;
+	char **ss;
+	for (size_t i = 0; i < n; ++i) {
+		int r = parselniis("$%u @%u %n", fresh(lines_iis), &len, &is,
+		                   &is2, &ss);
+		if (r < 0)
+			return r;
+
+		for (int j = 0; j < len; ++j)
+			free(ss[j]);
+		free(ss);
+		free(is);
+		free(is2);
+	}
+
+	return 0;
+}
+
+static int bench_strtokd_layout(size_t n)
+{
+	char *saveptr, delim;
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		char *tok = strtokd(fresh(LAYOUT), ",x[]{}", &saveptr, &delim);
+		while (tok) {
+			count++;
+			tok = strtokd(NULL, ",x[]{}", &saveptr, &delim);
+		}
+	}
+
+	return count ? 0 : -EINVAL;
+}
+
+static int bench_process_layout(size_t n)
+{
+	struct wtc_tmux_pane *pane;
+	for (size_t i = 0; i < n; ++i) {
+		int r = wtc_tmux_decode_layouts(tmux, fresh(layouts));
+		wtc_tmux_clear_closures(tmux);
+		if (r < 0)
+			return r;
+
+		for (pane = tmux->panes; pane; pane = pane->hh.next)
+			if (pane->pid < 0)
+				pane->pid *= -1;
+	}
+
+	return 0;
+}
+
+static int bench_key_string_lookup(size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		if (key_string_lookup_string(KEYS[i % KEYS_LEN]) == KEYC_UNKNOWN)
+			return -EINVAL;
+
+	return 0;
+}
+
+static int bench_cc_process_output(size_t n)
+{
+	struct wtc_tmux_cc cc = { .tmux = tmux, .buf = ring };
+	size_t len = strlen(stream);
+	int r = 0;
+
+	for (size_t i = 0; i < n && r >= 0; ++i) {
+		r = shl_ring_push(&cc.buf, stream, len);
+		if (r >= 0)
+			r = wtc_tmux_cc_process_output(&cc);
+		if (r >= 0 && !shl_ring_empty(&cc.buf))
+			r = -EINVAL;
+	}
+
+	ring = cc.buf;
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Queries through a control client, every other one answered with an
+ * error. Once qbuf and the ring are big enough, these mustn't allocate.
+ */
+static int bench_query_cc(size_t n)
+{
+	const char *reply;
+	char *out;
+	int r = 0;
+
+	tmux->ccs = &qcc;
+	alloc_count = 0;
+	alloc_counting = true;
+	for (size_t i = 0; i < n && r >= 0; ++i) {
+		reply = i % 2 ? QUERY_ERR : QUERY_OK;
+		if (write(qfd[1], reply, strlen(reply)) < 0) {
+			r = -errno;
+			break;
+		}
+
+		r = wtc_tmux_query(tmux, QUERY, &out);
+		if (r >= 0 && r != (int) (i % 2))
+			r = -EINVAL;
+		if (r >= 0 && strcmp(out, i % 2 ? "" : QUERY_OUT))
+			r = -EINVAL;
+	}
+	alloc_counting = false;
+	tmux->ccs = NULL;
+
+	if (r >= 0 && alloc_count) {
+		fprintf(stderr, "bench: query_cc made %zu allocations!\n",
+		        alloc_count);
+		r = -ENOMEM;
+	}
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Answer the commands read from fds[0] until it is closed, as tmux would,
+ * on fds[1]: the panes for list-panes, the layouts for list-windows
+ * (alternately zoomed) and nothing for anything else. This mustn't
+ * allocate either.
+ */
+static void *rserver(void *data)
+{
+	const int *fds = data;
+	char cmd[512], reply[512];
+	const char *out;
+	size_t len = 0;
+	ssize_t n;
+	char *end;
+	int num = 0;
+	bool zoomed = false;
+
+	while ((n = read(fds[0], cmd + len, sizeof(cmd) - 1 - len)) > 0) {
+		len += n;
+		cmd[len] = '\0';
+		while ((end = strchr(cmd, '\n'))) {
+			if (!strncmp(cmd, "\"list-panes\"", 12)) {
+				out = RPANES;
+			} else if (!strncmp(cmd, "\"list-windows\"", 14)) {
+				out = zoomed ? RZOOMED : RLAYOUT;
+				zoomed = !zoomed;
+			} else {
+				out = "";
+			}
+
+			++num;
+			n = snprintf(reply, sizeof(reply), "%%begin 1 %d 1\n%s"
+			             "%%end 1 %d 1\n", num, out, num);
+			if (write(fds[1], reply, n) < 0)
+				return NULL;
+
+			len -= end + 1 - cmd;
+			memmove(cmd, end + 1, len + 1);
+		}
+
+		// A command which doesn't fit isn't one we answer.
+		if (len == sizeof(cmd) - 1)
+			len = 0;
+	}
+
+	return NULL;
+}
+
+static int rvisibility_cb(struct wtc_tmux *tmux,
+                          const struct wtc_tmux_client *client,
+                          const int *panes, size_t count)
+{
+	const struct wtc_tmux_pane *pane;
+
+	// Zooming leaves the hidden panes without a size.
+	for (size_t i = 0; i < count; ++i) {
+		pane = wtc_tmux_lookup_pane(tmux, panes[i]);
+		if (!pane || wtc_tmux_pane_visible(client, pane) != (pane->w > 0))
+			return -EINVAL;
+	}
+
+	rvisibility += count;
+	return 0;
+}
+
+/* Count the changes into data, which none should be missed from. */
+static int rchange_cb(struct wtc_tmux *tmux,
+                      const struct wtc_tmux_change *change, void *data)
+{
+	uint64_t *changes = data;
+
+	if (!change || change->seq >= wtc_tmux_journal_seq(tmux))
+		return 1;
+
+	++*changes;
+	return 0;
+}
+
+/*
+ * Process a %layout-change through rcc and the refresh it queues: reloading
+ * the panes through rcc, decoding the layouts, updating the visible set,
+ * and journaling and running the callbacks.
+ */
+static int refresh_layout(void)
+{
+	int r = shl_ring_push(&rcc.buf, RNOTE, strlen(RNOTE));
+	if (r >= 0)
+		r = wtc_tmux_cc_process_output(&rcc);
+	if (r >= 0)
+		r = wtc_tmux_refresh_cb(rrefresh[0], 0, rtmux);
+	return r;
+}
+
+/*
+ * Refreshes after a layout change. Once the model and the buffers on the
+ * way have settled, these mustn't allocate.
+ */
+static int bench_refresh_layout(size_t n)
+{
+	size_t visibility;
+	uint64_t changes;
+	int r = 0;
+
+	alloc_count = 0;
+	alloc_counting = true;
+	for (size_t i = 0; i < n && r >= 0; ++i) {
+		visibility = rvisibility;
+		changes = rchanges;
+		r = refresh_layout();
+
+		// Every refresh moves the panes and flips two of them.
+		if (r >= 0 && (rvisibility != visibility + 2 ||
+		               rchanges == changes))
+			r = -EINVAL;
+	}
+	alloc_counting = false;
+
+	if (r >= 0 && alloc_count) {
+		fprintf(stderr, "bench: refresh_layout made %zu allocations!\n",
+		        alloc_count);
+		r = -ENOMEM;
+	}
+	return r < 0 ? r : 0;
+}
+
+static int bench_lookup_pane(size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		if (!wtc_tmux_lookup_pane(tmux, (i * 7919) % ENTRIES))
+			return -EINVAL;
+	return 0;
+}
+
+static int bench_lookup_window(size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		if (!wtc_tmux_lookup_window(tmux, (i * 7919) % ENTRIES))
+			return -EINVAL;
+	return 0;
+}
+
+static int bench_lookup_session(size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		if (!wtc_tmux_lookup_session(tmux, (i * 7919) % ENTRIES))
+			return -EINVAL;
+	return 0;
+}
+
+static int bench_lookup_client(size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		if (!wtc_tmux_lookup_client(tmux,
+		                            client_names[(i * 7919) % ENTRIES]))
+			return -EINVAL;
+	return 0;
+}
+
+/* Publish the whole model, ENTRIES of each object, n times. */
+static int bench_export_update(size_t n)
+{
+	int r = 0;
+
+	for (size_t i = 0; i < n && r >= 0; ++i)
+		r = wtc_tmux_export_update(tmux);
+	return r < 0 ? r : 0;
+}
+
+/* Lay out ENTRIES views, n times. */
+static int bench_layout(size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		if (!wtc_layout_place(&lout, lviews, ENTRIES, lres))
+			return -EINVAL;
+	return 0;
+}
+
+/*
+ * Show the window of the panes in the client's visible set, as
+ * update_visibility would.
+ */
+static void show_layout_window(struct wtc_tmux_window *wind)
+{
+	struct wtc_tmux_pane_ref *ref;
+
+	lsess.active_window = wind;
+	HASH_CLEAR(hh, lclient.visible);
+	for (int i = wind->id; i < ENTRIES; i += LAYOUT_WINDOWS) {
+		ref = &lrefs[i];
+		HASH_ADD_INT(lclient.visible, id, ref);
+	}
+}
+
+/*
+ * Lay out ENTRIES views, n times, with tmux churning in between: each time
+ * another window is switched to, its panes are resized and its active
+ * pane moves on.
+ */
+static int bench_layout_churn(size_t n)
+{
+	struct wtc_tmux_window *wind;
+	struct wtc_tmux_pane *pane;
+
+	for (size_t i = 0; i < n; ++i) {
+		wind = &lwinds[(i * 7) % LAYOUT_WINDOWS];
+		for (pane = wind->panes; pane; pane = pane->next) {
+			pane->w = 20 + i % 40;
+			pane->x = (pane->id / LAYOUT_WINDOWS) % 8 * pane->w;
+		}
+		wind->active_pane->active = false;
+		wind->active_pane = wind->active_pane->next
+		                    ? wind->active_pane->next : wind->panes;
+		wind->active_pane->active = true;
+		show_layout_window(wind);
+
+		// The active pane may be one without a view of its own.
+		wtc_layout_place(&lout, lviews, ENTRIES, lres);
+	}
+	return 0;
+}
+
+static const struct bench BENCHES[] = {
+	{ "shl_ring_push_pop", bench_ring_push_pop },
+	{ "shl_ring_iterate_4k", bench_ring_iterate_4k },
+	{ "read_available_pipe_4k", bench_read_available_4k },
+	{ "parselnis_1k", bench_parselnis },
+	{ "parselniii_1k", bench_parselniii },
+	{ "parselniiiii_buf_1k", bench_parselniiiii_buf },
+	{ "parselniis_1k", bench_parselniis },
+	{ "strtokd_layout", bench_strtokd_layout },
+	{ "process_layout_1k", bench_process_layout },
+	{ "key_string_lookup_string", bench_key_string_lookup },
+	{ "cc_process_output_1k", bench_cc_process_output },
+	{ "query_cc_noalloc", bench_query_cc },
+	{ "refresh_layout_noalloc", bench_refresh_layout },
+	{ "lookup_pane_10k", bench_lookup_pane },
+	{ "lookup_window_10k", bench_lookup_window },
+	{ "lookup_session_10k", bench_lookup_session },
+	{ "lookup_client_10k", bench_lookup_client },
+	{ "export_update_10k", bench_export_update },
+	{ "layout_10k", bench_layout },
+	{ "layout_churn_10k", bench_layout_churn },
+};
+#define BENCHES_LEN (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+/*
+ * Populate the tmux model with ENTRIES of each object. Panes are grouped
+ * four to a window, and the layouts describe all of them.
+ */
+static int setup_model(void)
+{
+	struct wtc_tmux_pane *pane;
+	struct wtc_tmux_window *wind;
+	struct wtc_tmux_session *sess;
+	struct wtc_tmux_client *client;
+
+	int r = wtc_tmux_new(&tmux);
+	if (r < 0)
+		return r;
+
+	for (int i = 0; i < ENTRIES; ++i) {
+		pane = calloc(1, sizeof(struct wtc_tmux_pane));
+		wind = calloc(1, sizeof(struct wtc_tmux_window));
+		sess = calloc(1, sizeof(struct wtc_tmux_session));
+		client = calloc(1, sizeof(struct wtc_tmux_client));
+		if (!pane || !wind || !sess || !client ||
+		    bprintf(&client_names[i], "/dev/pts/%d", i) < 0) {
+			free(pane);
+			free(wind);
+			free(sess);
+			free(client);
+			return -ENOMEM;
+		}
+
+		pane->id = wind->id = sess->id = i;
+		pane->pid = 1000 + i;
+		client->name = wtc_tmux_intern(tmux, client_names[i]);
+		if (!client->name) {
+			free(pane);
+			free(wind);
+			free(sess);
+			free(client);
+			return -ENOMEM;
+		}
+
+		HASH_ADD_INT(tmux->panes, id, pane);
+		HASH_ADD_INT(tmux->windows, id, wind);
+		HASH_ADD_INT(tmux->sessions, id, sess);
+		HASH_ADD_PTR(tmux->clients, name, client);
+	}
+
+	// Exported to a private object, which wtc_tmux_unref removes.
+	char *name = NULL;
+	r = bprintf(&name, "/wtc-bench-%d", getpid());
+	if (r >= 0)
+		r = wtc_tmux_set_export_name(tmux, name);
+	free(name);
+	if (r < 0)
+		return r;
+
+	size_t off = 0;
+	layouts = malloc(LINES * 128);
+	if (!layouts)
+		return -ENOMEM;
+	for (int i = 0; i < 4 * LINES; i += 4)
+		off += sprintf(layouts + off, "b25d,159x48,0,0{39x48,0,0,%d,"
+		               "39x48,40,0,%d,39x48,80,0[39x24,80,0,%d,"
+		               "39x23,80,25,%d]}\n", i, i + 1, i + 2, i + 3);
+
+	return 0;
+}
+
+/*
+ * Build the headless output the layout benchmarks lay out. Pane i is in
+ * window i % LAYOUT_WINDOWS, and the first pane of each window is active.
+ */
+static int setup_layout(void)
+{
+	struct wtc_tmux_window *wind;
+	struct wtc_tmux_pane *pane;
+
+	lpanes = calloc(ENTRIES, sizeof(struct wtc_tmux_pane));
+	lrefs = calloc(ENTRIES, sizeof(struct wtc_tmux_pane_ref));
+	lviews = calloc(ENTRIES, sizeof(struct wtc_layout_view));
+	lres = calloc(ENTRIES, sizeof(struct wtc_layout_result));
+	if (!lpanes || !lrefs || !lviews || !lres)
+		return -ENOMEM;
+
+	for (int i = 0; i < LAYOUT_WINDOWS; ++i)
+		lwinds[i].id = i;
+
+	// Built back to front, so that each window's list is in id order
+	for (int i = ENTRIES - 1; i >= 0; --i) {
+		pane = &lpanes[i];
+		wind = &lwinds[i % LAYOUT_WINDOWS];
+		pane->id = lrefs[i].id = i;
+		pane->pid = 1000 + i;
+		pane->x = (i / LAYOUT_WINDOWS) % 8 * 20;
+		pane->y = (i / LAYOUT_WINDOWS) / 8 % 60;
+		pane->w = 20;
+		pane->h = 1;
+		pane->window = wind;
+		pane->next = wind->panes;
+		if (wind->panes)
+			wind->panes->previous = pane;
+		wind->panes = pane;
+		wind->active_pane = pane;
+	}
+	for (int i = 0; i < LAYOUT_WINDOWS; ++i)
+		lwinds[i].active_pane->active = true;
+
+	for (int i = 0; i < ENTRIES; ++i) {
+		struct wtc_layout_view *view = &lviews[i];
+		view->root = view->anchor = -1;
+		view->geom.w = 640;
+		view->geom.h = 480;
+		if (i % 8 == 7) {
+			view->root = view->anchor = i - 1;
+			view->offset.x = 8;
+			view->offset.y = 16;
+		} else {
+			view->pane = &lpanes[i];
+		}
+	}
+
+	lsess.statusbar = WTC_TMUX_SESSION_BOTTOM;
+	lclient.session = &lsess;
+	lout.client = &lclient;
+	lout.cell.w = 8;
+	lout.cell.h = 16;
+	show_layout_window(&lwinds[0]);
+	return 0;
+}
+
+/*
+ * Build a control mode stream of LINES lines, mixing output, notifications
+ * which don't trigger refreshes, and command replies.
+ */
+static int setup_stream(void)
+{
+	size_t off = 0;
+	stream = malloc(LINES * 64);
+	if (!stream)
+		return -ENOMEM;
+
+	for (int i = 0; i < LINES; i += 5) {
+		off += sprintf(stream + off, "%%output %%%d hello world\\015\\012\n"
+		               "%%window-renamed @%d bash\n"
+		               "%%begin 1500000000 %d 1\n"
+		               "%%%d\n"
+		               "%%end 1500000000 %d 1\n", i, i, i, i, i);
+	}
+
+	return 0;
+}
+
+static int setup_query(void)
+{
+	char *out;
+	int r;
+
+	if (pipe2(qfd, O_NONBLOCK | O_CLOEXEC) < 0)
+		return -errno;
+
+	qcc.tmux = tmux;
+	qcc.session = &lsess;
+	qcc.fout = qfd[0];
+	qcc.fin = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (qcc.fin < 0)
+		return -errno;
+
+	// Size qbuf, the command buffer and the ring.
+	tmux->ccs = &qcc;
+	r = write(qfd[1], QUERY_OK, strlen(QUERY_OK)) < 0 ? -errno :
+	    wtc_tmux_query(tmux, QUERY, &out);
+	tmux->ccs = NULL;
+	return r;
+}
+
+/*
+ * Build rtmux's model and start its server. The panes are loaded by the
+ * first refreshes, which also warm up everything on the way.
+ */
+static int setup_refresh(void)
+{
+	struct wtc_tmux_session *sess;
+	struct wtc_tmux_window *wind;
+	struct wtc_tmux_client *client;
+	int r;
+
+	if (pipe2(rcmd, O_CLOEXEC) < 0 ||
+	    pipe2(rreply, O_NONBLOCK | O_CLOEXEC) < 0 ||
+	    pipe2(rrefresh, O_NONBLOCK | O_CLOEXEC) < 0)
+		return -errno;
+
+	r = wtc_tmux_new(&rtmux);
+	if (r < 0)
+		return r;
+
+	rtmux->refreshfd = rrefresh[1];
+	rcc.tmux = rtmux;
+	rcc.fin = rcmd[1];
+	rcc.fout = rreply[0];
+	rtmux->ccs = &rcc;
+
+	rserver_fds[0] = rcmd[0];
+	rserver_fds[1] = rreply[1];
+	r = pthread_create(&rthread, NULL, rserver, rserver_fds);
+	if (r)
+		return -r;
+	rthread_started = true;
+
+	sess = calloc(1, sizeof(struct wtc_tmux_session));
+	wind = calloc(1, sizeof(struct wtc_tmux_window));
+	client = calloc(1, sizeof(struct wtc_tmux_client));
+	if (!sess || !wind || !client ||
+	    !(sess->windows = malloc(sizeof(struct wtc_tmux_window *))) ||
+	    wtc_tmux_window_link(wind, sess) < 0 ||
+	    !(client->name = wtc_tmux_intern(rtmux, "/dev/pts/0"))) {
+		wtc_tmux_session_free(sess);
+		wtc_tmux_window_free(wind);
+		free(client);
+		return -ENOMEM;
+	}
+
+	sess->windows[sess->window_count++] = wind;
+	sess->active_window = wind;
+	sess->clients = client;
+	client->session = sess;
+	HASH_ADD_INT(rtmux->sessions, id, sess);
+	HASH_ADD_INT(rtmux->windows, id, wind);
+	HASH_ADD_PTR(rtmux->clients, name, client);
+
+	wtc_tmux_set_client_visibility_changed_cb(rtmux, rvisibility_cb);
+	r = wtc_tmux_subscribe(rtmux, 0, rchange_cb, &rchanges);
+	for (int i = 0; i < 4 && r >= 0; ++i)
+		r = refresh_layout();
+	return r < 0 ? r : 0;
+}
+
+static int setup(void)
+{
+	for (size_t i = 0; i < sizeof(chunk); ++i)
+		chunk[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+
+	if (pipe2(pfd, O_NONBLOCK | O_CLOEXEC) < 0)
+		return -errno;
+	// Make sure a whole chunk fits in the pipe
+	fcntl(pfd[1], F_SETPIPE_SZ, 2 * sizeof(chunk));
+
+	int r = gen_lines("$%d %d\n", &lines_is);
+	if (r >= 0)
+		r = gen_lines("$%d @%d %d\n", &lines_iii);
+	if (r >= 0)
+		r = gen_lines("%%%d @%d 0 %d 0\n", &lines_iiiii);
+	if (r >= 0)
+		r = gen_lines("$%d @%d name-%d\n", &lines_iis);
+	if (r >= 0)
+		r = setup_model();
+	if (r >= 0)
+		r = setup_layout();
+	if (r >= 0)
+		r = setup_stream();
+	if (r >= 0)
+		r = setup_query();
+	if (r >= 0)
+		r = setup_refresh();
+	return r;
+}
+
+static void cleanup(void)
+{
+	if (tmux) {
+		wtc_tmux_clear_model(tmux);
+		wtc_tmux_unref(tmux);
+	}
+	for (int i = 0; i < ENTRIES; ++i)
+		free(client_names[i]);
+	HASH_CLEAR(hh, lclient.visible);
+	free(lpanes);
+	free(lrefs);
+	free(lviews);
+	free(lres);
+
+	free(ring.buf);
+	free(lines_is);
+	free(lines_iii);
+	free(lines_iiiii);
+	free(lines_iis);
+	free(layouts);
+	free(stream);
+	free(scratch);
+	free(ibuf);
+	if (pfd[0] >= 0) {
+		close(pfd[0]);
+		close(pfd[1]);
+	}
+	if (qfd[0] >= 0) {
+		close(qfd[0]);
+		close(qfd[1]);
+	}
+	if (qcc.fin > 0)
+		close(qcc.fin);
+	free(qcc.buf.buf);
+
+	if (rtmux) {
+		rtmux->ccs = NULL;
+		wtc_tmux_clear_model(rtmux);
+		wtc_tmux_unref(rtmux);
+	}
+	// The server stops once its commands are closed.
+	if (rcmd[1] >= 0)
+		close(rcmd[1]);
+	if (rthread_started)
+		pthread_join(rthread, NULL);
+	if (rcmd[0] >= 0)
+		close(rcmd[0]);
+	if (rreply[0] >= 0) {
+		close(rreply[0]);
+		close(rreply[1]);
+	}
+	if (rrefresh[0] >= 0) {
+		close(rrefresh[0]);
+		close(rrefresh[1]);
+	}
+	free(rcc.buf.buf);
+}
+
+/*
+ * Time b, returning the best nanoseconds per operation over SAMPLES
+ * samples, or a negative error code.
+ */
+static double measure(const struct bench *b)
+{
+	size_t n = 1;
+	double t, best = -1;
+	int r;
+
+	// Find an n for which a sample takes at least SAMPLE_MS
+	while (true) {
+		t = now_ms();
+		r = b->fn(n);
+		t = now_ms() - t;
+		if (r < 0)
+			return r;
+		if (t >= SAMPLE_MS)
+			break;
+		n *= t > 1 ? (size_t) (SAMPLE_MS / t) + 1 : 10;
+	}
+
+	for (int i = 0; i < SAMPLES; ++i) {
+		t = now_ms();
+		r = b->fn(n);
+		t = now_ms() - t;
+		if (r < 0)
+			return r;
+		if (best < 0 || t < best)
+			best = t;
+	}
+
+	return best * 1e6 / n;
+}
+
+/*
+ * Look up name in the baseline file. Returns the baseline time, or a
+ * negative value if there is none.
+ */
+static double baseline_lookup(FILE *base, const char *name)
+{
+	char bname[128];
+	double val;
+
+	rewind(base);
+	while (fscanf(base, "%127s %lf", bname, &val) == 2)
+		if (!strcmp(bname, name))
+			return val;
+
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *out = stdout;
+	FILE *base = NULL;
+	double tolerance = 25;
+	const char *filter = NULL;
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:c:t:")) != -1) {
+		switch (opt) {
+		case 'o':
+			out = fopen(optarg, "w");
+			if (!out) {
+				fprintf(stderr, "bench: Couldn't open %s!\n", optarg);
+				return 2;
+			}
+			break;
+		case 'c':
+			base = fopen(optarg, "r");
+			if (!base) {
+				fprintf(stderr, "bench: Couldn't open %s!\n", optarg);
+				return 2;
+			}
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-o output] [-c baseline] "
+			                "[-t tolerance] [filter]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	// wtc logs everything to stdout; keep that out of the results.
+	if (out == stdout) {
+		int fd = dup(STDOUT_FILENO);
+		out = fd < 0 ? NULL : fdopen(fd, "w");
+		if (!out) {
+			fprintf(stderr, "bench: Couldn't duplicate stdout!\n");
+			return 2;
+		}
+	}
+	if (!freopen("/dev/null", "w", stdout)) {
+		fprintf(stderr, "bench: Couldn't silence stdout!\n");
+		return 2;
+	}
+
+	int r = setup();
+	if (r < 0) {
+		fprintf(stderr, "bench: Setup failed: %d\n", r);
+		cleanup();
+		return 2;
+	}
+
+	for (size_t i = 0; i < BENCHES_LEN; ++i) {
+		const struct bench *b = &BENCHES[i];
+		if (filter && !strstr(b->name, filter))
+			continue;
+
+		double ns = measure(b);
+		if (ns < 0) {
+			fprintf(stderr, "bench: %s failed: %d\n", b->name, (int) ns);
+			failed = 1;
+			continue;
+		}
+
+		fprintf(out, "%s %.1f\n", b->name, ns);
+		fflush(out);
+		if (!base)
+			continue;
+
+		double bns = baseline_lookup(base, b->name);
+		if (bns <= 0) {
+			fprintf(stderr, "%-28s %10.1f ns (no baseline)\n", b->name,
+			        ns);
+			continue;
+		}
+
+		double pct = (ns - bns) * 100 / bns;
+		bool regressed = pct > tolerance;
+		fprintf(stderr, "%-28s %10.1f ns %+7.1f%%%s\n", b->name, ns, pct,
+		        regressed ? "  REGRESSION" : "");
+		failed |= regressed;
+	}
+
+	cleanup();
+	if (base)
+		fclose(base);
+	fclose(out);
+	return failed;
+}
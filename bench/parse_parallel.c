@@ -0,0 +1,247 @@
+/*
+ * wtc - parse_parallel.c
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measures how decoding the replies of a very large tmux server scales with
+ * the number of decode workers. The list-panes and list-windows layout
+ * output of a server with PANES panes (four per window) is generated, then
+ * decoded with 1, 2, 4, and 8 workers. Each result is checked against the
+ * single worker decode, and the best of RUNS times is reported.
+ */
+
+#include "tmux_internal.h"
+
+#include "util.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PANES 100000
+#define RUNS 10
+#define PANE_FMT "%%%u @%u %u %u %u%n"
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Generate the output of list-panes (panes) or of list-windows for the
+ * layouts (!panes) into a newly allocated *out.
+ */
+static int gen_output(bool panes, char **out)
+{
+	size_t len = PANES * 96;
+	size_t off = 0;
+	char *str = malloc(len);
+	if (!str)
+		return -ENOMEM;
+
+	for (int i = 0; i < PANES; i += panes ? 1 : 4) {
+		if (panes)
+			off += sprintf(str + off, "%%%d @%d %d %d 0\n", i, i / 4,
+			               i % 4 == 0, 10000 + i);
+		else
+			off += sprintf(str + off, "b25d,159x48,0,0{39x48,0,0,%d,"
+			               "39x48,40,0,%d,39x48,80,0[39x24,80,0,%d,"
+			               "39x23,80,25,%d]}\n", i, i + 1, i + 2, i + 3);
+	}
+
+	*out = str;
+	return 0;
+}
+
+static int add_panes(struct wtc_tmux *tmux)
+{
+	struct wtc_tmux_pane *pane;
+	for (int i = 0; i < PANES; ++i) {
+		pane = calloc(1, sizeof(struct wtc_tmux_pane));
+		if (!pane)
+			return -ENOMEM;
+
+		pane->id = i;
+		pane->pid = 10000 + i;
+		HASH_ADD_INT(tmux->panes, id, pane);
+	}
+
+	return 0;
+}
+
+/*
+ * Decode the pane listing in src with the given number of workers. If
+ * check is set, the parsed columns are compared against ref (the single
+ * worker result); otherwise they are stored in it. Returns the best time
+ * in milliseconds, or a negative error.
+ */
+static double bench_panes(const char *src, size_t len, int workers,
+                          int *ref, bool check, int **buf, size_t *cap)
+{
+	char *str = malloc(len + 1);
+	int *is, *is2, *is3, *is4, *is5;
+	int count;
+	double best = -1;
+
+	if (!str)
+		return -ENOMEM;
+
+	for (int i = 0; i < RUNS; ++i) {
+		memcpy(str, src, len + 1);
+		double st = now_ms();
+		int r = parselniiiii_buf(PANE_FMT, str, workers, buf, cap, &count,
+		                         &is, &is2, &is3, &is4, &is5);
+		double t = now_ms() - st;
+		if (r < 0 || count != PANES) {
+			free(str);
+			return r < 0 ? r : -EINVAL;
+		}
+
+		if (best < 0 || t < best)
+			best = t;
+	}
+
+	int *cols[] = { is, is2, is3, is4, is5 };
+	for (int i = 0; i < 5; ++i) {
+		if (!check)
+			memcpy(ref + i * PANES, cols[i], PANES * sizeof(int));
+		else if (memcmp(ref + i * PANES, cols[i], PANES * sizeof(int)))
+			best = -EINVAL;
+	}
+
+	free(str);
+	return best;
+}
+
+static double bench_layouts(struct wtc_tmux *tmux, const char *src,
+                            size_t len)
+{
+	struct wtc_tmux_pane *pane;
+	char *str = malloc(len + 1);
+	double best = -1;
+
+	if (!str)
+		return -ENOMEM;
+
+	for (int i = 0; i < RUNS; ++i) {
+		for (pane = tmux->panes; pane; pane = pane->hh.next)
+			pane->w = pane->h = 0;
+
+		memcpy(str, src, len + 1);
+		double st = now_ms();
+		int r = wtc_tmux_decode_layouts(tmux, str);
+		double t = now_ms() - st;
+		wtc_tmux_clear_closures(tmux);
+
+		for (pane = tmux->panes; pane; pane = pane->hh.next) {
+			if (pane->pid < 0)
+				pane->pid *= -1;
+			else
+				r = -EINVAL; // Not every pane was found
+
+			if (pane->w != 39 || (pane->h != 48 && pane->id % 4 < 2))
+				r = -EINVAL;
+		}
+
+		if (r < 0) {
+			free(str);
+			return r;
+		}
+
+		if (best < 0 || t < best)
+			best = t;
+	}
+
+	free(str);
+	return best;
+}
+
+int main(void)
+{
+	static const int workers[] = { 1, 2, 4, 8 };
+	struct wtc_tmux *tmux;
+	char *panes = NULL, *layouts = NULL;
+	int *buf = NULL;
+	int *ref = malloc(5 * PANES * sizeof(int));
+	size_t cap = 0;
+	double base_p = 0, base_l = 0;
+	int r;
+
+	if (!ref) {
+		r = -ENOMEM;
+		goto err_gen;
+	}
+	r = gen_output(true, &panes);
+	if (r < 0)
+		goto err_gen;
+	r = gen_output(false, &layouts);
+	if (r < 0)
+		goto err_gen;
+
+	r = wtc_tmux_new(&tmux);
+	if (r < 0)
+		goto err_gen;
+	r = add_panes(tmux);
+	if (r < 0)
+		goto err_tmux;
+
+	printf("%d panes, best of %d runs\n", PANES, RUNS);
+	printf("%-8s %12s %8s %12s %8s\n", "workers", "panes (ms)", "speedup",
+	       "layout (ms)", "speedup");
+	for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i) {
+		tmux->workers = workers[i];
+		double p = bench_panes(panes, strlen(panes), workers[i], ref,
+		                       i > 0, &buf, &cap);
+		double l = bench_layouts(tmux, layouts, strlen(layouts));
+		if (p < 0 || l < 0) {
+			fprintf(stderr, "parse_parallel: %d workers failed!\n",
+			        workers[i]);
+			r = -EINVAL;
+			goto err_tmux;
+		}
+
+		if (i == 0) {
+			base_p = p;
+			base_l = l;
+		}
+
+		printf("%-8d %12.2f %7.2fx %12.2f %7.2fx\n", workers[i], p,
+		       base_p / p, l, base_l / l);
+	}
+
+err_tmux:
+	wtc_tmux_clear_model(tmux);
+	wtc_tmux_unref(tmux);
+	free(buf);
+err_gen:
+	free(ref);
+	free(panes);
+	free(layouts);
+	return r < 0;
+}
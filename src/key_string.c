@@ -33,6 +33,7 @@
 #include "log.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -76,6 +77,10 @@ static enum utf8_state utf8_combine(const struct utf8_data *ud,
 
 static key_code key_string_search_table(const char *);
 static key_code key_string_get_modifiers(const char **);
+static key_code key_string_fold_ctrl(key_code);
+
+/* Keys which keep the control modifier instead of being folded. */
+static const char *key_string_ctrl_other = "!#()+,-.0123456789:;<=>?'\r\t";
 
 static const struct {
 	const char     *string;
@@ -201,11 +206,28 @@ key_string_get_modifiers(const char **string)
 	return (modifiers);
 }
 
+/*
+ * Convert a key with the control modifier into the matching control
+ * character. Returns KEYC_UNKNOWN if there is no such character.
+ */
+static key_code
+key_string_fold_ctrl(key_code key)
+{
+	if (key >= 97 && key <= 122)
+		return (key - 96);
+	if (key >= 64 && key <= 95)
+		return (key - 64);
+	if (key == 32)
+		return (0);
+	if (key == 63)
+		return (KEYC_BSPACE);
+	return (KEYC_UNKNOWN);
+}
+
 /* Lookup a string and convert to a key value. */
 key_code
 key_string_lookup_string(const char *string)
 {
-	static const char	*other = "!#()+,-.0123456789:;<=>?'\r\t";
 	key_code		 key;
 	u_int			 u;
 	key_code		 modifiers;
@@ -263,16 +285,10 @@ key_string_lookup_string(const char *string)
 	}
 
 	/* Convert the standard control keys. */
-	if (key < KEYC_BASE && (modifiers & KEYC_CTRL) && !strchr(other, key)) {
-		if (key >= 97 && key <= 122)
-			key -= 96;
-		else if (key >= 64 && key <= 95)
-			key -= 64;
-		else if (key == 32)
-			key = 0;
-		else if (key == 63)
-			key = KEYC_BSPACE;
-		else
+	if (key < KEYC_BASE && (modifiers & KEYC_CTRL) &&
+	    !strchr(key_string_ctrl_other, key)) {
+		key = key_string_fold_ctrl(key);
+		if (key == KEYC_UNKNOWN)
 			return (KEYC_UNKNOWN);
 		modifiers &= ~KEYC_CTRL;
 	}
@@ -386,91 +402,108 @@ utf8_combine(const struct utf8_data *ud, wchar_t *wc)
 	}
 }
 
-key_code key_code_from_xkb_key_char(uint32_t key, uint32_t chr)
+/*
+ * Translation table for the keysyms in the 0xff00 page (the function,
+ * cursor, and keypad keys). These keysyms don't depend on the active
+ * keymap, so the table can be built at compile time. A 0 entry means the
+ * key has no special tmux key code and the character it produces should be
+ * used instead.
+ */
+#define XKB_PAGE_BASE 0xff00
+#define XKB_PAGE(k) ((k) - XKB_PAGE_BASE)
+static const key_code xkb_page_table[0x100] = {
+	[XKB_PAGE(XKB_KEY_BackSpace)]   = KEYC_BSPACE,
+	[XKB_PAGE(XKB_KEY_Tab)]         = '\011',
+	[XKB_PAGE(XKB_KEY_Return)]      = '\r',
+	[XKB_PAGE(XKB_KEY_Escape)]      = '\033',
+	[XKB_PAGE(XKB_KEY_Delete)]      = KEYC_DC,
+
+	[XKB_PAGE(XKB_KEY_F1)]          = KEYC_F1,
+	[XKB_PAGE(XKB_KEY_F2)]          = KEYC_F2,
+	[XKB_PAGE(XKB_KEY_F3)]          = KEYC_F3,
+	[XKB_PAGE(XKB_KEY_F4)]          = KEYC_F4,
+	[XKB_PAGE(XKB_KEY_F5)]          = KEYC_F5,
+	[XKB_PAGE(XKB_KEY_F6)]          = KEYC_F6,
+	[XKB_PAGE(XKB_KEY_F7)]          = KEYC_F7,
+	[XKB_PAGE(XKB_KEY_F8)]          = KEYC_F8,
+	[XKB_PAGE(XKB_KEY_F9)]          = KEYC_F9,
+	[XKB_PAGE(XKB_KEY_F10)]         = KEYC_F10,
+	[XKB_PAGE(XKB_KEY_F11)]         = KEYC_F11,
+	[XKB_PAGE(XKB_KEY_F12)]         = KEYC_F12,
+	[XKB_PAGE(XKB_KEY_Insert)]      = KEYC_IC,
+	[XKB_PAGE(XKB_KEY_Home)]        = KEYC_HOME,
+	[XKB_PAGE(XKB_KEY_End)]         = KEYC_END,
+	[XKB_PAGE(XKB_KEY_Page_Down)]   = KEYC_NPAGE,
+	[XKB_PAGE(XKB_KEY_Page_Up)]     = KEYC_PPAGE,
+
+	[XKB_PAGE(XKB_KEY_Up)]          = KEYC_UP,
+	[XKB_PAGE(XKB_KEY_Down)]        = KEYC_DOWN,
+	[XKB_PAGE(XKB_KEY_Left)]        = KEYC_LEFT,
+	[XKB_PAGE(XKB_KEY_Right)]       = KEYC_RIGHT,
+
+	[XKB_PAGE(XKB_KEY_KP_Divide)]   = KEYC_KP_SLASH,
+	[XKB_PAGE(XKB_KEY_KP_Multiply)] = KEYC_KP_STAR,
+	[XKB_PAGE(XKB_KEY_KP_Subtract)] = KEYC_KP_MINUS,
+	[XKB_PAGE(XKB_KEY_KP_7)]        = KEYC_KP_SEVEN,
+	[XKB_PAGE(XKB_KEY_KP_8)]        = KEYC_KP_EIGHT,
+	[XKB_PAGE(XKB_KEY_KP_9)]        = KEYC_KP_NINE,
+	[XKB_PAGE(XKB_KEY_KP_Add)]      = KEYC_KP_PLUS,
+	[XKB_PAGE(XKB_KEY_KP_4)]        = KEYC_KP_FOUR,
+	[XKB_PAGE(XKB_KEY_KP_5)]        = KEYC_KP_FIVE,
+	[XKB_PAGE(XKB_KEY_KP_6)]        = KEYC_KP_SIX,
+	[XKB_PAGE(XKB_KEY_KP_1)]        = KEYC_KP_ONE,
+	[XKB_PAGE(XKB_KEY_KP_2)]        = KEYC_KP_TWO,
+	[XKB_PAGE(XKB_KEY_KP_3)]        = KEYC_KP_THREE,
+	[XKB_PAGE(XKB_KEY_KP_Enter)]    = KEYC_KP_ENTER,
+	[XKB_PAGE(XKB_KEY_KP_0)]        = KEYC_KP_ZERO,
+	[XKB_PAGE(XKB_KEY_KP_Decimal)]  = KEYC_KP_PERIOD,
+};
+
+key_code key_code_from_xkb_key_char(uint32_t key, uint32_t chr,
+                                    key_code mods)
 {
-	// I wish there was a better way :(
-	switch (key) {
-	case XKB_KEY_BackSpace:
-		return KEYC_BSPACE;
-
-	case XKB_KEY_F1:
-		return KEYC_F1;
-	case XKB_KEY_F2:
-		return KEYC_F2;
-	case XKB_KEY_F3:
-		return KEYC_F3;
-	case XKB_KEY_F4:
-		return KEYC_F4;
-	case XKB_KEY_F5:
-		return KEYC_F5;
-	case XKB_KEY_F6:
-		return KEYC_F6;
-	case XKB_KEY_F7:
-		return KEYC_F7;
-	case XKB_KEY_F8:
-		return KEYC_F8;
-	case XKB_KEY_F9:
-		return KEYC_F9;
-	case XKB_KEY_F10:
-		return KEYC_F10;
-	case XKB_KEY_F11:
-		return KEYC_F11;
-	case XKB_KEY_F12:
-		return KEYC_F12;
-	case XKB_KEY_Insert:
-		return KEYC_IC;
-	case XKB_KEY_Home:
-		return KEYC_HOME;
-	case XKB_KEY_End:
-		return KEYC_END;
-	case XKB_KEY_Page_Down:
-		return KEYC_NPAGE;
-	case XKB_KEY_Page_Up:
-		return KEYC_PPAGE;
-	case XKB_KEY_BackTab:
-		return KEYC_BTAB;
-
-	case XKB_KEY_Up:
-		return KEYC_UP;
-	case XKB_KEY_Down:
-		return KEYC_DOWN;
-	case XKB_KEY_Left:
-		return KEYC_LEFT;
-	case XKB_KEY_Right:
-		return KEYC_RIGHT;
-
-	case XKB_KEY_KP_Divide:
-		return KEYC_KP_SLASH;
-	case XKB_KEY_KP_Multiply:
-		return KEYC_KP_STAR;
-	case XKB_KEY_KP_Subtract:
-		return KEYC_KP_MINUS;
-	case XKB_KEY_KP_7:
-		return KEYC_KP_SEVEN;
-	case XKB_KEY_KP_8:
-		return KEYC_KP_EIGHT;
-	case XKB_KEY_KP_9:
-		return KEYC_KP_NINE;
-	case XKB_KEY_KP_4:
-		return KEYC_KP_FOUR;
-	case XKB_KEY_KP_5:
-		return KEYC_KP_FIVE;
-	case XKB_KEY_KP_6:
-		return KEYC_KP_SIX;
-	case XKB_KEY_KP_1:
-		return KEYC_KP_ONE;
-	case XKB_KEY_KP_2:
-		return KEYC_KP_TWO;
-	case XKB_KEY_KP_3:
-		return KEYC_KP_THREE;
-	case XKB_KEY_KP_0:
-		return KEYC_KP_ZERO;
-	case XKB_KEY_KP_Decimal:
-		return KEYC_KP_PERIOD;
+	key_code code = 0;
+	bool from_table = false;
 
-	default:
-		if (chr)
-			return chr == 0x08 ? KEYC_BSPACE : chr;
-		return KEYC_UNKNOWN;
+	if (key >= XKB_PAGE_BASE && key <= XKB_PAGE_BASE + 0xff) {
+		code = xkb_page_table[XKB_PAGE(key)];
+		from_table = code != 0;
+	}
+	else if (key == XKB_KEY_ISO_Left_Tab || key == XKB_KEY_BackTab) {
+		code = KEYC_BTAB;
+		mods &= ~KEYC_SHIFT; // Shift is implied by the key.
+	}
+
+	if (!code) {
+		// Some combinations (e.g., C-Space) produce a NUL character, so
+		// fall back to the keysym, which matches ASCII in this range.
+		if (!chr && key >= XKB_KEY_space && key <= XKB_KEY_asciitilde)
+			chr = key;
+		else if (!chr)
+			return KEYC_UNKNOWN;
+		code = chr;
+
+		// Shift has already been applied to the character.
+		mods &= ~KEYC_SHIFT;
 	}
+
+	// Fold the control modifier the same way key_string_lookup_string
+	// does so that the result matches the parsed bindings. If xkb already
+	// produced a control character, there's nothing left to fold. The
+	// control characters in the table (Tab, Enter and Escape) are the keys
+	// themselves, so they go through the same rules as "C-Tab" and the
+	// like do.
+	if (code < KEYC_BASE && (mods & KEYC_CTRL)) {
+		if (!from_table && (code < 32 || code == 127)) {
+			mods &= ~KEYC_CTRL;
+		} else if (!strchr(key_string_ctrl_other, code)) {
+			key_code folded = key_string_fold_ctrl(code);
+			if (folded != KEYC_UNKNOWN) {
+				code = folded;
+				mods &= ~KEYC_CTRL;
+			}
+		}
+	}
+
+	return code | mods;
 }
@@ -0,0 +1,133 @@
+/*
+ * wtc - layout.c
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "layout.h"
+
+int wtc_layout_visible(const struct wtc_layout_output *out,
+                       const struct wtc_layout_view *views, size_t i)
+{
+	const struct wtc_layout_view *view = &views[i];
+
+	// Positioned views are shown along with the pane view they belong to
+	if (view->root >= 0) {
+		view = &views[view->root];
+		if (view->root >= 0)
+			return -1;
+	}
+
+	if (!out->client || !view->pane)
+		return -1;
+
+	return wtc_tmux_pane_visible(out->client, view->pane);
+}
+
+/*
+ * Where tmux has pane, in the output's terminal.
+ */
+static struct wtc_layout_rect pane_rect(const struct wtc_layout_output *out,
+                                        const struct wtc_tmux_pane *pane)
+{
+	int offset = out->client->session->statusbar == WTC_TMUX_SESSION_TOP
+	              ? 1 : 0;
+	struct wtc_layout_rect g = {
+		.x = out->cell.x + out->cell.w * pane->x,
+		.y = out->cell.y + out->cell.h * (pane->y + offset),
+		.w = out->cell.w * pane->w,
+		.h = out->cell.h * pane->h,
+	};
+	return g;
+}
+
+/*
+ * Where a positioned view goes: at its offset from its anchor (as it will
+ * be once its own decision, if already made, is applied).
+ */
+static struct wtc_layout_rect anchor_rect(const struct wtc_layout_view *views,
+                                          size_t i,
+                                          const struct wtc_layout_result *res)
+{
+	const struct wtc_layout_view *view = &views[i];
+	const struct wtc_layout_rect *pg = &views[view->anchor].geom;
+	if ((size_t) view->anchor < i && res[view->anchor].action == WTC_LAYOUT_SHOW)
+		pg = &res[view->anchor].geom;
+
+	struct wtc_layout_rect g = {
+		.x = pg->x + view->offset.x,
+		.y = pg->y + view->offset.y,
+		.w = view->offset.w,
+		.h = view->offset.h,
+	};
+	if (g.w <= 0 || g.h <= 0) {
+		g.w = view->geom.w;
+		g.h = view->geom.h;
+	}
+	return g;
+}
+
+bool wtc_layout_place(const struct wtc_layout_output *out,
+                      const struct wtc_layout_view *views, size_t count,
+                      struct wtc_layout_result *res)
+{
+	const struct wtc_tmux_window *active = NULL;
+	const struct wtc_layout_view *view;
+	bool found = false;
+
+	if (out->client)
+		active = out->client->session->active_window;
+
+	for (size_t i = 0; i < count; ++i) {
+		view = &views[i];
+		res[i].vis = wtc_layout_visible(out, views, i);
+		res[i].action = WTC_LAYOUT_KEEP;
+		res[i].focus = false;
+		res[i].geom = view->geom;
+		if (view->fixed)
+			continue;
+
+		if (view->pane && view->root < 0 &&
+		    view->pane->window == active && view->pane->active) {
+			// N.B. This counts an error as visible.
+			found = res[i].vis != 0;
+		}
+
+		if (res[i].vis == 0) {
+			res[i].action = WTC_LAYOUT_HIDE;
+			continue;
+		}
+		if (res[i].vis < 0)
+			continue;
+
+		if (view->anchor >= 0) {
+			res[i].geom = anchor_rect(views, i, res);
+			res[i].action = WTC_LAYOUT_SHOW;
+		} else if (view->pane) {
+			res[i].geom = pane_rect(out, view->pane);
+			res[i].action = WTC_LAYOUT_SHOW;
+			res[i].focus = view->pane->active;
+		}
+	}
+
+	return found;
+}
@@ -0,0 +1,116 @@
+/*
+ * wtc - layout.h
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * wtc - Layout Engine
+ *
+ * Decides where the views of an output go, based on the tmux model alone.
+ * The compositor describes each view (the pane it shows, the view it is
+ * positioned relative to, its current geometry) and the engine says
+ * whether to show it, hide it or leave it be, at what geometry, and
+ * whether it should take the focus. Applying the decisions is left to the
+ * caller, so the engine runs (and can be measured) without a compositor.
+ */
+
+#ifndef WTC_LAYOUT_H
+#define WTC_LAYOUT_H
+
+#include "tmux.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct wtc_layout_rect {
+	int x, y;
+	int w, h;
+};
+
+/*
+ * The output being laid out. client is the tmux client on display (NULL if
+ * it isn't known yet) and cell is the position and size of the top left
+ * grid square of its terminal.
+ */
+struct wtc_layout_output {
+	const struct wtc_tmux_client *client;
+	struct wtc_layout_rect cell;
+};
+
+/*
+ * A view on the output. References to other views are indices into the
+ * same array, or -1 for none.
+ *
+ * pane is the tmux pane the view shows, if any. root is the view which
+ * decides the visibility of this one (the pane view at the top of a tree
+ * of popups). anchor is the view this one is positioned relative to:
+ * offset.x and offset.y give the position relative to the anchor's origin,
+ * and offset.w and offset.h the requested size (non-positive to keep the
+ * current size). geom is the current geometry.
+ *
+ * A fixed view is only there to be referred to; no decision is made for it.
+ */
+struct wtc_layout_view {
+	const struct wtc_tmux_pane *pane;
+	int root;
+	int anchor;
+	struct wtc_layout_rect offset;
+	struct wtc_layout_rect geom;
+	bool fixed;
+};
+
+#define WTC_LAYOUT_KEEP 0
+#define WTC_LAYOUT_HIDE 1
+#define WTC_LAYOUT_SHOW 2
+
+/*
+ * The decision for a view. vis is as wtc_layout_visible. action is one of
+ * WTC_LAYOUT_KEEP, WTC_LAYOUT_HIDE, or WTC_LAYOUT_SHOW, in which case the
+ * view goes at geom. If focus is set, the view should be focused once it
+ * is shown; decisions are meant to be applied in order.
+ */
+struct wtc_layout_result {
+	int vis;
+	int action;
+	bool focus;
+	struct wtc_layout_rect geom;
+};
+
+/*
+ * Based on the current tmux state, should view i be displayed? Returns 1
+ * if yes, 0 if no. If there is missing information, returns -1.
+ */
+int wtc_layout_visible(const struct wtc_layout_output *out,
+                       const struct wtc_layout_view *views, size_t i);
+
+/*
+ * Decide the placement of count views, filling in one result per view.
+ * Returns true if one of the views shows the active pane of the client's
+ * session and isn't known to be hidden (so the terminal shouldn't take
+ * the focus).
+ */
+bool wtc_layout_place(const struct wtc_layout_output *out,
+                      const struct wtc_layout_view *views, size_t count,
+                      struct wtc_layout_result *res);
+
+#endif // !WTC_LAYOUT_H
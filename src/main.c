@@ -23,22 +23,44 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
+#include "layout.h"
 #include "log.h"
 #include "shl_ring.h"
+#include "stats.h"
+#include "thumbnail.h"
 #include "tmux.h"
 #include "util.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <wayland-server-core.h>
 #include <wlc/wlc.h>
 
 static struct wtc_tmux *tmux;
+// Run for every view a client opens and closes, so compiled up front.
+static struct wtc_tmux_cmd *split_cmd;
+static struct wtc_tmux_cmd *kill_cmd;
+
+// Set in the environment of the upgraded process to the handover state fd.
+#define WTC_HANDOVER_ENV "WTC_TMUX_HANDOVER_FD"
+
+// SIGUSR1 requests a dump of the frame and session statistics to the log.
+static int statspipe[2];
+
+// SIGUSR2 requests an upgrade (i.e., re-exec'ing ourselves).
+static int upgradepipe[2];
+static bool upgrade;
+static char exe_path[PATH_MAX];
 
 struct wtc_output {
 	struct wlc_event_source *create_timer;
@@ -52,16 +74,125 @@ struct wtc_output {
 	int term_x, term_y, term_w, term_h;
 
 	const struct wtc_tmux_client *client;
-	char *table_name;
-	int tnlen;
+	/* The client's current key table. NULL means the root table. */
+	const struct wtc_tmux_key_table *table;
+
+	/*
+	 * Set when the focus has been moved ahead of tmux for a pane
+	 * navigation binding. If tmux hasn't confirmed the move by the time
+	 * focus_timer fires, the focus is restored from tmux's state.
+	 */
+	bool focus_predicted;
+	struct wlc_event_source *focus_timer;
+
+	/*
+	 * Snapshots of the windows this output has shown. shown_window is the
+	 * id of the window on display (-1 if none). The pixels can only be read
+	 * from the render callback, so a window switch is held for one frame
+	 * (switch_pending) while the outgoing window is captured. The shown
+	 * window is also retaken when the switcher opens (capture_shown).
+	 */
+	struct wtc_thumbs thumbs;
+	int shown_window;
+	bool switch_pending;
+	bool capture_shown;
+
+	/* Whether the window switcher is open, and its selected window. */
+	bool switcher;
+	int switcher_sel;
+
+	/* How frames are keeping up with tmux. Dumped on SIGUSR1. */
+	struct wtc_frame_stats stats;
+
+	/*
+	 * When the output goes away, its terminal is kept running and the
+	 * output data is parked in the pool under the output's name, along
+	 * with the views that were on it and the name of its tmux client.
+	 * An output with the same name picks it back up.
+	 */
+	char *name;
+	char *client_name;
+	wlc_handle *parked_views;
+	size_t parked_len;
+	UT_hash_handle hh;
 };
 
+static struct wtc_output *parked;
+static bool terminating;
+
+// How long to wait for tmux to confirm a predicted focus change (ms)
+#define FOCUS_PREDICT_TIMEOUT 500
+
+// The most windows the switcher will show
+#define SWITCHER_MAX 64
+
 struct wtc_view {
+	wlc_handle view;
 	pid_t pane_pid;
 	const struct wtc_tmux_pane *pane;
+
+	/*
+	 * Positioned views (popups, menus, tooltips) hang off the view they
+	 * are anchored to, so that moving or hiding a view takes its children
+	 * along.
+	 */
+	struct wtc_view *parent;
+	struct wtc_view *children;
+	struct wtc_view *previous;
+	struct wtc_view *next;
 };
 
-static void reposition_view(wlc_handle view);
+static int reposition_view(wlc_handle view);
+static void reposition_output(wlc_handle output);
+static int is_visible(wlc_handle view);
+static bool switcher_key(wlc_handle view, const struct wlc_modifiers *mods,
+                         uint32_t sym, enum wlc_key_state state);
+void wlc_out_render_post(wlc_handle output);
+
+static void link_child(struct wtc_view *parent, struct wtc_view *child)
+{
+	child->parent = parent;
+	child->previous = NULL;
+	child->next = parent->children;
+	if (parent->children)
+		parent->children->previous = child;
+	parent->children = child;
+}
+
+static void unlink_child(struct wtc_view *child)
+{
+	if (!child->parent)
+		return;
+
+	if (child->previous)
+		child->previous->next = child->next;
+	else
+		child->parent->children = child->next;
+	if (child->next)
+		child->next->previous = child->previous;
+
+	child->parent = NULL;
+	child->previous = NULL;
+	child->next = NULL;
+}
+
+/*
+ * Detach and hide the children of a view which is going away. They can't
+ * be shown without their anchor, and their own destruction frees them.
+ */
+static void orphan_children(struct wtc_view *vud)
+{
+	struct wtc_view *child, *next;
+	for (child = vud->children; child; child = next) {
+		next = child->next;
+		child->parent = NULL;
+		child->previous = NULL;
+		child->next = NULL;
+		wlc_view_set_mask(child->view, 0);
+	}
+
+	vud->children = NULL;
+}
 
 static void wlc_log(enum wlc_log_type type, const char *str)
 {
@@ -80,28 +211,6 @@ static void wlc_log(enum wlc_log_type type, const char *str)
 	}
 }
 
-static int set_table_name(struct wtc_output *op, const char *name)
-{
-	int len;
-
-	if (!op || !name)
-		return -EINVAL;
-
-	len = strlen(name);
-	if (len > op->tnlen) {
-		char *tmp = realloc(op->table_name, (len + 1) * sizeof(char));
-		if (!tmp) {
-			crit("set_table_name: Could not resize table_name!");
-			return -ENOMEM;
-		}
-		op->table_name = tmp;
-		op->tnlen = len + 1;
-	}
-
-	strcpy(op->table_name, name);
-	return 0;
-}
-
 static const struct wtc_tmux_client *get_client(wlc_handle output)
 {
 	struct wtc_output *ud = wlc_handle_get_user_data(output);
@@ -297,6 +406,174 @@ err_pid:
 	return r;
 }
 
+static void show_term(wlc_handle view, wlc_handle output)
+{
+	const struct wlc_geometry g = {
+		.origin = {
+			.x = 0,
+			.y = 0,
+		},
+		.size = *wlc_output_get_virtual_resolution(output),
+	};
+
+	wlc_view_set_geometry(view, 0, &g);
+	wlc_view_set_mask(view, wlc_output_get_mask(output));
+	wlc_view_focus(view);
+}
+
+static void free_output(struct wtc_output *ud)
+{
+	if (ud->term_out)
+		wlc_event_source_remove(ud->term_out);
+
+	wtc_thumbs_clear(&ud->thumbs);
+	free(ud->name);
+	free(ud->client_name);
+	free(ud->parked_views);
+	free(ud);
+}
+
+/*
+ * Park the data of an output which is going away. Its views are hidden
+ * and remembered so they can be moved back when the output returns.
+ */
+static int park_output(wlc_handle output, struct wtc_output *ud)
+{
+	const wlc_handle *views;
+	struct wtc_output *old;
+	size_t vc;
+	int r = 0;
+
+	const char *name = wlc_output_get_name(output);
+	if (!name)
+		return -EINVAL;
+
+	HASH_FIND_STR(parked, name, old);
+	if (old)
+		return -EEXIST;
+
+	ud->name = strdup(name);
+	if (!ud->name)
+		return -ENOMEM;
+
+	if (ud->client) {
+		ud->client_name = strdup(ud->client->name);
+		if (!ud->client_name) {
+			r = -ENOMEM;
+			goto err_name;
+		}
+	}
+	ud->client = NULL;
+
+	views = wlc_output_get_views(output, &vc);
+	if (vc) {
+		ud->parked_views = malloc(vc * sizeof(wlc_handle));
+		if (!ud->parked_views) {
+			r = -ENOMEM;
+			goto err_client;
+		}
+		memcpy(ud->parked_views, views, vc * sizeof(wlc_handle));
+	}
+	ud->parked_len = vc;
+
+	for (size_t i = 0; i < vc; ++i)
+		wlc_view_set_mask(views[i], 0);
+
+	HASH_ADD_KEYPTR(hh, parked, ud->name, strlen(ud->name), ud);
+	info("park_output: Parked terminal of %s", name);
+
+	return 0;
+
+err_client:
+	free(ud->client_name);
+	ud->client_name = NULL;
+err_name:
+	free(ud->name);
+	ud->name = NULL;
+	return r;
+}
+
+/*
+ * Take the parked data for output, if there is any, and move its views
+ * over. Returns NULL if nothing is parked under the output's name.
+ */
+static struct wtc_output *unpark_output(wlc_handle output)
+{
+	struct wtc_output *ud;
+
+	const char *name = wlc_output_get_name(output);
+	if (!name)
+		return NULL;
+
+	HASH_FIND_STR(parked, name, ud);
+	if (!ud)
+		return NULL;
+
+	HASH_DEL(parked, ud);
+	wlc_handle_set_user_data(output, ud);
+
+	for (size_t i = 0; i < ud->parked_len; ++i)
+		wlc_view_set_output(ud->parked_views[i], output);
+	free(ud->parked_views);
+	ud->parked_views = NULL;
+	ud->parked_len = 0;
+
+	// The client may have gone in the meantime; get_client will search.
+	if (ud->client_name)
+		ud->client = wtc_tmux_lookup_client(tmux, ud->client_name);
+	free(ud->client_name);
+	ud->client_name = NULL;
+
+	ud->shown_window = -1;
+	// The time away isn't a frame interval.
+	ud->stats.last_frame = 0;
+	if (ud->term_view)
+		show_term(ud->term_view, output);
+
+	info("unpark_output: Reattached terminal to %s", name);
+	return ud;
+}
+
+/*
+ * Drop view from the parked outputs. If it was a parked terminal, the
+ * output data goes with it.
+ */
+static void forget_parked_view(wlc_handle view)
+{
+	struct wtc_output *ud, *tmp;
+	HASH_ITER(hh, parked, ud, tmp) {
+		if (ud->term_view == view) {
+			HASH_DEL(parked, ud);
+			free_output(ud);
+			return;
+		}
+
+		for (size_t i = 0; i < ud->parked_len; ++i) {
+			if (ud->parked_views[i] != view)
+				continue;
+
+			ud->parked_views[i] = ud->parked_views[--ud->parked_len];
+			return;
+		}
+	}
+}
+
+/*
+ * wlc is shutting down, so no output is coming back. The outputs destroyed
+ * from here on are freed rather than parked, and so is everything parked
+ * already, while the event loop is still around.
+ */
+void wlc_comp_term(void)
+{
+	struct wtc_output *ud, *tmp;
+
+	terminating = true;
+	HASH_ITER(hh, parked, ud, tmp) {
+		HASH_DEL(parked, ud);
+		free_output(ud);
+	}
+}
+
 bool wlc_view_cr(wlc_handle view)
 {
 	pid_t pid = wlc_view_get_pid(view);
@@ -308,65 +585,53 @@ bool wlc_view_cr(wlc_handle view)
 	struct wtc_output *ud = wlc_handle_get_user_data(vop);
 	if (ud && ud->term_pid == pid) {
 		ud->term_view = view;
-
-		const struct wlc_geometry g = {
-			.origin = {
-				.x = 0,
-				.y = 0,
-			},
-			.size = *wlc_output_get_virtual_resolution(vop),
-		};
-
-		wlc_view_set_geometry(view, 0, &g);
-		wlc_view_set_mask(view, wlc_output_get_mask(vop));
-		wlc_view_focus(view);
+		show_term(view, vop);
 	} else if (wlc_view_get_parent(view) && 
 	           wlc_view_positioner_get_anchor_rect(view)) {
+		wlc_handle parent = wlc_view_get_parent(view);
+		struct wtc_view *pvud = wlc_handle_get_user_data(parent);
+
+		// Popups of the terminal aren't tracked; it's always shown.
+		if (pvud) {
+			struct wtc_view *vud = calloc(1, sizeof(struct wtc_view));
+			if (!vud) {
+				crit("wlc_view_cr: Couldn't allocate view user data!");
+				return false;
+			}
+			vud->view = view;
+			link_child(pvud, vud);
+			wlc_handle_set_user_data(view, vud);
+		}
+
 		reposition_view(view);
 	} else {
-		const char *cmd[] = { "split-window", "-t", NULL, "-PF",
-		                      "#{pane_pid}", NULL, NULL };
 		const struct wtc_tmux_client *client;
-		char *dpane = NULL, *dcmd = NULL;
 		char *out = NULL;
 
 		client = get_client(vop);
-		if (!client)
-			return false;
-		if (bprintf(&dpane, "%%%d",
-		            client->session->active_window->active_pane->id))
-			return false;
-		if (bprintf(&dcmd, "echo \"PID: %u\"; sleep infinity", pid)) {
-			free(dpane);
+		if (!client || !client->session->active_window ||
+		    !client->session->active_window->active_pane)
 			return false;
-		}
-
-		cmd[2] = dpane;
-		cmd[5] = dcmd;
 
-		wtc_tmux_exec(tmux, cmd, &out, NULL);
-		if (!out) {
-			free(dcmd);
-			free(dpane);
+		wtc_tmux_cmd_exec(tmux, split_cmd, &out, NULL,
+		                  client->session->active_window->active_pane->id,
+		                  (int) pid);
+		if (!out)
 			return false;
-		}
 
 		struct wtc_view *vud = calloc(1, sizeof(struct wtc_view));
 		if (!vud) {
 			crit("wlc_view_cr: Couldn't allocate view user data!");
 			free(out);
-			free(dcmd);
-			free(dpane);
 			return false;
 		}
+		vud->view = view;
 		vud->pane_pid = atoi(out);
 		wlc_handle_set_user_data(view, vud);
 
 		wlc_view_set_mask(view, 0);
 
 		free(out);
-		free(dcmd);
-		free(dpane);
 	}
 
 	debug("New view: %p -- %p -- %d -- %d\n", view, vop, wlc_output_get_mask(vop), wlc_view_get_state(view));
@@ -379,11 +644,14 @@ void wlc_view_dr(wlc_handle view)
 	wlc_handle vop = wlc_view_get_output(view);
 	debug("View destroyed: %p -- %p\n", view, vop);
 
+	if (parked)
+		forget_parked_view(view);
+
 	if (!vop)
 		return;
 
 	struct wtc_output *oud = wlc_handle_get_user_data(vop);
-	if (oud->term_view == view) {
+	if (oud && oud->term_view == view) {
 		oud->term_pid = 0;
 		oud->term_view = 0;
 		// TODO we should probably have a better method of determining when
@@ -393,21 +661,18 @@ void wlc_view_dr(wlc_handle view)
 		shl_ring_pop(&(oud->term_buf), oud->term_buf.size);
 		launch_term(oud);
 	} else {
-		const char *cmd[] = { "kill-pane", "-t", NULL, NULL };
-		char *dyn = NULL;
 		struct wtc_view *vud = wlc_handle_get_user_data(view);
 		if (!vud)
 			return;
 
-		if (!vud->pane)
-			return;
+		orphan_children(vud);
+		unlink_child(vud);
+		wlc_handle_set_user_data(view, NULL);
 
-		if (bprintf(&dyn, "%%%u", vud->pane->id))
-			return;
+		if (vud->pane)
+			wtc_tmux_cmd_exec(tmux, kill_cmd, NULL, NULL, vud->pane->id);
 
-		cmd[2] = dyn;
-		wtc_tmux_exec(tmux, cmd, NULL, NULL);
-		free(dyn);
+		free(vud);
 	}
 }
 
@@ -439,20 +704,14 @@ bool wlc_out_cr(wlc_handle output)
 
 	debug("New output: %p -- %s -- %p\n", output, wlc_output_get_name(output), wlc_handle_get_user_data(output));
 
-	if (wlc_handle_get_user_data(output) == NULL) {
+	if (wlc_handle_get_user_data(output) == NULL &&
+	    !(ud = unpark_output(output))) {
 		ud = calloc(1, sizeof(struct wtc_output));
 		if (!ud) {
 			crit("wlc_out_cr: Could not allocate output data!");
 			return false;
 		}
-		ud->tnlen = 10;
-		ud->table_name = calloc(10, sizeof(char));
-		if (!ud->table_name) {
-			crit("wlc_out_cr: Could not allocate table name!");
-			free(ud);
-			return false;
-		}
-		strcpy(ud->table_name, "root");
+		ud->shown_window = -1;
 		wlc_handle_set_user_data(output, ud);
 	} else {
 		ud = wlc_handle_get_user_data(output);
@@ -479,6 +738,9 @@ bool wlc_out_cr(wlc_handle output)
 	// TODO This needs to be more extensible
 	wlc_output_set_resolution(output, wlc_output_get_resolution(output), 1);
 
+	if (ud->term_view)
+		reposition_output(output);
+
 	return true;
 }
 
@@ -489,32 +751,122 @@ void wlc_out_dr(wlc_handle output)
 	if (!ud)
 		return;
 
-	if (ud->create_timer)
+	wlc_handle_set_user_data(output, NULL);
+	if (ud->create_timer) {
 		wlc_event_source_remove(ud->create_timer);
-	if (ud->term_out)
-		wlc_event_source_remove(ud->term_out);
+		ud->create_timer = NULL;
+	}
+	if (ud->focus_timer) {
+		wlc_event_source_remove(ud->focus_timer);
+		ud->focus_timer = NULL;
+	}
+	ud->focus_predicted = false;
+	ud->switcher = false;
 
-	free(ud->table_name);
-	free(ud);
+	// Keep a running terminal (and its tmux client) for the output's return
+	if (ud->term_pid && !terminating && !park_output(output, ud))
+		return;
+
+	free_output(ud);
+}
+
+static int focus_cb(void *dt)
+{
+	wlc_handle output = (wlc_handle) dt;
+	struct wtc_output *ud = wlc_handle_get_user_data(output);
+
+	if (ud && ud->focus_predicted) {
+		debug("focus_cb: Predicted focus unconfirmed, reconciling");
+		reposition_output(output);
+	}
+
+	return 0;
+}
+
+static wlc_handle find_pane_view(wlc_handle output,
+                                 const struct wtc_tmux_pane *pane)
+{
+	const wlc_handle *views;
+	struct wtc_view *vud;
+	size_t vc;
+
+	views = wlc_output_get_views(output, &vc);
+	for (int i = 0; i < vc; ++i) {
+		vud = wlc_handle_get_user_data(views[i]);
+		if (vud && vud->pane == pane)
+			return views[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Move the focus to where bind (a pane navigation binding) will move the
+ * active pane, without waiting for tmux. The tmux callbacks correct the
+ * focus once tmux reports the new active pane.
+ */
+static void predict_focus(wlc_handle output,
+                          const struct wtc_tmux_client *client,
+                          const struct wtc_tmux_key_bind *bind)
+{
+	const struct wtc_tmux_window *wind;
+	const struct wtc_tmux_pane *target;
+	struct wtc_output *ud;
+	wlc_handle view;
+
+	ud = wlc_handle_get_user_data(output);
+	wind = client->session->active_window;
+	if (!ud || !ud->term_view || !wind || !wind->active_pane)
+		return;
+
+	if (bind->action == WTC_TMUX_KEY_BIND_LAST_PANE)
+		target = wind->last_pane;
+	else
+		target = wtc_tmux_pane_neighbor(wind->active_pane,
+		                                bind->direction);
+	if (!target || target == wind->active_pane)
+		return;
+
+	if (!ud->focus_timer) {
+		ud->focus_timer = wlc_event_loop_add_timer(focus_cb,
+		                                           (void *) output);
+		if (!ud->focus_timer) {
+			warn("predict_focus: Couldn't create timer!");
+			return;
+		}
+	}
+
+	// Panes without a view of their own are shown by the terminal.
+	view = find_pane_view(output, target);
+	if (view && is_visible(view) == 1)
+		wlc_view_focus(view);
+	else
+		wlc_view_focus(ud->term_view);
+
+	ud->focus_predicted = true;
+	wlc_event_source_timer_update(ud->focus_timer, FOCUS_PREDICT_TIMEOUT);
 }
 
 bool wlc_kbd(wlc_handle view, uint32_t time,
              const struct wlc_modifiers *mods, uint32_t key,
              enum wlc_key_state state)
 {
-	const struct wtc_tmux_key_table *table;
 	const struct wtc_tmux_key_bind *bind;
 	const struct wtc_tmux_client *client;
 	struct wtc_output *ud;
 	wlc_handle output;
 	uint32_t sym, chr;
-	key_code code;
+	key_code code, kmods;
+	int r;
+
+	sym = wlc_keyboard_get_keysym_for_key(key, NULL);
+	if (switcher_key(view, mods, sym, state))
+		return true;
 
 	// TODO Handle repeated keys
 	if (state != WLC_KEY_STATE_PRESSED)
 		return false;
 
-	sym = wlc_keyboard_get_keysym_for_key(key, NULL);
 	if (sym == XKB_KEY_q && state == WLC_KEY_STATE_PRESSED
 	                     && mods->mods == WLC_BIT_MOD_CTRL) {
 		wlc_terminate();
@@ -539,47 +891,63 @@ bool wlc_kbd(wlc_handle view, uint32_t time,
 	if (ud->term_view == view)
 		goto ignore;
 
-	table = wtc_tmux_lookup_key_table(tmux, ud->table_name);
-	if (!table)
-		goto ignore;
+	kmods = 0;
+	if (mods->mods & WLC_BIT_MOD_CTRL)
+		kmods |= KEYC_CTRL;
+	if (mods->mods & WLC_BIT_MOD_ALT)
+		kmods |= KEYC_ESCAPE;
+	if (mods->mods & WLC_BIT_MOD_SHIFT)
+		kmods |= KEYC_SHIFT;
 
 	chr = wlc_keyboard_get_utf32_for_key(key, mods);
-	code = key_code_from_xkb_key_char(sym, chr);
+	code = key_code_from_xkb_key_char(sym, chr, kmods);
 	if (code < 128)
 		debug("Pressed: %c", code);
 
 	if (code == KEYC_NONE || code == KEYC_UNKNOWN)
 		return false;
 
-	if (mods->mods & WLC_BIT_MOD_ALT)
-		code |= KEYC_ESCAPE;
-
 	// 104 - 8
 	info("KEY: %c - %u - %u", chr, sym, code);
 
-	HASH_FIND(hh, table->binds, &code, sizeof(code), bind);
-	if (bind) {
-		if (set_table_name(ud, bind->next_table->name))
-			return false;
-		// If we didn't switch back to root then this is a switch command
-		// so we don't execute anything
-		if (strcmp(bind->next_table->name, "root") != 0)
-			return true;
+	// The key tables are loaded on the first key press which needs them.
+	r = wtc_tmux_load_key_binds(tmux);
+	if (r < 0)
+		warn("wlc_kbd: Couldn't load key bindings: %d", r);
+
+	// The whole key table walk happens here; tmux only ever sees the
+	// commands of the bindings which actually do something.
+	if (!wtc_tmux_key_table_step(tmux, client->session, &ud->table, code,
+	                             &bind))
+		return false;
 
-		wtc_tmux_session_exec(tmux, client->session, bind->cmd, NULL, NULL);
+	if (!bind || bind->action == WTC_TMUX_KEY_BIND_SWITCH)
 		return true;
-	}
 
-	if (strcmp(ud->table_name, "root") == 0) {
-		if (code == client->session->prefix ||
-		    code == client->session->prefix2) {
-			strcpy(ud->table_name, "prefix");
-			return true;
+	if (bind->action == WTC_TMUX_KEY_BIND_SELECT_PANE ||
+	    bind->action == WTC_TMUX_KEY_BIND_LAST_PANE)
+		predict_focus(output, client, bind);
+
+	if (ud->focus_predicted) {
+		// Waiting for tmux would hold the predicted focus back until
+		// it answers. If tmux rejects the command instead, focus_cb
+		// puts the focus back when the prediction times out.
+		r = wtc_tmux_session_send(tmux, client->session, bind->cmd);
+		if (r < 0) {
+			warn("wlc_kbd: Pane navigation failed: %d", r);
+			reposition_output(output);
 		}
+	} else {
+		r = wtc_tmux_session_exec(tmux, client->session, bind->cmd, NULL,
+		                          NULL);
 	}
 
+	if (r >= 0 && bind->rebinds && wtc_tmux_invalidate_key_binds(tmux) < 0)
+		warn("wlc_kbd: Couldn't schedule a key binding reload");
+	return true;
+
 ignore:
-	strcpy(ud->table_name, "root");
+	ud->table = NULL;
 	return false;
 }
 
@@ -589,15 +957,167 @@ bool wlc_ptr(wlc_handle view, uint32_t time, const struct wlc_point *pos)
 	return false;
 }
 
+static void sigusr1_handler(int signal)
+{
+	int save_errno = errno;
+	write(statspipe[1], "", 1);
+	errno = save_errno;
+}
+
+static int stats_cb(int fd, uint32_t mask, void *userdata)
+{
+	const struct wtc_tmux_session *sess;
+	const wlc_handle *outputs;
+	struct wtc_output *ud;
+	unsigned long rate;
+	bool polled;
+	size_t opc;
+
+	int r = read_available(fd, WTC_RDAVL_DISCARD, NULL, NULL);
+	if (r < 0)
+		warn("stats_cb: Error clearing pipe: %d", r);
+
+	outputs = wlc_get_outputs(&opc);
+	for (size_t i = 0; i < opc; ++i) {
+		ud = wlc_handle_get_user_data(outputs[i]);
+		if (ud)
+			wtc_frame_stats_dump(&ud->stats,
+			                     wlc_output_get_name(outputs[i]));
+	}
+
+	sess = wtc_tmux_root_session(tmux);
+	for ( ; sess; sess = sess->hh.next) {
+		if (wtc_tmux_session_rate(tmux, sess, &rate, &polled) < 0)
+			continue;
+		info("session $%d: %lu notifications/s, %s", sess->id, rate,
+		     polled ? "polled" : "event driven");
+	}
+
+	return 0;
+}
+
+static int setup_stats(void)
+{
+	struct sigaction act;
+
+	if (pipe2(statspipe, O_CLOEXEC | O_NONBLOCK)) {
+		warn("setup_stats: Couldn't open pipe: %d", errno);
+		return -errno;
+	}
+
+	if (!wlc_event_loop_add_fd(statspipe[0], WL_EVENT_READABLE,
+	                           stats_cb, NULL)) {
+		warn("setup_stats: Couldn't add pipe to event loop!");
+		return -1;
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = sigusr1_handler;
+	if (sigaction(SIGUSR1, &act, NULL)) {
+		warn("setup_stats: Couldn't set SIGUSR1 handler: %d", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void sigusr2_handler(int signal)
+{
+	int save_errno = errno;
+	write(upgradepipe[1], "", 1);
+	errno = save_errno;
+}
+
+static int upgrade_cb(int fd, uint32_t mask, void *userdata)
+{
+	int r = read_available(fd, WTC_RDAVL_DISCARD, NULL, NULL);
+	if (r < 0)
+		warn("upgrade_cb: Error clearing pipe: %d", r);
+
+	info("upgrade_cb: Upgrade requested");
+	upgrade = true;
+	wlc_terminate();
+	return 0;
+}
+
+static int setup_upgrade(void)
+{
+	struct sigaction act;
+	ssize_t len;
+
+	// Once the binary has been reinstalled, /proc/self/exe refers to the
+	// old, unlinked file, so remember where it lives while we still can.
+	len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+	if (len < 0) {
+		warn("setup_upgrade: Couldn't resolve executable: %d", errno);
+		return -errno;
+	}
+	exe_path[len] = '\0';
+
+	if (pipe2(upgradepipe, O_CLOEXEC | O_NONBLOCK)) {
+		warn("setup_upgrade: Couldn't open pipe: %d", errno);
+		return -errno;
+	}
+
+	if (!wlc_event_loop_add_fd(upgradepipe[0], WL_EVENT_READABLE,
+	                           upgrade_cb, NULL)) {
+		warn("setup_upgrade: Couldn't add pipe to event loop!");
+		return -1;
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = sigusr2_handler;
+	if (sigaction(SIGUSR2, &act, NULL)) {
+		warn("setup_upgrade: Couldn't set SIGUSR2 handler: %d", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Replace ourselves with the (possibly updated) binary, handing the tmux
+ * connection over. This only returns if something goes wrong.
+ *
+ * Wayland clients can't survive this. By the time wlc_run returns, their
+ * views have been destroyed, which kills the panes of GUI programs; the new
+ * process learns of that from the control clients' buffered output. Only
+ * the terminals are started again.
+ */
+static void exec_upgrade(char **argv)
+{
+	char val[16];
+	int fd, r;
+
+	r = wtc_tmux_handover_export(tmux, &fd);
+	if (r < 0) {
+		warn("exec_upgrade: Couldn't export tmux state: %d", r);
+		return;
+	}
+
+	snprintf(val, sizeof(val), "%d", fd);
+	if (setenv(WTC_HANDOVER_ENV, val, 1)) {
+		warn("exec_upgrade: Couldn't set environment: %d", errno);
+		return;
+	}
+
+	info("exec_upgrade: Restarting...");
+	execv(exe_path, argv);
+	crit("exec_upgrade: exec failed: %d", errno);
+}
+
 void setup_wlc_handlers(void)
 {
 	wlc_log_set_handler(wlc_log);
 
+	wlc_set_compositor_terminate_cb(wlc_comp_term);
+
 	wlc_set_keyboard_key_cb(wlc_kbd);
 	wlc_set_pointer_motion_cb(wlc_ptr);
 
 	wlc_set_output_created_cb(wlc_out_cr);
 	wlc_set_output_destroyed_cb(wlc_out_dr);
+	wlc_set_output_render_post_cb(wlc_out_render_post);
 
 	wlc_set_view_created_cb(wlc_view_cr);
 	wlc_set_view_destroyed_cb(wlc_view_dr);
@@ -605,123 +1125,257 @@ void setup_wlc_handlers(void)
 }
 
 /*
- * Based on the current tmux state, should the given view be displayed?
- * Returns 1 if yes, 0 if no. If there is missing information, returns -1.
+ * The views being laid out, as described to the layout engine, along with
+ * the engine's decisions. The arrays are reused from one layout to the
+ * next.
  */
-static int is_visible(wlc_handle view)
+static struct {
+	wlc_handle *handles;
+	struct wtc_layout_view *views;
+	struct wtc_layout_result *res;
+	size_t len;
+	size_t cap;
+} layout;
+
+static void free_layout(void)
 {
-	const struct wtc_tmux_client *client;
+	free(layout.handles);
+	free(layout.views);
+	free(layout.res);
+	memset(&layout, 0, sizeof(layout));
+}
+
+/*
+ * Describe view to the layout engine. root and anchor are the indices of
+ * the views deciding its visibility and its position (-1 for none).
+ * Returns the index of the view, or a negative error code.
+ */
+static int layout_add(wlc_handle view, int root, int anchor, bool fixed)
+{
+	const struct wlc_geometry *anchor_rect, *g;
+	struct wtc_layout_view *lv;
 	struct wtc_view *vud;
-	wlc_handle output;
 
-	// If we have a positioner, defer to our parent (if it exists)
-	if (wlc_view_positioner_get_anchor_rect(view)) {
-		wlc_handle parent = wlc_view_get_parent(view);
-		if (parent)
-			return is_visible(parent);
-	}
+	if (layout.len == layout.cap) {
+		size_t cap = layout.cap ? 2 * layout.cap : 64;
+		void *handles = realloc(layout.handles, cap * sizeof(wlc_handle));
+		if (!handles)
+			return -ENOMEM;
+		layout.handles = handles;
 
-	output = wlc_view_get_output(view);
-	if (!output)
-		return -1;
+		void *views = realloc(layout.views,
+		                      cap * sizeof(struct wtc_layout_view));
+		if (!views)
+			return -ENOMEM;
+		layout.views = views;
 
-	client = get_client(output);
-	if (!client)
-		return -1;
+		void *res = realloc(layout.res,
+		                    cap * sizeof(struct wtc_layout_result));
+		if (!res)
+			return -ENOMEM;
+		layout.res = res;
+		layout.cap = cap;
+	}
 
 	vud = wlc_handle_get_user_data(view);
-	if (!vud || !vud->pane)
-		return -1;
+	lv = &layout.views[layout.len];
+	memset(lv, 0, sizeof(struct wtc_layout_view));
+	lv->pane = vud ? vud->pane : NULL;
+	lv->root = root;
+	lv->anchor = -1;
+	lv->fixed = fixed;
+
+	/* Adapted from wlc example. */
+	anchor_rect = wlc_view_positioner_get_anchor_rect(view);
+	if (anchor_rect && anchor >= 0) {
+		const struct wlc_size *size_req = wlc_view_positioner_get_size(view);
+		lv->anchor = anchor;
+		lv->offset.x = anchor_rect->origin.x;
+		lv->offset.y = anchor_rect->origin.y;
+		lv->offset.w = size_req->w;
+		lv->offset.h = size_req->h;
+	}
+
+	g = wlc_view_get_geometry(view);
+	lv->geom.x = g->origin.x;
+	lv->geom.y = g->origin.y;
+	lv->geom.w = g->size.w;
+	lv->geom.h = g->size.h;
 
-	return vud->pane->window == client->session->active_window &&
-	       !(vud->pane->in_mode) && vud->pane->w > 0 && vud->pane->h > 0;
+	layout.handles[layout.len] = view;
+	return layout.len++;
 }
 
-static void reposition_view(wlc_handle view)
+/*
+ * Describe view and everything positioned relative to it, depth first.
+ * Returns the index of view, or a negative error code.
+ */
+static int layout_add_tree(wlc_handle view, int root, int anchor)
 {
-	const struct wlc_geometry *anchor_rect;
-	const struct wtc_tmux_client *client;
-	struct wtc_output *pud;
-	struct wtc_view *vud;
-	wlc_handle output, parent;
+	struct wtc_view *vud, *child;
+	int i, r;
 
-	switch (is_visible(view)) {
-	case -1:
-		return;
-	case 0:
-		wlc_view_set_mask(view, 0);
-		return;
-	default:
-		break;
-	}
+	i = layout_add(view, root, anchor, false);
+	if (i < 0)
+		return i;
 
-	/* Adapted from wlc example. */
-	anchor_rect = wlc_view_positioner_get_anchor_rect(view);
-	parent = wlc_view_get_parent(view);
-	if (anchor_rect && parent) {
-		struct wlc_size size_req = *wlc_view_positioner_get_size(view);
-		if ((size_req.w <= 0) || (size_req.h <= 0))
-			size_req = wlc_view_get_geometry(view)->size;
-
-		const struct wlc_geometry *pg = wlc_view_get_geometry(parent);
-		const struct wlc_geometry g = {
-			.origin = {
-				.x = pg->origin.x + anchor_rect->origin.x,
-				.y = pg->origin.y + anchor_rect->origin.y,
-			},
-			.size = size_req,
-		};
-		wlc_view_set_geometry(view, 0, &g);
-		wlc_view_set_mask(view, wlc_output_get_mask(output));
-		return;
+	vud = wlc_handle_get_user_data(view);
+	if (!vud)
+		return i;
+
+	for (child = vud->children; child; child = child->next) {
+		r = layout_add_tree(child->view, root < 0 ? i : root, i);
+		if (r < 0)
+			return r;
 	}
 
-	output = wlc_view_get_output(view);
-	if (!output)
-		return;
+	return i;
+}
 
-	pud = wlc_handle_get_user_data(output);
-	if (!pud)
-		return;
+/*
+ * Describe the views vud is positioned relative to, from the pane view at
+ * the top down, for reference only. Sets anchor to the index of vud's
+ * parent (-1 if it has none). Returns 0 or a negative error code.
+ */
+static int layout_add_ancestors(struct wtc_view *vud, int *anchor)
+{
+	int r, up;
 
-	client = get_client(output);
-	if (!client)
-		return;
+	*anchor = -1;
+	if (!vud || !vud->parent)
+		return 0;
 
-	vud = wlc_handle_get_user_data(view);
-	if (!vud || !vud->pane)
+	r = layout_add_ancestors(vud->parent, &up);
+	if (r < 0)
+		return r;
+
+	// The ancestors start the array, so the top one is the root.
+	r = layout_add(vud->parent->view, up < 0 ? -1 : 0, up, true);
+	if (r < 0)
+		return r;
+
+	*anchor = r;
+	return 0;
+}
+
+static void layout_output(wlc_handle output, struct wtc_layout_output *out)
+{
+	struct wtc_output *ud = wlc_handle_get_user_data(output);
+
+	memset(out, 0, sizeof(struct wtc_layout_output));
+	out->client = get_client(output);
+	if (!ud)
 		return;
 
-	int offset = client->session->statusbar == WTC_TMUX_SESSION_TOP
-	              ? 1 : 0;
-	const struct wlc_geometry g = {
-		.origin = {
-			.x = pud->term_x + pud->term_w * vud->pane->x,
-			.y = pud->term_y + pud->term_h * (vud->pane->y + offset),
-		},
-		.size = {
-			.w = pud->term_w * vud->pane->w,
-			.h = pud->term_h * vud->pane->h,
-		},
-	};
-	wlc_view_set_geometry(view, 0, &g);
-	wlc_view_set_mask(view, wlc_output_get_mask(output));
+	out->cell.x = ud->term_x;
+	out->cell.y = ud->term_y;
+	out->cell.w = ud->term_w;
+	out->cell.h = ud->term_h;
+}
 
-	if (vud->pane->active)
-		wlc_view_focus(view);
+/*
+ * Apply the layout engine's decisions for the described views, in order.
+ */
+static void layout_apply(wlc_handle output)
+{
+	uint32_t mask = wlc_output_get_mask(output);
+	struct wtc_output *oud = wlc_handle_get_user_data(output);
+	struct wtc_layout_result *res;
+	uint64_t placed = 0;
+
+	for (size_t i = 0; i < layout.len; ++i) {
+		res = &layout.res[i];
+		switch (res->action) {
+		case WTC_LAYOUT_HIDE:
+			wlc_view_set_mask(layout.handles[i], 0);
+			break;
+		case WTC_LAYOUT_SHOW: {
+			const struct wlc_geometry g = {
+				.origin = { .x = res->geom.x, .y = res->geom.y },
+				.size = { .w = res->geom.w, .h = res->geom.h },
+			};
+			wlc_view_set_geometry(layout.handles[i], 0, &g);
+			wlc_view_set_mask(layout.handles[i], mask);
+			if (res->focus)
+				wlc_view_focus(layout.handles[i]);
+			break;
+		}
+		default:
+			continue;
+		}
+		++placed;
+	}
+
+	if (oud)
+		wtc_frame_stats_layout(&oud->stats, wtc_stats_now(), placed);
+}
+
+/*
+ * Based on the current tmux state, should the given view be displayed?
+ * Returns 1 if yes, 0 if no. If there is missing information, returns -1.
+ * See wtc_layout_visible.
+ */
+static int is_visible(wlc_handle view)
+{
+	struct wtc_layout_output out;
+	int r, i, anchor;
+
+	layout.len = 0;
+	r = layout_add_ancestors(wlc_handle_get_user_data(view), &anchor);
+	if (r < 0)
+		goto err;
+	i = layout_add(view, anchor < 0 ? -1 : 0, anchor, true);
+	if (i < 0)
+		goto err;
+
+	layout_output(wlc_view_get_output(view), &out);
+	return wtc_layout_visible(&out, layout.views, i);
+
+err:
+	crit("is_visible: Couldn't describe view!");
+	return -1;
+}
+
+/*
+ * Place view and everything positioned relative to it, as decided by the
+ * layout engine. Returns the view's visibility, as is_visible.
+ */
+static int reposition_view(wlc_handle view)
+{
+	struct wtc_layout_output out;
+	wlc_handle output;
+	int r, i, anchor;
+
+	layout.len = 0;
+	r = layout_add_ancestors(wlc_handle_get_user_data(view), &anchor);
+	if (r < 0)
+		goto err;
+	i = layout_add_tree(view, anchor < 0 ? -1 : 0, anchor);
+	if (i < 0)
+		goto err;
+
+	output = wlc_view_get_output(view);
+	layout_output(output, &out);
+	wtc_layout_place(&out, layout.views, layout.len, layout.res);
+	layout_apply(output);
+	return layout.res[i].vis;
+
+err:
+	crit("reposition_view: Couldn't describe views!");
+	return -1;
 }
 
 static void reposition_output(wlc_handle output)
 {
 	const wlc_handle *views;
-	const struct wtc_tmux_client *client;
+	struct wtc_layout_output out;
 	struct wtc_output *oud;
 	struct wtc_view *vud;
 	size_t vc;
 	bool found;
 
-	client = get_client(output);
-	if (!client)
+	layout_output(output, &out);
+	if (!out.client)
 		return;
 
 	// Since we have a client, we know this exists.
@@ -729,22 +1383,208 @@ static void reposition_output(wlc_handle output)
 	if (!oud->term_view)
 		return;
 
-	found = false;
+	// Whatever focus we predicted, tmux's state is authoritative now.
+	oud->focus_predicted = false;
+	// The outgoing window is off screen after this, too late to capture.
+	oud->switch_pending = false;
+
+	layout.len = 0;
 	views = wlc_output_get_views(output, &vc);
 	for (int i = 0; i < vc; ++i) {
-		reposition_view(views[i]);
+		// Children are placed along with their parent
 		vud = wlc_handle_get_user_data(views[i]);
-		if (!vud || !vud->pane)
-			continue;
-		if (vud->pane->window != client->session->active_window ||
-		    !vud->pane->active)
+		if (vud && vud->parent)
 			continue;
 
-		// N.B. This counts an error as visible.
-		found = is_visible(views[i]);
+		if (layout_add_tree(views[i], -1, -1) < 0) {
+			crit("reposition_output: Couldn't describe views!");
+			return;
+		}
 	}
+
+	found = wtc_layout_place(&out, layout.views, layout.len, layout.res);
+	layout_apply(output);
 	if (!found)
 		wlc_view_focus(oud->term_view);
+
+	oud->shown_window = out.client->session->active_window
+	                    ? out.client->session->active_window->id : -1;
+}
+
+/*
+ * Reposition output after its client's window may have changed. If the window
+ * on display is being switched away from, the switch is applied from the
+ * render callback once the outgoing window has been captured.
+ */
+static void switch_window(wlc_handle output)
+{
+	struct wtc_layout_output out;
+	struct wtc_output *ud;
+
+	layout_output(output, &out);
+	ud = wlc_handle_get_user_data(output);
+	if (!out.client || !ud || ud->shown_window < 0 ||
+	    wlc_output_get_sleep(output) ||
+	    (out.client->session->active_window &&
+	     out.client->session->active_window->id == ud->shown_window)) {
+		reposition_output(output);
+		return;
+	}
+
+	ud->switch_pending = true;
+	wlc_output_schedule_render(output);
+}
+
+/*
+ * Collect the ids of the windows in output's session into windows (which
+ * has room for SWITCHER_MAX). Returns the number of windows, or -1 if the
+ * output has no client.
+ */
+static int switcher_windows(wlc_handle output, int *windows)
+{
+	const struct wtc_tmux_client *client = get_client(output);
+	int count = 0;
+
+	if (!client)
+		return -1;
+
+	for (int i = 0; i < client->session->window_count &&
+	                count < SWITCHER_MAX; ++i)
+		windows[count++] = client->session->windows[i]->id;
+
+	return count;
+}
+
+/*
+ * Handle a key for the window switcher. Super+Tab opens the switcher and
+ * moves the selection forward (Super+Shift+Tab moves it back). Releasing
+ * Super or pressing Return switches to the selected window, and Escape
+ * closes the switcher. While the switcher is open, it consumes every key.
+ * Returns whether the key was consumed.
+ */
+static bool switcher_key(wlc_handle view, const struct wlc_modifiers *mods,
+                         uint32_t sym, enum wlc_key_state state)
+{
+	const struct wtc_tmux_client *client;
+	struct wtc_output *ud;
+	wlc_handle output;
+	int windows[SWITCHER_MAX];
+	int count, r;
+	char *cmd = NULL;
+	bool tab, pick;
+
+	output = view ? wlc_view_get_output(view) : wlc_get_focused_output();
+	ud = output ? wlc_handle_get_user_data(output) : NULL;
+	if (!ud)
+		return false;
+
+	tab = (sym == XKB_KEY_Tab || sym == XKB_KEY_ISO_Left_Tab) &&
+	      (mods->mods & WLC_BIT_MOD_LOGO);
+	if (!ud->switcher && !(tab && state == WLC_KEY_STATE_PRESSED))
+		return false;
+
+	client = get_client(output);
+	count = switcher_windows(output, windows);
+	if (count <= 0) {
+		ud->switcher = false;
+		return false;
+	}
+
+	if (tab) {
+		if (state != WLC_KEY_STATE_PRESSED)
+			return true;
+
+		if (!ud->switcher) {
+			ud->switcher = true;
+			ud->switcher_sel = 0;
+			// The window on display has likely changed since it was
+			// last captured.
+			ud->capture_shown = true;
+			for (int i = 0; i < count; ++i)
+				if (client->session->active_window &&
+				    windows[i] == client->session->active_window->id)
+					ud->switcher_sel = i;
+		}
+
+		if (sym == XKB_KEY_ISO_Left_Tab || (mods->mods & WLC_BIT_MOD_SHIFT))
+			ud->switcher_sel += count - 1;
+		else
+			ud->switcher_sel++;
+		ud->switcher_sel %= count;
+
+		wlc_output_schedule_render(output);
+		return true;
+	}
+
+	pick = state == WLC_KEY_STATE_PRESSED ? sym == XKB_KEY_Return
+	       : sym == XKB_KEY_Super_L || sym == XKB_KEY_Super_R;
+	if (!pick && !(state == WLC_KEY_STATE_PRESSED && sym == XKB_KEY_Escape))
+		return true;
+
+	ud->switcher = false;
+	wtc_thumbs_trim(&ud->thumbs);
+	wlc_output_schedule_render(output);
+	if (!pick)
+		return true;
+
+	if (bprintf(&cmd, "select-window -t @%d",
+	            windows[ud->switcher_sel % count]))
+		return true;
+
+	r = wtc_tmux_session_exec(tmux, client->session, cmd, NULL, NULL);
+	if (r < 0)
+		warn("switcher_key: Couldn't select window: %d", r);
+	free(cmd);
+	return true;
+}
+
+void wlc_out_render_post(wlc_handle output)
+{
+	struct wtc_output *ud = wlc_handle_get_user_data(output);
+	int windows[SWITCHER_MAX];
+	unsigned long refresh;
+	struct wtc_frame frame;
+	uint64_t now, tmux_ns, queued_ns;
+	int count, r;
+
+	if (!ud)
+		return;
+
+	now = wtc_stats_now();
+	wtc_tmux_refresh_stats(tmux, &refresh, &tmux_ns);
+	queued_ns = wtc_tmux_refresh_queued(tmux, ud->stats.refresh_id + 1);
+	wtc_frame_stats_frame(&ud->stats, now, refresh, tmux_ns, queued_ns,
+	                      &frame);
+	if (frame.missed)
+		debug("wlc_out_render_post: Missed %" PRIu64 " vblanks: %" PRIu64
+		      " us in tmux, %" PRIu64 " views, refreshes %lu-%lu",
+		      frame.missed, frame.tmux_us, frame.views,
+		      frame.first_refresh, frame.last_refresh);
+
+	// This comes before the switcher is drawn over the frame.
+	if ((ud->switch_pending || ud->capture_shown) && ud->shown_window >= 0) {
+		r = wtc_thumbs_capture(&ud->thumbs, output, ud->shown_window);
+		if (r < 0)
+			warn("wlc_out_render_post: Couldn't capture window %d: %d",
+			     ud->shown_window, r);
+	}
+	ud->capture_shown = false;
+	if (ud->switch_pending)
+		reposition_output(output);
+
+	if (!ud->switcher)
+		return;
+
+	count = switcher_windows(output, windows);
+	if (count <= 0) {
+		ud->switcher = false;
+		return;
+	}
+
+	r = wtc_thumbs_draw_switcher(&ud->thumbs, output, windows, count,
+	                             ud->switcher_sel % count);
+	if (r < 0)
+		warn("wlc_out_render_post: Couldn't draw switcher: %d", r);
 }
 
 static int tmux_new_pane(struct wtc_tmux *tmux, 
@@ -815,24 +1655,56 @@ static int tmux_pane_resized(struct wtc_tmux *tmux,
 
 	debug("Pane resized: %p %u", pane, pane->id);
 
+	// Visibility changes are handled by tmux_visibility_changed.
 	outputs = wlc_get_outputs(&opc);
-	for (int i = 0; i < opc; ++i)
-		reposition_output(outputs[i]);
+	for (int i = 0; i < opc; ++i) {
+		wlc_handle view = find_pane_view(outputs[i], pane);
+		if (view)
+			reposition_view(view);
+	}
 
 	return 0;
 }
 
-static int tmux_pane_mode_changed(struct wtc_tmux *tmux, 
-                                  const struct wtc_tmux_pane *pane)
+/*
+ * Lay out the views whose panes were shown or hidden on the client's
+ * outputs (and their popups). This covers pane mode changes, which only
+ * affect visibility.
+ */
+static int tmux_visibility_changed(struct wtc_tmux *tmux,
+                                   const struct wtc_tmux_client *client,
+                                   const int *panes, size_t count)
 {
-	const wlc_handle *outputs;
-	size_t opc;
+	const wlc_handle *outputs, *views;
+	struct wtc_output *oud;
+	struct wtc_view *vud;
+	size_t opc, vc;
 
-	debug("Pane changed mode: %p %u", pane, pane->id);
+	debug("Visibility changed: %s (%zu panes)", client->name, count);
 
 	outputs = wlc_get_outputs(&opc);
-	for (int i = 0; i < opc; ++i)
-		reposition_output(outputs[i]);
+	for (int i = 0; i < opc; ++i) {
+		oud = wlc_handle_get_user_data(outputs[i]);
+		if (!oud || !oud->term_view || get_client(outputs[i]) != client)
+			continue;
+
+		views = wlc_output_get_views(outputs[i], &vc);
+		for (int j = 0; j < vc; ++j) {
+			vud = wlc_handle_get_user_data(views[j]);
+			if (!vud || !vud->pane)
+				continue;
+
+			for (int k = 0; k < count; ++k) {
+				if (panes[k] != vud->pane->id)
+					continue;
+
+				// Don't leave the focus on a view we just hid
+				if (reposition_view(views[j]) == 0 && vud->pane->active)
+					wlc_view_focus(oud->term_view);
+				break;
+			}
+		}
+	}
 
 	return 0;
 }
@@ -862,7 +1734,7 @@ static int tmux_session_window_changed(struct wtc_tmux *tmux,
 
 	outputs = wlc_get_outputs(&opc);
 	for (int i = 0; i < opc; ++i)
-		reposition_output(outputs[i]);
+		switch_window(outputs[i]);
 
 	return 0;
 }
@@ -877,7 +1749,49 @@ static int tmux_client_session_changed(struct wtc_tmux *tmux,
 
 	outputs = wlc_get_outputs(&opc);
 	for (int i = 0; i < opc; ++i)
-		reposition_output(outputs[i]);
+		switch_window(outputs[i]);
+
+	return 0;
+}
+
+static int tmux_window_closed(struct wtc_tmux *tmux,
+                              const struct wtc_tmux_window *wind)
+{
+	const wlc_handle *outputs;
+	struct wtc_output *ud;
+	size_t opc;
+
+	outputs = wlc_get_outputs(&opc);
+	for (int i = 0; i < opc; ++i) {
+		ud = wlc_handle_get_user_data(outputs[i]);
+		if (ud)
+			wtc_thumbs_forget(&ud->thumbs, wind->id);
+	}
+
+	return 0;
+}
+
+static int tmux_connect_changed(struct wtc_tmux *tmux, int state)
+{
+	const wlc_handle *outputs;
+	size_t opc;
+
+	switch (state) {
+	case WTC_TMUX_CONNECT_READY:
+		info("tmux_connect_changed: Connected to tmux");
+
+		// The outputs came up before tmux was mirrored; lay them out.
+		outputs = wlc_get_outputs(&opc);
+		for (int i = 0; i < opc; ++i)
+			reposition_output(outputs[i]);
+		break;
+	case WTC_TMUX_CONNECT_FAILED:
+		crit("tmux_connect_changed: Couldn't connect to tmux!");
+		wlc_terminate();
+		break;
+	default:
+		break;
+	}
 
 	return 0;
 }
@@ -886,17 +1800,19 @@ static int setup_tmux_handlers(struct wtc_tmux *tmux)
 {
 	int r = 0;
 
-	r =         wtc_tmux_set_new_pane_cb(tmux, tmux_new_pane);
+	r =         wtc_tmux_set_connect_cb(tmux, tmux_connect_changed);
+	r = r ? r : wtc_tmux_set_new_pane_cb(tmux, tmux_new_pane);
 	r = r ? r : wtc_tmux_set_pane_closed_cb(tmux, tmux_pane_closed);
 	r = r ? r : wtc_tmux_set_pane_resized_cb(tmux, tmux_pane_resized);
-	r = r ? r : wtc_tmux_set_pane_mode_changed_cb(tmux,
-	                                             tmux_pane_mode_changed);
 	r = r ? r : wtc_tmux_set_window_pane_changed_cb(tmux,
 	                                            tmux_window_pane_changed);
 	r = r ? r : wtc_tmux_set_session_window_changed_cb(tmux,
 	                                           tmux_session_window_changed);
 	r = r ? r : wtc_tmux_set_client_session_changed_cb(tmux,
 	                                           tmux_client_session_changed);
+	r = r ? r : wtc_tmux_set_window_closed_cb(tmux, tmux_window_closed);
+	r = r ? r : wtc_tmux_set_client_visibility_changed_cb(tmux,
+	                                               tmux_visibility_changed);
 	return r;
 }
 
@@ -912,7 +1828,18 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	int r = wtc_tmux_new(&tmux);
+	const char *split_argv[] = { "split-window", "-t", "%P", "-PF",
+	                             "#{pane_pid}",
+	                             "echo \"PID: %d\"; sleep infinity", NULL };
+	const char *kill_argv[] = { "kill-pane", "-t", "%P", NULL };
+	int r = wtc_tmux_cmd_compile(split_argv, &split_cmd);
+	if (r)
+		return -r;
+	r = wtc_tmux_cmd_compile(kill_argv, &kill_cmd);
+	if (r)
+		return -r;
+
+	r = wtc_tmux_new(&tmux);
 	if (r)
 		return -r;
 	r = setup_tmux_handlers(tmux);
@@ -927,13 +1854,42 @@ int main(int argc, char **argv)
 	r = wtc_tmux_set_socket_name(tmux, "test"); //164, 50);
 	if (r)
 		return -r;
-	r = wtc_tmux_connect(tmux);
+
+	// Let status bars and the like follow along without asking tmux.
+	char *export = NULL;
+	if (bprintf(&export, "/wtc-%u", getuid()) ||
+	    wtc_tmux_set_export_name(tmux, export))
+		warn("main: The model won't be published to other programs!");
+	free(export);
+
+	// If we've just been upgraded, pick up where the old process left off.
+	r = -1;
+	const char *handover = getenv(WTC_HANDOVER_ENV);
+	if (handover) {
+		r = wtc_tmux_handover_resume(tmux, atoi(handover));
+		if (r)
+			warn("main: Couldn't resume tmux connection: %d", r);
+		unsetenv(WTC_HANDOVER_ENV);
+	}
+	if (r)
+		r = wtc_tmux_connect(tmux);
 	if (r)
 		return -r;
 
+	if (setup_upgrade())
+		warn("main: Live upgrades will be unavailable!");
+	if (setup_stats())
+		warn("main: Frame statistics won't be available!");
+
 	wlc_run();
 
+	if (upgrade)
+		exec_upgrade(argv);
+
 	wtc_tmux_disconnect(tmux);
 	wtc_tmux_unref(tmux);
+	wtc_tmux_cmd_free(split_cmd);
+	wtc_tmux_cmd_free(kill_cmd);
+	free_layout();
 	return EXIT_SUCCESS;
 }
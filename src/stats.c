@@ -0,0 +1,166 @@
+/*
+ * wtc - stats.c
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "stats.h"
+
+#include "log.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+void wtc_hist_add(struct wtc_hist *hist, uint64_t val)
+{
+	int bucket = val ? 64 - __builtin_clzll(val) : 0;
+	if (bucket >= WTC_HIST_BUCKETS)
+		bucket = WTC_HIST_BUCKETS - 1;
+
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum += val;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+uint64_t wtc_hist_percentile(const struct wtc_hist *hist, int pct)
+{
+	uint64_t seen = 0, want;
+
+	if (!hist->count)
+		return 0;
+
+	// The rank of the percentile, rounded up, and at least 1
+	want = (hist->count * pct + 99) / 100;
+	if (!want)
+		want = 1;
+
+	for (int i = 0; i < WTC_HIST_BUCKETS - 1; ++i) {
+		seen += hist->buckets[i];
+		if (seen < want)
+			continue;
+
+		uint64_t top = i ? (1ULL << i) - 1 : 0;
+		return top < hist->max ? top : hist->max;
+	}
+
+	return hist->max;
+}
+
+uint64_t wtc_stats_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void wtc_frame_stats_layout(struct wtc_frame_stats *stats, uint64_t now,
+                            uint64_t views)
+{
+	if (views && !stats->pending_since)
+		stats->pending_since = now;
+	stats->pending_views += views;
+}
+
+void wtc_frame_stats_frame(struct wtc_frame_stats *stats, uint64_t now,
+                           unsigned long refresh_id, uint64_t tmux_ns,
+                           uint64_t queued_ns, struct wtc_frame *frame)
+{
+	struct wtc_frame f;
+	uint64_t elapsed, pending;
+
+	memset(&f, 0, sizeof(f));
+	if (!stats->last_frame)
+		goto out;
+
+	elapsed = now - stats->last_frame;
+	f.interval_us = elapsed / 1000;
+	f.tmux_us = (tmux_ns - stats->tmux_ns) / 1000;
+	f.views = stats->pending_views;
+	if (refresh_id != stats->refresh_id) {
+		f.first_refresh = stats->refresh_id + 1;
+		f.last_refresh = refresh_id;
+	}
+
+	// wlc only renders on damage, so the time since the last frame may
+	// be idle. Only count the vblanks which went by while work was
+	// waiting to be shown. If the refresh is too old to be remembered, it
+	// started before the last frame at the latest.
+	pending = stats->pending_since;
+	if (f.first_refresh) {
+		if (!queued_ns)
+			queued_ns = stats->last_frame;
+		if (!pending || queued_ns < pending)
+			pending = queued_ns;
+	}
+	// Work which became pending just after a vblank is still on time at
+	// the next one, a little under two periods later, so one period of
+	// waiting is always allowed.
+	if (pending && now > pending && now - pending >= 2 * WTC_FRAME_NS)
+		f.missed = (now - pending) / WTC_FRAME_NS - 1;
+
+	wtc_hist_add(&stats->interval, f.interval_us);
+	wtc_hist_add(&stats->tmux, f.tmux_us);
+	wtc_hist_add(&stats->views, f.views);
+	stats->frames++;
+	stats->missed += f.missed;
+	if (f.missed > stats->slowest.missed)
+		stats->slowest = f;
+
+out:
+	stats->last_frame = now;
+	stats->tmux_ns = tmux_ns;
+	stats->refresh_id = refresh_id;
+	stats->pending_views = 0;
+	stats->pending_since = 0;
+	if (frame)
+		*frame = f;
+}
+
+static void dump_hist(const char *name, const char *what,
+                      const struct wtc_hist *hist)
+{
+	info("%s: %s: n %" PRIu64 " mean %" PRIu64 " p50 %" PRIu64
+	     " p90 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64, name, what,
+	     hist->count, hist->count ? hist->sum / hist->count : 0,
+	     wtc_hist_percentile(hist, 50), wtc_hist_percentile(hist, 90),
+	     wtc_hist_percentile(hist, 99), hist->max);
+}
+
+void wtc_frame_stats_dump(const struct wtc_frame_stats *stats,
+                          const char *name)
+{
+	const struct wtc_frame *s = &stats->slowest;
+
+	info("%s: %" PRIu64 " frames, %" PRIu64 " missed vblanks", name,
+	     stats->frames, stats->missed);
+	dump_hist(name, "frame interval (us)", &stats->interval);
+	dump_hist(name, "tmux refreshes (us)", &stats->tmux);
+	dump_hist(name, "views laid out", &stats->views);
+	if (s->missed)
+		info("%s: slowest frame: %" PRIu64 " us, %" PRIu64 " us in tmux, "
+		     "%" PRIu64 " views, refreshes %lu-%lu", name, s->interval_us,
+		     s->tmux_us, s->views, s->first_refresh, s->last_refresh);
+}
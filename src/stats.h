@@ -0,0 +1,143 @@
+/*
+ * wtc - stats.h
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * wtc - Frame Statistics
+ *
+ * Every output records how its frames are paced and how much tmux driven
+ * work led up to each one: the time between frames, the time spent in
+ * tmux refresh cycles since the previous frame, the number of views laid
+ * out since the previous frame, and the number of vblanks missed while
+ * that work waited to be shown. Values go into fixed-size histograms, so
+ * recording never allocates.
+ *
+ * Each frame is also tagged with the tmux refresh cycles which ran before
+ * it (see wtc_tmux_refresh_stats). The frame which missed the most
+ * vblanks keeps its tags, so a slow frame can be traced back to the tmux
+ * events which caused it.
+ */
+
+#ifndef WTC_STATS_H
+#define WTC_STATS_H
+
+#include <stdint.h>
+
+/*
+ * A histogram with power of two buckets: bucket 0 counts zeros and bucket
+ * i counts values in [2^(i - 1), 2^i). The last bucket also takes
+ * everything bigger.
+ */
+#define WTC_HIST_BUCKETS 32
+struct wtc_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[WTC_HIST_BUCKETS];
+};
+
+void wtc_hist_add(struct wtc_hist *hist, uint64_t val);
+
+/*
+ * An upper bound on the pct-th percentile of the recorded values (the top
+ * of the bucket it falls in, capped at the maximum). Returns 0 if nothing
+ * has been recorded.
+ */
+uint64_t wtc_hist_percentile(const struct wtc_hist *hist, int pct);
+
+/*
+ * wlc doesn't report the refresh rate, so vblanks are assumed to come at
+ * 60Hz.
+ */
+#define WTC_FRAME_NS 16666667ULL
+
+/*
+ * A frame and the tmux work which led up to it. first_refresh and
+ * last_refresh are the ids of the tmux refresh cycles which ran since the
+ * previous frame (both 0 if none did).
+ */
+struct wtc_frame {
+	uint64_t interval_us;
+	uint64_t tmux_us;
+	uint64_t views;
+	uint64_t missed;
+	unsigned long first_refresh;
+	unsigned long last_refresh;
+};
+
+struct wtc_frame_stats {
+	/* Microseconds between frames. */
+	struct wtc_hist interval;
+	/* Microseconds spent in tmux refresh cycles between frames. */
+	struct wtc_hist tmux;
+	/* Views laid out between frames. */
+	struct wtc_hist views;
+
+	uint64_t frames;
+	uint64_t missed;
+	/* The frame which missed the most vblanks. */
+	struct wtc_frame slowest;
+
+	/*
+	 * The state as of the last frame, and when views were first laid out
+	 * since (0 if they weren't), in CLOCK_MONOTONIC ns.
+	 */
+	uint64_t last_frame;
+	uint64_t tmux_ns;
+	unsigned long refresh_id;
+	uint64_t pending_views;
+	uint64_t pending_since;
+};
+
+/* CLOCK_MONOTONIC, in nanoseconds. */
+uint64_t wtc_stats_now(void);
+
+/*
+ * Count views laid out at now for the next frame.
+ */
+void wtc_frame_stats_layout(struct wtc_frame_stats *stats, uint64_t now,
+                            uint64_t views);
+
+/*
+ * Record a frame finishing at now. refresh_id and tmux_ns are the tmux
+ * counters at that time, as returned by wtc_tmux_refresh_stats, and
+ * queued_ns is when the first refresh cycle since the previous frame
+ * (stats->refresh_id + 1) was queued, as returned by
+ * wtc_tmux_refresh_queued. Vblanks are only counted as missed from the
+ * time work became pending (the earlier of that and the first layout),
+ * less the one period any work may wait for the next vblank. The
+ * frame is stored in frame (which may be NULL). The first frame only sets
+ * the counters' baseline.
+ */
+void wtc_frame_stats_frame(struct wtc_frame_stats *stats, uint64_t now,
+                           unsigned long refresh_id, uint64_t tmux_ns,
+                           uint64_t queued_ns, struct wtc_frame *frame);
+
+/*
+ * Write a summary of stats to the log, at info level, under name.
+ */
+void wtc_frame_stats_dump(const struct wtc_frame_stats *stats,
+                          const char *name);
+
+#endif // !WTC_STATS_H
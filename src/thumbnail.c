@@ -0,0 +1,287 @@
+/*
+ * wtc - thumbnail.c
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "thumbnail.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wlc/wlc-render.h>
+
+// Switcher geometry, in pixels
+#define SWITCHER_PAD 16
+#define SWITCHER_BORDER 4
+
+static const uint8_t SWITCHER_BG[4] = { 32, 32, 32, 255 };
+static const uint8_t SWITCHER_SEL[4] = { 255, 160, 0, 255 };
+static const uint8_t SWITCHER_EMPTY[4] = { 72, 72, 72, 255 };
+
+/*
+ * Make sure buf can hold at least pixels pixels.
+ */
+static int grow_buf(struct wtc_thumbs *thumbs, size_t pixels)
+{
+	uint8_t *tmp;
+
+	if (4 * pixels <= thumbs->buf_len)
+		return 0;
+
+	tmp = realloc(thumbs->buf, 4 * pixels);
+	if (!tmp) {
+		crit("grow_buf: Couldn't grow thumbnail buffer!");
+		return -ENOMEM;
+	}
+
+	thumbs->buf = tmp;
+	thumbs->buf_len = 4 * pixels;
+	return 0;
+}
+
+/*
+ * Shrink the sw x sh image src into the dw x dh image dst, averaging the
+ * block of source pixels which maps onto each destination pixel.
+ */
+static void downscale(const uint8_t *src, uint32_t sw, uint32_t sh,
+                      uint8_t *dst, uint32_t dw, uint32_t dh)
+{
+	for (uint32_t y = 0; y < dh; ++y) {
+		uint32_t y0 = y * sh / dh;
+		uint32_t y1 = (y + 1) * sh / dh;
+		if (y1 <= y0)
+			y1 = y0 + 1;
+
+		for (uint32_t x = 0; x < dw; ++x) {
+			uint32_t x0 = x * sw / dw;
+			uint32_t x1 = (x + 1) * sw / dw;
+			if (x1 <= x0)
+				x1 = x0 + 1;
+
+			uint32_t sum[4] = { 0 };
+			for (uint32_t sy = y0; sy < y1; ++sy) {
+				const uint8_t *p = src + 4 * (sy * sw + x0);
+				for (uint32_t sx = x0; sx < x1; ++sx, p += 4)
+					for (int c = 0; c < 4; ++c)
+						sum[c] += p[c];
+			}
+
+			uint32_t n = (x1 - x0) * (y1 - y0);
+			uint8_t *d = dst + 4 * (y * dw + x);
+			for (int c = 0; c < 4; ++c)
+				d[c] = sum[c] / n;
+		}
+	}
+}
+
+static void fill(uint8_t *img, uint32_t iw, uint32_t x, uint32_t y,
+                 uint32_t w, uint32_t h, const uint8_t color[4])
+{
+	for (uint32_t j = y; j < y + h; ++j)
+		for (uint32_t i = x; i < x + w; ++i)
+			memcpy(img + 4 * (j * iw + i), color, 4);
+}
+
+/*
+ * Copy thumb into the w x h rectangle at (x, y) of img (which is iw pixels
+ * wide), scaling it to fit with nearest neighbor sampling.
+ */
+static void blit(uint8_t *img, uint32_t iw, uint32_t x, uint32_t y,
+                 uint32_t w, uint32_t h, const struct wtc_thumb *thumb)
+{
+	for (uint32_t j = 0; j < h; ++j) {
+		const uint8_t *row = thumb->pixels + 4 * thumb->w *
+		                     (j * thumb->h / h);
+		uint8_t *out = img + 4 * ((y + j) * iw + x);
+		for (uint32_t i = 0; i < w; ++i)
+			memcpy(out + 4 * i, row + 4 * (i * thumb->w / w), 4);
+	}
+}
+
+int wtc_thumbs_capture(struct wtc_thumbs *thumbs, wlc_handle output,
+                       int window)
+{
+	const struct wlc_size *res = wlc_output_get_virtual_resolution(output);
+	struct wtc_thumb *thumb;
+	struct wlc_geometry out;
+	uint32_t w, h;
+	int r;
+
+	if (!res || !res->w || !res->h)
+		return 0;
+
+	w = res->w < WTC_THUMB_WIDTH ? res->w : WTC_THUMB_WIDTH;
+	h = res->h * w / res->w;
+	if (!h)
+		h = 1;
+
+	// Only a row at a time is read, so the scratch space stays small.
+	r = grow_buf(thumbs, res->w);
+	if (r < 0)
+		return r;
+
+	HASH_FIND_INT(thumbs->cache, &window, thumb);
+	if (!thumb) {
+		thumb = calloc(1, sizeof(struct wtc_thumb));
+		if (!thumb) {
+			crit("wtc_thumbs_capture: Couldn't allocate thumbnail!");
+			return -ENOMEM;
+		}
+
+		thumb->window = window;
+		HASH_ADD_INT(thumbs->cache, window, thumb);
+	}
+
+	if (thumb->w != w || thumb->h != h) {
+		uint8_t *tmp = realloc(thumb->pixels, 4 * w * h);
+		if (!tmp) {
+			crit("wtc_thumbs_capture: Couldn't allocate pixels!");
+			HASH_DEL(thumbs->cache, thumb);
+			free(thumb->pixels);
+			free(thumb);
+			return -ENOMEM;
+		}
+
+		thumb->pixels = tmp;
+		thumb->w = w;
+		thumb->h = h;
+	}
+
+	// Read just the middle row of each band of rows which makes up a row
+	// of the thumbnail. That's h rows instead of the whole framebuffer,
+	// and still averages across each row.
+	for (uint32_t y = 0; y < h; ++y) {
+		const struct wlc_geometry g = {
+			.origin = { 0, (2 * y + 1) * res->h / (2 * h) },
+			.size = { res->w, 1 },
+		};
+		wlc_pixels_read(WLC_RGBA8888, &g, &out, thumbs->buf);
+		if (!out.size.w || !out.size.h) {
+			wtc_thumbs_forget(thumbs, window);
+			return 0;
+		}
+
+		downscale(thumbs->buf, out.size.w, 1, thumb->pixels + 4 * w * y,
+		          w, 1);
+	}
+
+	return 0;
+}
+
+const struct wtc_thumb *wtc_thumbs_get(const struct wtc_thumbs *thumbs,
+                                       int window)
+{
+	struct wtc_thumb *thumb;
+	HASH_FIND_INT(thumbs->cache, &window, thumb);
+	return thumb;
+}
+
+void wtc_thumbs_forget(struct wtc_thumbs *thumbs, int window)
+{
+	struct wtc_thumb *thumb;
+	HASH_FIND_INT(thumbs->cache, &window, thumb);
+	if (!thumb)
+		return;
+
+	HASH_DEL(thumbs->cache, thumb);
+	free(thumb->pixels);
+	free(thumb);
+}
+
+void wtc_thumbs_trim(struct wtc_thumbs *thumbs)
+{
+	free(thumbs->buf);
+	thumbs->buf = NULL;
+	thumbs->buf_len = 0;
+}
+
+void wtc_thumbs_clear(struct wtc_thumbs *thumbs)
+{
+	struct wtc_thumb *thumb, *tmp;
+	HASH_ITER(hh, thumbs->cache, thumb, tmp) {
+		HASH_DEL(thumbs->cache, thumb);
+		free(thumb->pixels);
+		free(thumb);
+	}
+
+	wtc_thumbs_trim(thumbs);
+}
+
+int wtc_thumbs_draw_switcher(struct wtc_thumbs *thumbs, wlc_handle output,
+                             const int *windows, int count, int selected)
+{
+	const struct wlc_size *res = wlc_output_get_virtual_resolution(output);
+	const struct wtc_thumb *thumb;
+	uint32_t cols, rows, cw, ch, pw, ph;
+	int r;
+
+	if (!res || !res->w || !res->h || count <= 0)
+		return 0;
+
+	for (cols = 1; cols * cols < count; ++cols);
+	rows = (count + cols - 1) / cols;
+
+	// Shrink the cells until the grid fits on the output
+	cw = WTC_THUMB_WIDTH;
+	if (cols * (cw + SWITCHER_PAD) + SWITCHER_PAD > res->w)
+		cw = (res->w - SWITCHER_PAD) / cols - SWITCHER_PAD;
+	ch = cw * res->h / res->w;
+	if (rows * (ch + SWITCHER_PAD) + SWITCHER_PAD > res->h) {
+		ch = (res->h - SWITCHER_PAD) / rows - SWITCHER_PAD;
+		cw = ch * res->w / res->h;
+	}
+	if ((int) cw < 1 || (int) ch < 1)
+		return 0;
+
+	pw = cols * (cw + SWITCHER_PAD) + SWITCHER_PAD;
+	ph = rows * (ch + SWITCHER_PAD) + SWITCHER_PAD;
+	r = grow_buf(thumbs, (size_t) pw * ph);
+	if (r < 0)
+		return r;
+
+	fill(thumbs->buf, pw, 0, 0, pw, ph, SWITCHER_BG);
+	for (int i = 0; i < count; ++i) {
+		uint32_t x = SWITCHER_PAD + (i % cols) * (cw + SWITCHER_PAD);
+		uint32_t y = SWITCHER_PAD + (i / cols) * (ch + SWITCHER_PAD);
+
+		if (i == selected)
+			fill(thumbs->buf, pw, x - SWITCHER_BORDER, y - SWITCHER_BORDER,
+			     cw + 2 * SWITCHER_BORDER, ch + 2 * SWITCHER_BORDER,
+			     SWITCHER_SEL);
+
+		thumb = wtc_thumbs_get(thumbs, windows[i]);
+		if (thumb)
+			blit(thumbs->buf, pw, x, y, cw, ch, thumb);
+		else
+			fill(thumbs->buf, pw, x, y, cw, ch, SWITCHER_EMPTY);
+	}
+
+	const struct wlc_geometry g = {
+		.origin = { (res->w - pw) / 2, (res->h - ph) / 2 },
+		.size = { pw, ph },
+	};
+	wlc_pixels_write(WLC_RGBA8888, &g, thumbs->buf);
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * wtc - thumbnail.h
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * wtc - Window Thumbnails
+ *
+ * Each output keeps a downscaled snapshot of a recent frame it showed of
+ * every tmux window, keyed by window id. Snapshots are only taken from
+ * within a wlc render callback (as that is the only time the framebuffer
+ * can be read). Taking one reads a single row of the framebuffer per row
+ * of the thumbnail rather than the whole frame, and hidden windows cost
+ * nothing.
+ *
+ * The cached snapshots are enough to draw a window switcher without
+ * making any hidden client render.
+ */
+
+#ifndef WTC_THUMBNAIL_H
+#define WTC_THUMBNAIL_H
+
+#include "uthash.h"
+
+#include <stdint.h>
+#include <wlc/wlc.h>
+
+/* The width of a thumbnail. The height follows from the output's aspect. */
+#define WTC_THUMB_WIDTH 256
+
+/*
+ * A snapshot of a tmux window. pixels holds w * h RGBA pixels, in the row
+ * order wlc uses, so that they can be handed back to wlc_pixels_write.
+ */
+struct wtc_thumb {
+	int window;
+	uint32_t w;
+	uint32_t h;
+	uint8_t *pixels;
+
+	UT_hash_handle hh;
+};
+
+/*
+ * The snapshots of a single output. Zero initialize before first use. buf
+ * is scratch space for reading the framebuffer and composing the switcher;
+ * it is kept around so that repeated captures don't allocate, until it is
+ * trimmed.
+ */
+struct wtc_thumbs {
+	struct wtc_thumb *cache;
+
+	uint8_t *buf;
+	size_t buf_len;
+};
+
+/*
+ * Snapshot what output is currently showing as the thumbnail of window,
+ * replacing any previous one. This must be called from a render callback.
+ * Returns 0 on success and -ENOMEM if memory can't be allocated.
+ */
+int wtc_thumbs_capture(struct wtc_thumbs *thumbs, wlc_handle output,
+                       int window);
+
+/*
+ * Look up the thumbnail of window. Returns NULL if there isn't one.
+ */
+const struct wtc_thumb *wtc_thumbs_get(const struct wtc_thumbs *thumbs,
+                                       int window);
+
+/*
+ * Drop the thumbnail of window (e.g., because the window closed).
+ */
+void wtc_thumbs_forget(struct wtc_thumbs *thumbs, int window);
+
+/*
+ * Free the scratch space (e.g., once the switcher is closed, as composing
+ * it needs far more than a capture does).
+ */
+void wtc_thumbs_trim(struct wtc_thumbs *thumbs);
+
+/*
+ * Free every thumbnail and the scratch space. thumbs may be reused after.
+ */
+void wtc_thumbs_clear(struct wtc_thumbs *thumbs);
+
+/*
+ * Draw a switcher over the output: the thumbnails of the count windows in
+ * windows, in a grid centered on the output, with the window at index
+ * selected highlighted. Windows without a thumbnail are drawn blank. This
+ * must be called from the output's post render callback.
+ *
+ * Returns 0 on success and -ENOMEM if memory can't be allocated.
+ */
+int wtc_thumbs_draw_switcher(struct wtc_thumbs *thumbs, wlc_handle output,
+                             const int *windows, int count, int selected);
+
+#endif // !WTC_THUMBNAIL_H
@@ -35,6 +35,8 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
+#include <stddef.h>
+#include <time.h>
 #include <unistd.h>
 #include <wait.h>
 #include <wayland-server-core.h>
@@ -47,9 +49,49 @@ void wtc_tmux_pane_free(struct wtc_tmux_pane *pane)
 
 void wtc_tmux_window_free(struct wtc_tmux_window *window)
 {
+	if (!window)
+		return;
+
+	free(window->sessions);
 	free(window);
 }
 
+int wtc_tmux_window_link(struct wtc_tmux_window *wind,
+                         struct wtc_tmux_session *sess)
+{
+	struct wtc_tmux_session **sessions;
+
+	for (int i = 0; i < wind->session_count; ++i)
+		if (wind->sessions[i] == sess)
+			return 0;
+
+	if (wind->session_count == wind->session_cap) {
+		int cap = wind->session_cap ? wind->session_cap * 2 : 2;
+		sessions = realloc(wind->sessions, cap * sizeof(*sessions));
+		if (!sessions) {
+			crit("wtc_tmux_window_link: Couldn't resize sessions list!");
+			return -ENOMEM;
+		}
+		wind->sessions = sessions;
+		wind->session_cap = cap;
+	}
+
+	wind->sessions[wind->session_count++] = sess;
+	return 0;
+}
+
+void wtc_tmux_window_unlink(struct wtc_tmux_window *wind,
+                            struct wtc_tmux_session *sess)
+{
+	for (int i = 0; i < wind->session_count; ++i) {
+		if (wind->sessions[i] != sess)
+			continue;
+
+		wind->sessions[i] = wind->sessions[--wind->session_count];
+		return;
+	}
+}
+
 void wtc_tmux_session_free(struct wtc_tmux_session *sess)
 {
 	if (!sess)
@@ -59,33 +101,93 @@ void wtc_tmux_session_free(struct wtc_tmux_session *sess)
 	free(sess);
 }
 
-void wtc_tmux_client_free(struct wtc_tmux_client *client)
+void wtc_tmux_client_free(struct wtc_tmux *tmux,
+                          struct wtc_tmux_client *client)
 {
 	if (!client)
 		return;
 
-	free((void *) client->name);
+	struct wtc_tmux_pane_ref *ref, *tmp;
+	HASH_ITER(hh, client->visible, ref, tmp) {
+		HASH_DEL(client->visible, ref);
+		free(ref);
+	}
+
+	free(client->flipped);
+	wtc_tmux_atom_put(tmux, client->name);
 	free(client);
 }
 
-void wtc_tmux_key_table_free(struct wtc_tmux_key_table *table)
+void wtc_tmux_key_table_free(struct wtc_tmux *tmux,
+                             struct wtc_tmux_key_table *table)
 {
 	if (!table)
 		return;
 
-	free((void *) table->name);
+	wtc_tmux_atom_put(tmux, table->name);
 	free(table);
 }
 
-void wtc_tmux_key_bind_free(struct wtc_tmux_key_bind *bind)
+void wtc_tmux_key_bind_free(struct wtc_tmux *tmux,
+                            struct wtc_tmux_key_bind *bind)
 {
 	if (!bind)
 		return;
 
-	free((void *) bind->cmd);
+	wtc_tmux_atom_put(tmux, bind->cmd);
 	free(bind);
 }
 
+const char *wtc_tmux_intern_len(struct wtc_tmux *tmux, const char *str,
+                                size_t len)
+{
+	struct wtc_tmux_atom *atom;
+	HASH_FIND(hh, tmux->atoms, str, len, atom);
+	if (atom) {
+		++atom->refs;
+		return atom->str;
+	}
+
+	atom = malloc(sizeof(struct wtc_tmux_atom) + len + 1);
+	if (!atom) {
+		crit("wtc_tmux_intern: Couldn't allocate atom!");
+		return NULL;
+	}
+
+	atom->refs = 1;
+	memcpy(atom->str, str, len);
+	atom->str[len] = '\0';
+	HASH_ADD_KEYPTR(hh, tmux->atoms, atom->str, len, atom);
+
+	return atom->str;
+}
+
+const char *wtc_tmux_intern(struct wtc_tmux *tmux, const char *str)
+{
+	return wtc_tmux_intern_len(tmux, str, strlen(str));
+}
+
+const char *wtc_tmux_atom_find(const struct wtc_tmux *tmux, const char *str)
+{
+	struct wtc_tmux_atom *atom;
+	HASH_FIND(hh, tmux->atoms, str, strlen(str), atom);
+	return atom ? atom->str : NULL;
+}
+
+void wtc_tmux_atom_put(struct wtc_tmux *tmux, const char *atom)
+{
+	if (!atom)
+		return;
+
+	struct wtc_tmux_atom *a = (struct wtc_tmux_atom *)
+		(atom - offsetof(struct wtc_tmux_atom, str));
+	if (--a->refs)
+		return;
+
+	HASH_DEL(tmux->atoms, a);
+	free(a);
+}
+
 static int sigc_cb(int fd, uint32_t mask, void *userdata)
 {
 	struct wtc_tmux *tmux = userdata;
@@ -104,12 +206,19 @@ static int sigc_cb(int fd, uint32_t mask, void *userdata)
 	// child we don't even have that.
 	struct wtc_tmux_cc *prev, *cc;
 	while (pid = waitpid(-1, NULL, WNOHANG)) {
-		if (r < 0) {
+		if (pid < 0) {
 			if (errno == EINTR)
 				continue;
+			if (errno == ECHILD)
+				break;
 
 			warn("sigc_cb: waitpid error: %d", errno);
-			return r;
+			return -errno;
+		}
+
+		if (pid == tmux->probe_pid) {
+			tmux->probe_pid = 0;
+			continue;
 		}
 
 		prev = NULL;
@@ -150,8 +259,10 @@ int wtc_tmux_new(struct wtc_tmux **out)
 	output->ref = 1;
 
 	output->timeout = 5000;
+	output->workers = 4;
 	output->w = 80;
 	output->h = 24;
+	output->export_fd = -1;
 
 	*out = output;
 	return 0;
@@ -175,7 +286,7 @@ static bool cmd_freeable(struct wtc_tmux *tmux, char *ptr)
 
 void wtc_tmux_unref(struct wtc_tmux *tmux)
 {
-	if (!tmux || !tmux->ref || tmux->ref--)
+	if (!tmux || !tmux->ref || --tmux->ref)
 		return;
 
 	if (tmux->connected)
@@ -191,6 +302,28 @@ void wtc_tmux_unref(struct wtc_tmux *tmux)
 	free(tmux->socket_path);
 	free(tmux->config);
 
+	wtc_tmux_export_close(tmux, true);
+	free(tmux->export_name);
+	wtc_tmux_journal_free(tmux);
+	for (int i = 0; i < WTC_TMUX_TMPL_COUNT; ++i)
+		wtc_tmux_cmd_free(tmux->tmpls[i]);
+
+	free(tmux->closures);
+	struct wtc_tmux_pane_ref *ref;
+	while ((ref = tmux->spare_refs)) {
+		tmux->spare_refs = ref->hh.next;
+		free(ref);
+	}
+	free(tmux->cmdbuf);
+	free(tmux->qbuf);
+	free(tmux->ibuf);
+
+	struct wtc_tmux_atom *atom, *tmpa;
+	HASH_ITER(hh, tmux->atoms, atom, tmpa) {
+		HASH_DEL(tmux->atoms, atom);
+		free(atom);
+	}
+
 	free(tmux);
 }
 
@@ -513,17 +646,12 @@ out:
 	return r;
 }
 
-int wtc_tmux_connect(struct wtc_tmux *tmux)
+int wtc_tmux_setup_loop(struct wtc_tmux *tmux)
 {
 	struct sigaction act;
 	int refreshfds[2];
 	int r = 0;
 
-	if (!tmux)
-		return -EINVAL;
-	if (tmux->connected)
-		return 0;
-
 	r = setup_pipe(refreshfds, &(tmux->rfev), wtc_tmux_refresh_cb, tmux);
 	if (r < 0)
 		return r;
@@ -539,7 +667,7 @@ int wtc_tmux_connect(struct wtc_tmux *tmux)
 	act.sa_flags = SA_NOCLDSTOP;
 	r = sigaction(SIGCHLD, &act, &tmux->restore);
 	if (r < 0) {
-		crit("wtc_tmux_connect: Could not set SIGCHLD handler: %d", errno);
+		crit("wtc_tmux_setup_loop: Could not set SIGCHLD handler: %d", errno);
 		r = -errno;
 		goto err_evl;
 	}
@@ -548,26 +676,7 @@ int wtc_tmux_connect(struct wtc_tmux *tmux)
 	if (r < 0)
 		goto err_sig;
 
-	r = wtc_tmux_version_check(tmux);
-	switch (r) {
-	case 0:
-		crit("Invalid tmux version! tmux must either be version 'master' "
-		     "or newer than version '2.4'");
-		r = -1;
-		goto err_sig;
-	case 1:
-		r = 0;
-		break;
-	default:
-		goto err_sig;
-	}
-
-	r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_SESSIONS);
-	if (r < 0)
-		goto err_sig;
-
-	tmux->connected = true;
-	return r;
+	return 0;
 
 err_sig:
 	sigaction(SIGCHLD, &tmux->restore, NULL);
@@ -576,42 +685,43 @@ err_evl:
 	wlc_event_source_remove(tmux->sigc);
 	tmux->sigc = NULL;
 	if (close(sigcpipe[1]))
-		warn("wtc_tmux_connect: Error closing sigcpipe[1]: %d", errno);
+		warn("wtc_tmux_setup_loop: Error closing sigcpipe[1]: %d", errno);
 err_rf:
 	wlc_event_source_remove(tmux->rfev);
 	tmux->rfev = NULL;
 	if (close(tmux->refreshfd))
-		warn("wtc_tmux_connect: Error closing refreshfd: %d", errno);
+		warn("wtc_tmux_setup_loop: Error closing refreshfd: %d", errno);
 	return r;
 }
 
-void wtc_tmux_disconnect(struct wtc_tmux *tmux)
+void wtc_tmux_teardown_loop(struct wtc_tmux *tmux)
 {
-	if (!tmux || !tmux->connected)
-		return;
-
-	struct wtc_tmux_cc *cc;
-	const char *cmd[] = { "detach-client", NULL };
-	for (cc = tmux->ccs; cc; cc = cc->next) {
-		wtc_tmux_cc_exec(cc, cmd, NULL, NULL);
-		wtc_tmux_waitpid(tmux, cc->pid, NULL, 0);
-		wtc_tmux_cc_unref(cc);
-	}
-	tmux->ccs = NULL;
-
 	sigaction(SIGCHLD, &tmux->restore, NULL);
 	memset(&tmux->restore, 0, sizeof(struct sigaction));
 
 	wlc_event_source_remove(tmux->sigc);
 	tmux->sigc = NULL;
 	if (close(sigcpipe[1]))
-		warn("wtc_tmux_disconnect: Error closing sigcpipe[1]: %d", errno);
+		warn("wtc_tmux_teardown_loop: Error closing sigcpipe[1]: %d",
+		     errno);
 
 	wlc_event_source_remove(tmux->rfev);
 	tmux->rfev = NULL;
 	if (close(tmux->refreshfd))
-		warn("wtc_tmux_disconnect: Error closing refreshfd: %d", errno);
+		warn("wtc_tmux_teardown_loop: Error closing refreshfd: %d", errno);
 
+	if (tmux->poll_timer) {
+		wlc_event_source_remove(tmux->poll_timer);
+		tmux->poll_timer = NULL;
+	}
+	if (tmux->connect_timer) {
+		wlc_event_source_remove(tmux->connect_timer);
+		tmux->connect_timer = NULL;
+	}
+}
+
+void wtc_tmux_clear_model(struct wtc_tmux *tmux)
+{
 	struct wtc_tmux_pane *pane, *tmpp;
 	struct wtc_tmux_window *window, *tmpw;
 	struct wtc_tmux_client *client, *tmpc;
@@ -631,7 +741,7 @@ void wtc_tmux_disconnect(struct wtc_tmux *tmux)
 
 	HASH_ITER(hh, tmux->clients, client, tmpc) {
 		HASH_DEL(tmux->clients, client);
-		wtc_tmux_client_free(client);
+		wtc_tmux_client_free(tmux, client);
 	}
 
 	HASH_ITER(hh, tmux->sessions, sess, tmps) {
@@ -642,14 +752,337 @@ void wtc_tmux_disconnect(struct wtc_tmux *tmux)
 	HASH_ITER(hh, tmux->tables, table, tmpt) {
 		HASH_ITER(hh, table->binds, bind, tmpb) {
 			HASH_DEL(table->binds, bind);
-			wtc_tmux_key_bind_free(bind);
+			wtc_tmux_key_bind_free(tmux, bind);
 		}
 
 		HASH_DEL(tmux->tables, table);
-		wtc_tmux_key_table_free(table);
+		wtc_tmux_key_table_free(tmux, table);
+	}
+	tmux->root_table = NULL;
+	tmux->prefix_table = NULL;
+	tmux->keys_loaded = false;
+	tmux->keys_hash = 0;
+}
+
+void wtc_tmux_set_connect_state(struct wtc_tmux *tmux, int state)
+{
+	int r;
+
+	if (tmux->connect_state == state)
+		return;
+
+	debug("wtc_tmux_set_connect_state: %d -> %d", tmux->connect_state,
+	      state);
+	tmux->connect_state = state;
+	if (state != WTC_TMUX_CONNECT_LOADING)
+		tmux->connect_tries = 0;
+	if (!tmux->cbs.connect)
+		return;
+
+	r = tmux->cbs.connect(tmux, state);
+	if (r)
+		warn("wtc_tmux_set_connect_state: Callback returned %d", r);
+}
+
+static int connect_cb(void *userdata)
+{
+	struct wtc_tmux *tmux = userdata;
+
+	if (tmux->connect_state != WTC_TMUX_CONNECT_LOADING)
+		return 0;
+
+	return wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_SESSIONS);
+}
+
+void wtc_tmux_connect_retry(struct wtc_tmux *tmux)
+{
+	unsigned int delay;
+
+	if (tmux->connect_state != WTC_TMUX_CONNECT_LOADING)
+		return;
+
+	if (++tmux->connect_tries >= WTC_TMUX_CONNECT_TRIES) {
+		warn("wtc_tmux_connect_retry: Giving up after %u tries",
+		     tmux->connect_tries);
+		goto fail;
+	}
+
+	if (!tmux->connect_timer) {
+		tmux->connect_timer = wlc_event_loop_add_timer(connect_cb, tmux);
+		if (!tmux->connect_timer) {
+			warn("wtc_tmux_connect_retry: Couldn't create timer!");
+			goto fail;
+		}
+	}
+
+	delay = WTC_TMUX_CONNECT_RETRY_MS << (tmux->connect_tries - 1);
+	info("wtc_tmux_connect_retry: Loading failed. Retrying in %u ms",
+	     delay);
+	wlc_event_source_timer_update(tmux->connect_timer, delay);
+	return;
+
+fail:
+	wtc_tmux_set_connect_state(tmux, WTC_TMUX_CONNECT_FAILED);
+}
+
+/*
+ * Collect the output of tmux -V. Once it's all in, check it and move on to
+ * loading the server's state.
+ */
+static int probe_cb(int fd, uint32_t mask, void *userdata)
+{
+	struct wtc_tmux *tmux = userdata;
+	size_t space;
+	ssize_t n;
+	int r;
+
+	if (mask & WL_EVENT_READABLE) {
+		// Once the pipe has hung up, all that's left is already in it.
+		do {
+			space = sizeof(tmux->probe_out) - 1 - tmux->probe_len;
+			n = read(fd, tmux->probe_out + tmux->probe_len, space);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				warn("probe_cb: Read error: %d", errno);
+				goto fail;
+			}
+			tmux->probe_len += n;
+		} while (n > 0 && space > n && (mask & WL_EVENT_HANGUP));
+
+		if (n > 0 && space > n)
+			return 0;
+	} else if (!(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR))) {
+		return 0;
+	}
+
+	// The child is done with us; sigc_cb reaps it.
+	wlc_event_source_remove(tmux->probe);
+	tmux->probe = NULL;
+	tmux->probe_out[tmux->probe_len] = '\0';
+
+	r = wtc_tmux_version_check(tmux, tmux->probe_out);
+	if (r == 0)
+		crit("Invalid tmux version! tmux must either be version 'master' "
+		     "or newer than version '2.4'");
+	if (r != 1)
+		goto fail_state;
+
+	wtc_tmux_set_connect_state(tmux, WTC_TMUX_CONNECT_LOADING);
+	r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_SESSIONS);
+	if (r < 0)
+		goto fail_state;
+
+	return 0;
+
+fail:
+	wlc_event_source_remove(tmux->probe);
+	tmux->probe = NULL;
+	if (tmux->probe_pid > 0)
+		kill(tmux->probe_pid, SIGKILL);
+	tmux->probe_pid = 0;
+fail_state:
+	wtc_tmux_set_connect_state(tmux, WTC_TMUX_CONNECT_FAILED);
+	return 0;
+}
+
+int wtc_tmux_connect(struct wtc_tmux *tmux)
+{
+	const char *const cmd[] = { "-V", NULL };
+	pid_t pid = 0;
+	int r = 0, fout;
+
+	if (!tmux)
+		return -EINVAL;
+	if (tmux->connected)
+		return 0;
+
+	r = wtc_tmux_setup_loop(tmux);
+	if (r < 0)
+		return r;
+
+	// The version check runs in the background; probe_cb carries on from
+	// there. The child is reaped by sigc_cb.
+	r = wtc_tmux_fork(tmux, cmd, &pid, NULL, &fout, NULL);
+	if (!pid)
+		goto err_loop;
+
+	tmux->probe_len = 0;
+	tmux->probe_pid = pid;
+	tmux->probe = wlc_event_loop_add_fd(fout, WL_EVENT_READABLE, probe_cb,
+	                                    tmux);
+	if (!tmux->probe) {
+		warn("wtc_tmux_connect: Couldn't add probe to event loop!");
+		kill(pid, SIGKILL);
+		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) ;
+		tmux->probe_pid = 0;
+		if (close(fout))
+			warn("wtc_tmux_connect: Error closing fout: %d", errno);
+		r = -1;
+		goto err_loop;
+	}
+
+	tmux->connected = true;
+	wtc_tmux_set_connect_state(tmux, WTC_TMUX_CONNECT_PROBING);
+	return 0;
+
+err_loop:
+	wtc_tmux_teardown_loop(tmux);
+	return r;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Ask cc to detach without waiting for the reply. If the request can't
+ * be written, there's no point in waiting for the client to act on it.
+ */
+static void send_detach(struct wtc_tmux_cc *cc)
+{
+	static const char cmd[] = "detach-client\n";
+	size_t pos = 0;
+	ssize_t r;
+
+	debug("send_detach: Detaching %d", cc->pid);
+	while (pos < sizeof(cmd) - 1) {
+		r = write(cc->fin, cmd + pos, sizeof(cmd) - 1 - pos);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			debug("send_detach: Error writing to %d: %d", cc->pid,
+			      errno);
+			kill(cc->pid, SIGTERM);
+			return;
+		}
+		pos += r;
 	}
+}
+
+/*
+ * Reap every control client which has exited, marking it by setting its
+ * pid to 0, until either all of them are gone or timeout milliseconds
+ * have passed since start (a timeout of 0 waits forever). The children are
+ * all waited for together, so the total time is bounded by timeout rather
+ * than by timeout per client. Returns the number still running.
+ */
+static unsigned int reap_ccs(struct wtc_tmux *tmux,
+                             const struct timespec *start,
+                             unsigned int timeout)
+{
+	struct pollfd pol = { .fd = sigcpipe[0], .events = POLLIN,
+	                      .revents = 0 };
+	struct wtc_tmux_cc *cc;
+	unsigned int left;
+	long wait;
+	pid_t r;
+
+	while (true) {
+		left = 0;
+		for (cc = tmux->ccs; cc; cc = cc->next) {
+			if (cc->pid <= 0)
+				continue;
+
+			while ((r = waitpid(cc->pid, NULL, WNOHANG)) == -1 &&
+			       errno == EINTR) ;
+			if (r == 0)
+				++left;
+			else
+				cc->pid = 0;
+		}
+		if (!left)
+			return 0;
+
+		wait = -1;
+		if (timeout) {
+			wait = timeout - elapsed_ms(start);
+			if (wait <= 0)
+				return left;
+		}
+
+		r = poll(&pol, 1, wait);
+		if (r == -1 && errno != EINTR) {
+			warn("reap_ccs: Error waiting for sigc: %d", errno);
+			return left;
+		}
+		if (r > 0 && read_available(pol.fd, WTC_RDAVL_DISCARD, NULL,
+		                            NULL) < 0)
+			warn("reap_ccs: Error clearing SIGCHLD pipe");
+	}
+}
+
+void wtc_tmux_disconnect(struct wtc_tmux *tmux)
+{
+	if (!tmux || !tmux->connected)
+		return;
+
+	struct wtc_tmux_cc *cc, *next;
+	struct timespec start, term;
+	unsigned int count = 0, left;
+	if (tmux->probe) {
+		wlc_event_source_remove(tmux->probe);
+		tmux->probe = NULL;
+	}
+	// A probe which hasn't been reaped yet is still ours to kill.
+	if (tmux->probe_pid > 0) {
+		kill(tmux->probe_pid, SIGKILL);
+		while (waitpid(tmux->probe_pid, NULL, 0) == -1 &&
+		       errno == EINTR) ;
+		tmux->probe_pid = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (cc = tmux->ccs; cc; cc = cc->next) {
+		send_detach(cc);
+		++count;
+	}
+
+	left = reap_ccs(tmux, &start, tmux->timeout);
+	if (left) {
+		warn("wtc_tmux_disconnect: %u clients didn't detach in time. "
+		     "Terminating...", left);
+		for (cc = tmux->ccs; cc; cc = cc->next)
+			if (cc->pid > 0)
+				kill(cc->pid, SIGTERM);
+
+		clock_gettime(CLOCK_MONOTONIC, &term);
+		left = reap_ccs(tmux, &term, WTC_TMUX_TERM_GRACE);
+	}
+	if (left) {
+		warn("wtc_tmux_disconnect: %u clients ignored SIGTERM. "
+		     "Killing...", left);
+		for (cc = tmux->ccs; cc; cc = cc->next) {
+			if (cc->pid <= 0)
+				continue;
+
+			kill(cc->pid, SIGKILL);
+			while (waitpid(cc->pid, NULL, 0) == -1 && errno == EINTR) ;
+		}
+	}
+
+	for (cc = tmux->ccs; cc; cc = next) {
+		next = cc->next;
+		wtc_tmux_cc_unref(cc);
+	}
+	tmux->ccs = NULL;
+
+	wtc_tmux_teardown_loop(tmux);
+	wtc_tmux_clear_model(tmux);
+	if (wtc_tmux_export_update(tmux) < 0)
+		warn("wtc_tmux_disconnect: Couldn't publish the empty model");
 
 	tmux->connected = false;
+	tmux->connect_state = WTC_TMUX_CONNECT_NONE;
+	tmux->connect_tries = 0;
+
+	info("wtc_tmux_disconnect: Disconnected %u clients in %ld ms", count,
+	     elapsed_ms(&start));
 }
 
 bool wtc_tmux_is_connected(const struct wtc_tmux *tmux)
@@ -671,6 +1104,20 @@ unsigned int wtc_tmux_get_timeout(const struct wtc_tmux *tmux)
 	return tmux->timeout;
 }
 
+int wtc_tmux_set_decode_workers(struct wtc_tmux *tmux, unsigned int workers)
+{
+	if (!tmux || workers == 0 || workers > WTC_MAX_WORKERS)
+		return -EINVAL;
+
+	tmux->workers = workers;
+	return 0;
+}
+
+unsigned int wtc_tmux_get_decode_workers(const struct wtc_tmux *tmux)
+{
+	return tmux->workers;
+}
+
 int wtc_tmux_set_size(struct wtc_tmux *tmux, unsigned int w, unsigned int h)
 {
 	struct wtc_tmux_cc *cc;
@@ -718,6 +1165,32 @@ int wtc_tmux_set_client_session_changed_cb(struct wtc_tmux *tmux,
 	return 0;
 }
 
+int wtc_tmux_set_connect_cb(struct wtc_tmux *tmux,
+	int (*cb)(struct wtc_tmux *tmux, int state))
+{
+	if (!tmux)
+		return -EINVAL;
+
+	tmux->cbs.connect = cb;
+	return 0;
+}
+
+int wtc_tmux_get_connect_state(const struct wtc_tmux *tmux)
+{
+	return tmux->connect_state;
+}
+
+int wtc_tmux_set_client_visibility_changed_cb(struct wtc_tmux *tmux,
+	int (*cb)(struct wtc_tmux *tmux, const struct wtc_tmux_client *client,
+	          const int *panes, size_t count))
+{
+	if (!tmux)
+		return -EINVAL;
+
+	tmux->cbs.client_visibility_changed = cb;
+	return 0;
+}
+
 int wtc_tmux_set_new_session_cb(struct wtc_tmux *tmux,
 	int (*cb)(struct wtc_tmux *tmux, const struct wtc_tmux_session *sess))
 {
@@ -809,6 +1282,133 @@ int wtc_tmux_set_pane_mode_changed_cb(struct wtc_tmux *tmux,
 	tmux->cbs.pane_mode_changed = cb;
 }
 
+int wtc_tmux_load_key_binds(struct wtc_tmux *tmux)
+{
+	if (!tmux)
+		return -EINVAL;
+	if (tmux->keys_loaded || !tmux->connected)
+		return 0;
+
+	return wtc_tmux_reload_key_binds(tmux);
+}
+
+int wtc_tmux_invalidate_key_binds(struct wtc_tmux *tmux)
+{
+	if (!tmux)
+		return -EINVAL;
+	if (!tmux->keys_loaded)
+		return 0;
+
+	return wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_KEYS);
+}
+
+bool wtc_tmux_key_table_step(const struct wtc_tmux *tmux,
+                             const struct wtc_tmux_session *sess,
+                             const struct wtc_tmux_key_table **table,
+                             key_code code,
+                             const struct wtc_tmux_key_bind **bind)
+{
+	const struct wtc_tmux_key_table *cur = *table;
+	struct wtc_tmux_key_bind *bnd = NULL;
+
+	*bind = NULL;
+	if (!cur)
+		cur = tmux->root_table;
+	if (!cur) {
+		*table = NULL;
+		return false;
+	}
+
+	HASH_FIND(hh, cur->binds, &code, sizeof(code), bnd);
+	if (bnd) {
+		*bind = bnd;
+		*table = bnd->next_table;
+		return true;
+	}
+
+	if (cur == tmux->root_table && sess &&
+	    (code == sess->prefix || code == sess->prefix2)) {
+		*table = tmux->prefix_table;
+		return true;
+	}
+
+	*table = tmux->root_table;
+	return false;
+}
+
+/*
+ * Fetch the extents of pane along the axis of dir (pos and len) and across
+ * it (cpos and clen).
+ */
+static void pane_extents(const struct wtc_tmux_pane *pane, int dir, int *pos,
+                         int *len, int *cpos, int *clen)
+{
+	if (dir == WTC_TMUX_PANE_LEFT || dir == WTC_TMUX_PANE_RIGHT) {
+		*pos = pane->x;
+		*len = pane->w;
+		*cpos = pane->y;
+		*clen = pane->h;
+	} else {
+		*pos = pane->y;
+		*len = pane->h;
+		*cpos = pane->x;
+		*clen = pane->w;
+	}
+}
+
+const struct wtc_tmux_pane *
+wtc_tmux_pane_neighbor(const struct wtc_tmux_pane *pane, int dir)
+{
+	const struct wtc_tmux_pane *next, *best = NULL;
+	int pos, len, cpos, clen, npos, nlen, ncpos, nclen;
+	int edge, size = 0;
+
+	if (!pane || dir < WTC_TMUX_PANE_LEFT || dir > WTC_TMUX_PANE_DOWN)
+		return NULL;
+	if (!pane->window)
+		return pane;
+
+	// tmux doesn't tell us the window size, but the panes tile it.
+	for (next = pane->window->panes; next; next = next->next) {
+		pane_extents(next, dir, &npos, &nlen, &ncpos, &nclen);
+		if (npos + nlen > size)
+			size = npos + nlen;
+	}
+
+	// This mirrors window_pane_find_* in tmux. Panes are separated by a
+	// one cell border, and moving off an edge wraps to the opposite side.
+	pane_extents(pane, dir, &pos, &len, &cpos, &clen);
+	if (dir == WTC_TMUX_PANE_LEFT || dir == WTC_TMUX_PANE_UP) {
+		edge = pos == 0 ? size + 1 : pos;
+	} else {
+		edge = pos + len + 1;
+		if (edge >= size)
+			edge = 0;
+	}
+
+	for (next = pane->window->panes; next; next = next->next) {
+		if (next == pane)
+			continue;
+
+		pane_extents(next, dir, &npos, &nlen, &ncpos, &nclen);
+		if (dir == WTC_TMUX_PANE_LEFT || dir == WTC_TMUX_PANE_UP) {
+			if (npos + nlen + 1 != edge)
+				continue;
+		} else if (npos != edge) {
+			continue;
+		}
+
+		// Do the panes overlap along the shared border?
+		if (ncpos > cpos + clen || ncpos + nclen - 1 < cpos)
+			continue;
+
+		if (!best || next == pane->window->last_pane)
+			best = next;
+	}
+
+	return best ? best : pane;
+}
+
 const struct wtc_tmux_session *
 wtc_tmux_root_session(const struct wtc_tmux *tmux)
 {
@@ -846,6 +1446,202 @@ int wtc_tmux_add_closure(struct wtc_tmux *tmux,
 	return 0;
 }
 
+static bool pane_shown(const struct wtc_tmux_client *client,
+                       const struct wtc_tmux_pane *pane)
+{
+	return client->session && pane->window &&
+	       pane->window == client->session->active_window &&
+	       !pane->in_mode && pane->w > 0 && pane->h > 0;
+}
+
+/*
+ * Record that pane id flipped for client. Flipping back cancels out.
+ */
+static int record_flip(struct wtc_tmux_client *client, int id)
+{
+	int *tmp;
+
+	for (size_t i = 0; i < client->flipped_len; ++i) {
+		if (client->flipped[i] != id)
+			continue;
+
+		client->flipped[i] = client->flipped[--client->flipped_len];
+		return 0;
+	}
+
+	if (client->flipped_len == client->flipped_cap) {
+		size_t cap = client->flipped_cap ? 2 * client->flipped_cap : 8;
+		tmp = realloc(client->flipped, cap * sizeof(int));
+		if (!tmp) {
+			crit("record_flip: Couldn't grow flipped!");
+			return -ENOMEM;
+		}
+
+		client->flipped = tmp;
+		client->flipped_cap = cap;
+	}
+
+	client->flipped[client->flipped_len++] = id;
+	return 0;
+}
+
+static int set_visible(struct wtc_tmux *tmux, struct wtc_tmux_client *client,
+                       int id, bool vis)
+{
+	struct wtc_tmux_pane_ref *ref;
+	HASH_FIND_INT(client->visible, &id, ref);
+
+	if (vis == !!ref)
+		return 0;
+
+	if (vis) {
+		ref = tmux->spare_refs;
+		if (ref)
+			tmux->spare_refs = ref->hh.next;
+		else
+			ref = malloc(sizeof(struct wtc_tmux_pane_ref));
+		if (!ref) {
+			crit("set_visible: Couldn't allocate pane reference!");
+			return -ENOMEM;
+		}
+
+		memset(ref, 0, sizeof(struct wtc_tmux_pane_ref));
+		ref->id = id;
+		HASH_ADD_INT(client->visible, id, ref);
+	} else {
+		HASH_DEL(client->visible, ref);
+		ref->hh.next = tmux->spare_refs;
+		tmux->spare_refs = ref;
+	}
+
+	return record_flip(client, id);
+}
+
+/*
+ * Recompute the visible set of client from scratch. This is only needed
+ * when the window the client shows changes, and only touches the panes
+ * in the old and new windows.
+ */
+static int update_client(struct wtc_tmux *tmux,
+                         struct wtc_tmux_client *client)
+{
+	struct wtc_tmux_pane_ref *ref, *tmp;
+	struct wtc_tmux_pane *pane;
+	int r;
+
+	HASH_ITER(hh, client->visible, ref, tmp) {
+		HASH_FIND_INT(tmux->panes, &ref->id, pane);
+		if (pane && pane_shown(client, pane))
+			continue;
+
+		r = set_visible(tmux, client, ref->id, false);
+		if (r < 0)
+			return r;
+	}
+
+	if (!client->session || !client->session->active_window)
+		return 0;
+
+	pane = client->session->active_window->panes;
+	for ( ; pane; pane = pane->next) {
+		r = set_visible(tmux, client, pane->id,
+		                pane_shown(client, pane));
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int update_pane(struct wtc_tmux *tmux, struct wtc_tmux_pane *pane,
+                       bool closed)
+{
+	struct wtc_tmux_client *client;
+	int r;
+
+	for (client = tmux->clients; client; client = client->hh.next) {
+		r = set_visible(tmux, client, pane->id,
+		                !closed && pane_shown(client, pane));
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int update_window(struct wtc_tmux *tmux,
+                         struct wtc_tmux_window *wind)
+{
+	struct wtc_tmux_client *client;
+	int r;
+
+	for (client = tmux->clients; client; client = client->hh.next) {
+		if (!client->session || client->session->active_window != wind)
+			continue;
+
+		r = update_client(tmux, client);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+int wtc_tmux_update_visibility(struct wtc_tmux *tmux)
+{
+	struct wtc_tmux_cb_closure *cl, cb;
+	struct wtc_tmux_client *client;
+	int r = 0;
+
+	// Only the closures queued so far; we add to the list below.
+	size_t count = tmux->closure_size;
+	for (size_t i = 0; i < count && r >= 0; ++i) {
+		cl = &tmux->closures[i];
+		switch (cl->fid) {
+		case WTC_TMUX_CB_CLIENT_SESSION_CHANGED:
+			if (!cl->free_after_use)
+				r = update_client(tmux, cl->value.client);
+			break;
+		case WTC_TMUX_CB_SESSION_WINDOW_CHANGED:
+			client = cl->value.session->clients;
+			for ( ; client && r >= 0; client = client->next)
+				r = update_client(tmux, client);
+			break;
+		case WTC_TMUX_CB_WINDOW_PANE_CHANGED:
+			// Panes may have been moved in or out of the window.
+			r = update_window(tmux, cl->value.window);
+			break;
+		case WTC_TMUX_CB_NEW_PANE:
+		case WTC_TMUX_CB_PANE_RESIZED:
+		case WTC_TMUX_CB_PANE_MODE_CHANGED:
+			r = update_pane(tmux, cl->value.pane, false);
+			break;
+		case WTC_TMUX_CB_PANE_CLOSED:
+			r = update_pane(tmux, cl->value.pane, true);
+			break;
+		default:
+			break;
+		}
+	}
+	if (r < 0)
+		return r;
+
+	for (client = tmux->clients; client; client = client->hh.next) {
+		if (!client->flipped_len)
+			continue;
+
+		cb.fid = WTC_TMUX_CB_CLIENT_VISIBILITY_CHANGED;
+		cb.tmux = tmux;
+		cb.value.client = client;
+		cb.free_after_use = false;
+		r = wtc_tmux_add_closure(tmux, cb);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
 int wtc_tmux_closure_invoke(struct wtc_tmux_cb_closure *cl)
 {
 	int r = 0;
@@ -855,16 +1651,32 @@ int wtc_tmux_closure_invoke(struct wtc_tmux_cb_closure *cl)
 		return -EINVAL;
 
 	struct wtc_tmux *tmux = cl->tmux;
+	struct wtc_tmux_cc *cc;
 	switch (cl->fid) {
 	case WTC_TMUX_CB_CLIENT_SESSION_CHANGED:
 		p = 3;
 		if (tmux->cbs.client_session_changed)
 			r = tmux->cbs.client_session_changed(tmux, cl->value.client);
 		break;
+	case WTC_TMUX_CB_CLIENT_VISIBILITY_CHANGED:
+		p = 3;
+		if (tmux->cbs.client_visibility_changed)
+			r = tmux->cbs.client_visibility_changed(tmux, cl->value.client,
+			                                        cl->value.client->flipped,
+			                                        cl->value.client->flipped_len);
+		if (r == 0)
+			cl->value.client->flipped_len = 0;
+		break;
 
 	case WTC_TMUX_CB_NEW_SESSION:
 		p = 2;
-		r = wtc_tmux_cc_launch(tmux, cl->value.session);
+		// The refresh which found the session normally attached to it
+		// already.
+		for (cc = tmux->ccs; cc; cc = cc->next)
+			if (cc->session == cl->value.session)
+				break;
+		if (!cc)
+			r = wtc_tmux_cc_launch(tmux, cl->value.session);
 		if (r < 0)
 			break;
 		if (tmux->cbs.new_session)
@@ -945,7 +1757,7 @@ int wtc_tmux_closure_invoke(struct wtc_tmux_cb_closure *cl)
 		cl->value.session = NULL;
 		break;
 	case 3:
-		wtc_tmux_client_free(cl->value.client);
+		wtc_tmux_client_free(cl->tmux, cl->value.client);
 		cl->value.client = NULL;
 		break;
 	default:
@@ -968,7 +1780,7 @@ void wtc_tmux_clear_closures(struct wtc_tmux *tmux)
 
 		switch (cb.fid) {
 		case WTC_TMUX_CB_CLIENT_SESSION_CHANGED:
-			wtc_tmux_client_free(cb.value.client);
+			wtc_tmux_client_free(tmux, cb.value.client);
 			break;
 		case WTC_TMUX_CB_NEW_SESSION:
 		case WTC_TMUX_CB_SESSION_CLOSED:
@@ -996,7 +1808,11 @@ const struct wtc_tmux_client *
 wtc_tmux_lookup_client(const struct wtc_tmux *tmux, const char *name)
 {
 	struct wtc_tmux_client *res;
-	HASH_FIND(hh, tmux->clients, name, strlen(name), res);
+	const char *atom = wtc_tmux_atom_find(tmux, name);
+	if (!atom)
+		return NULL;
+
+	HASH_FIND_PTR(tmux->clients, &atom, res);
 	return res;
 }
 
@@ -1024,10 +1840,178 @@ wtc_tmux_lookup_pane(const struct wtc_tmux *tmux, int id)
 	return pane;
 }
 
+void wtc_tmux_refresh_stats(const struct wtc_tmux *tmux, unsigned long *id,
+                            uint64_t *cb_ns)
+{
+	if (id)
+		*id = tmux->refresh_id;
+	if (cb_ns)
+		*cb_ns = tmux->refresh_cb_ns;
+}
+
+uint64_t wtc_tmux_refresh_queued(const struct wtc_tmux *tmux,
+                                 unsigned long id)
+{
+	if (!id || id > tmux->refresh_id ||
+	    tmux->refresh_id - id >= WTC_TMUX_REFRESH_HISTORY)
+		return 0;
+
+	return tmux->refresh_queued[id % WTC_TMUX_REFRESH_HISTORY];
+}
+
+static long now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int poll_cb(void *userdata);
+
+/*
+ * Queue the refresh held for cc's session.
+ */
+static int poll_flush(struct wtc_tmux_cc *cc)
+{
+	int flags = cc->poll_refresh;
+
+	if (!cc->poll_pending)
+		return 0;
+
+	cc->poll_refresh = 0;
+	cc->poll_pending = false;
+	return wtc_tmux_queue_refresh(cc->tmux, flags);
+}
+
+/*
+ * Close cc's rate window if it has run its course, switching its session
+ * between polled and event driven refreshes as its rate calls for.
+ */
+static int rate_roll(struct wtc_tmux_cc *cc, long now)
+{
+	struct wtc_tmux *tmux = cc->tmux;
+	long elapsed = now - cc->rate_start;
+	if (elapsed < WTC_TMUX_RATE_WINDOW_MS)
+		return 0;
+
+	cc->rate = cc->rate_count * 1000 / elapsed;
+	cc->rate_count = 0;
+	cc->rate_start = now;
+
+	if (cc->polled && cc->rate <= WTC_TMUX_POLL_EXIT) {
+		info("rate_roll: Session $%d calmed down (%lu/s); back to events",
+		     cc->session->id, cc->rate);
+		cc->polled = false;
+		return poll_flush(cc);
+	}
+	if (cc->polled || cc->rate < WTC_TMUX_POLL_ENTER)
+		return 0;
+
+	if (!tmux->poll_timer) {
+		tmux->poll_timer = wlc_event_loop_add_timer(poll_cb, tmux);
+		if (!tmux->poll_timer) {
+			warn("rate_roll: Couldn't create poll timer!");
+			return 0;
+		}
+		wlc_event_source_timer_update(tmux->poll_timer, WTC_TMUX_POLL_MS);
+	}
+
+	info("rate_roll: Session $%d is noisy (%lu/s); polling it",
+	     cc->session->id, cc->rate);
+	cc->polled = true;
+	return 0;
+}
+
+/*
+ * Refresh what the polled sessions held back, and see whether they have
+ * calmed down. Polling goes on while any session needs it.
+ */
+static int poll_cb(void *userdata)
+{
+	struct wtc_tmux *tmux = userdata;
+	struct wtc_tmux_cc *cc;
+	bool polling = false;
+	long now = now_ms();
+	int r = 0, s;
+
+	for (cc = tmux->ccs; cc; cc = cc->next) {
+		if (!cc->polled)
+			continue;
+
+		s = rate_roll(cc, now);
+		if (cc->polled)
+			s = poll_flush(cc);
+		r = r < 0 ? r : s;
+		polling |= cc->polled;
+	}
+
+	if (polling) {
+		wlc_event_source_timer_update(tmux->poll_timer, WTC_TMUX_POLL_MS);
+	} else {
+		wlc_event_source_remove(tmux->poll_timer);
+		tmux->poll_timer = NULL;
+	}
+
+	return r;
+}
+
+int wtc_tmux_notify_refresh(struct wtc_tmux_cc *cc, int flags)
+{
+	struct wtc_tmux *tmux = cc->tmux;
+	int r;
+
+	if (!cc->session)
+		return wtc_tmux_queue_refresh(tmux, flags);
+
+	cc->rate_count++;
+	r = rate_roll(cc, now_ms());
+	if (r < 0)
+		return r;
+	if (!cc->polled)
+		return wtc_tmux_queue_refresh(tmux, flags);
+
+	cc->poll_refresh |= flags;
+	cc->poll_pending = true;
+	return 0;
+}
+
+int wtc_tmux_session_rate(const struct wtc_tmux *tmux,
+                          const struct wtc_tmux_session *sess,
+                          unsigned long *rate, bool *polled)
+{
+	struct wtc_tmux_cc *cc;
+
+	for (cc = tmux->ccs; cc; cc = cc->next) {
+		if (cc->session != sess)
+			continue;
+
+		if (rate)
+			*rate = cc->rate;
+		if (polled)
+			*polled = cc->polled;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+bool wtc_tmux_pane_visible(const struct wtc_tmux_client *client,
+                           const struct wtc_tmux_pane *pane)
+{
+	struct wtc_tmux_pane_ref *ref;
+	HASH_FIND_INT(client->visible, &pane->id, ref);
+	return ref;
+}
+
 const struct wtc_tmux_key_table *
 wtc_tmux_lookup_key_table(const struct wtc_tmux *tmux, const char *name)
 {
 	struct wtc_tmux_key_table *tbl;
-	HASH_FIND(hh, tmux->tables, name, strlen(name), tbl);
+	const char *atom = wtc_tmux_atom_find(tmux, name);
+	if (!atom)
+		return NULL;
+
+	HASH_FIND_PTR(tmux->tables, &atom, tbl);
 	return tbl;
 }
@@ -48,6 +48,7 @@
 #define WTC_TMUX_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "tmux_keycode.h"
 #include "uthash.h"
@@ -125,6 +126,11 @@ struct wtc_tmux_window
 
 	/* The active pane in the window. */
 	struct wtc_tmux_pane *active_pane;
+	/*
+	 * The pane which was active before active_pane (i.e., the target of
+	 * last-pane) or NULL if there is none.
+	 */
+	struct wtc_tmux_pane *last_pane;
 	/* The number of panes in this window. */
 	int pane_count;
 	/*
@@ -134,6 +140,19 @@ struct wtc_tmux_window
 	 */
 	struct wtc_tmux_pane *panes;
 
+	/*
+	 * The sessions this window is linked into. This is the other side of
+	 * wtc_tmux_session->windows: a window linked into a session several
+	 * times is still listed only once here.
+	 */
+	int session_count;
+	struct wtc_tmux_session **sessions;
+
+	/* Internal bookkeeping for reloads. */
+	int session_cap;
+	unsigned long reload_pass;
+	bool pending; // Added or dropped by a notification, not settled yet
+
 	/* So we can be in a hash map. */
 	UT_hash_handle hh;
 };
@@ -220,6 +239,21 @@ struct wtc_tmux_client
 	struct wtc_tmux_client *previous;
 	struct wtc_tmux_client *next;
 
+	/*
+	 * The set of panes this client shows: those in its session's active
+	 * window which aren't in a mode and have a non-zero size. This is
+	 * updated incrementally as the server changes; query it with
+	 * wtc_tmux_pane_visible.
+	 */
+	struct wtc_tmux_pane_ref *visible;
+	/*
+	 * The ids of the panes which joined or left visible since the last
+	 * client visibility changed callback.
+	 */
+	int *flipped;
+	size_t flipped_len;
+	size_t flipped_cap;
+
 	/* So we can be in a hash map. */
 	UT_hash_handle hh;
 };
@@ -230,6 +264,10 @@ struct wtc_tmux_client
  * effects may happen. Relevant here, an effect is switching key tables.
  * For instance, the prefix key transitions into the prefix key table. This
  * allows for a lot of bindings which don't interfere with normal typing.
+ *
+ * Once a key table has been seen it is kept until disconnection (even if
+ * all of its bindings are removed), so pointers to key tables remain valid
+ * across reloads.
  */
 struct wtc_tmux_key_table
 {
@@ -265,6 +303,33 @@ struct wtc_tmux_key_bind
 	/* Can this key be held down to repeat the command. */
 	bool repeat;
 
+	/*
+	 * What this binding does, as determined from cmd when the bindings are
+	 * loaded. WTC_TMUX_KEY_BIND_COMMAND bindings need to have cmd run by
+	 * tmux. WTC_TMUX_KEY_BIND_SWITCH bindings only transition into
+	 * next_table (e.g., "switch-client -T resize") and so can be handled
+	 * entirely locally.
+	 *
+	 * WTC_TMUX_KEY_BIND_SELECT_PANE ("select-pane -L", etc.) and
+	 * WTC_TMUX_KEY_BIND_LAST_PANE ("last-pane") bindings still need to
+	 * have cmd run by tmux, but their effect on the active pane is known
+	 * in advance and so can be predicted (see wtc_tmux_pane_neighbor).
+	 * For the former, direction holds the direction of the move.
+	 */
+	int action;
+#define WTC_TMUX_KEY_BIND_COMMAND     0
+#define WTC_TMUX_KEY_BIND_SWITCH      1
+#define WTC_TMUX_KEY_BIND_SELECT_PANE 2
+#define WTC_TMUX_KEY_BIND_LAST_PANE   3
+	int direction;
+	/*
+	 * Whether cmd may change the key bindings themselves (i.e., it runs
+	 * bind-key, unbind-key or source-file, or commands we can't see, as
+	 * command-prompt and run-shell do). Running such a binding should be
+	 * followed by wtc_tmux_invalidate_key_binds.
+	 */
+	bool rebinds;
+
 	/* The wtc_tmux_key_table which contains this key binding. */
 	struct wtc_tmux_key_table *table;
 	/* 
@@ -354,12 +419,18 @@ const char *wtc_tmux_get_config_file(const struct wtc_tmux *tmux);
  * for how the tmux connection will be configured can be set using the
  * previous functions. Once wtc_tmux_connect has been called successfully,
  * they will have no effect until after wtc_tmux_disconnect has been called
- * successfully. Both of these functions are synchronous and respect the
- * timeout value.
+ * successfully. wtc_tmux_disconnect is synchronous and respects the timeout
+ * value: every control client is asked to detach at once, and any which
+ * haven't exited when the timeout runs out are terminated, so the whole
+ * disconnect takes at most a little over one timeout.
  *
- * When wtc_tmux_connect is called, a list of all of the currently running
- * sessions is retrieved from the server. Then a control mode client is
- * attached to each one in order to properly track the entire server.
+ * wtc_tmux_connect doesn't wait for the server: it returns once the
+ * connection has been started, and the rest happens on the event loop.
+ * First, the server's version is checked. Then a list of all of the
+ * currently running sessions is retrieved from the server, and a control
+ * mode client is attached to each one in order to properly track the entire
+ * server. The progress is reported through the connect callback (see
+ * wtc_tmux_set_connect_cb).
  * In the event that no sessions are running, a temporary session called
  * "wtc_tmux" will be created. When tmux reports that another session has
  * been created, this session will be terminated (provided that no other
@@ -377,6 +448,62 @@ int wtc_tmux_connect(struct wtc_tmux *tmux);
 void wtc_tmux_disconnect(struct wtc_tmux *tmux);
 bool wtc_tmux_is_connected(const struct wtc_tmux *tmux);
 
+/*
+ * The stages of a connection. A connection starts out probing the server's
+ * version, then loads the server's state, and then is ready: the model
+ * mirrors the server and the other callbacks keep it up to date. If the
+ * server can't be used (e.g., it's too old), or loading it keeps failing
+ * after a few retries, the connection fails instead; it should then be
+ * cleaned up with wtc_tmux_disconnect.
+ *
+ * The probe runs in the background. Loading is split into stages, each
+ * taking its own pass through the event loop: the sessions, the windows,
+ * the panes and the clients are each reloaded with blocking queries, and
+ * then the control clients are launched one at a time. The event loop only
+ * stalls for the length of one stage, but the model may be incomplete
+ * until the connection is ready; the other callbacks are only invoked once
+ * it is.
+ *
+ * The connect callback is invoked each time the stage changes. A connection
+ * resumed with wtc_tmux_handover_resume starts out ready.
+ */
+#define WTC_TMUX_CONNECT_NONE    0
+#define WTC_TMUX_CONNECT_PROBING 1
+#define WTC_TMUX_CONNECT_LOADING 2
+#define WTC_TMUX_CONNECT_READY   3
+#define WTC_TMUX_CONNECT_FAILED  4
+int wtc_tmux_set_connect_cb(struct wtc_tmux *tmux,
+	int (*cb)(struct wtc_tmux *tmux, int state));
+int wtc_tmux_get_connect_state(const struct wtc_tmux *tmux);
+
+/*
+ * These functions carry a connection across exec (e.g., to upgrade the
+ * program in place) without detaching the control clients. Since exec
+ * keeps the pid, the control clients remain our children throughout.
+ *
+ * wtc_tmux_handover_export writes the server representation and the
+ * control clients (including any output which hasn't been processed yet)
+ * to a new anonymous file, whose descriptor is stored in *fd. The file and
+ * duplicates of the control clients' pipes are left open across exec. The
+ * tmux object is then disconnected without detaching anything, so nothing
+ * but exec (or exit) should follow.
+ *
+ * In the new process image, wtc_tmux_handover_resume takes the place of
+ * wtc_tmux_connect. The state is read from fd (which is then closed), the
+ * control clients are taken over, and the representation is restored
+ * without querying tmux (except for the key bindings, which aren't
+ * exported). The creation callbacks are then invoked for everything
+ * restored, just as after connecting. If resuming fails, the control
+ * clients are closed (which makes them exit) and the object is left
+ * disconnected, so wtc_tmux_connect can be used instead.
+ *
+ * Both return 0 on success or a negative error code. -EINVAL is returned if
+ * the object is not connected (respectively, is already connected) or if
+ * the state can't be parsed.
+ */
+int wtc_tmux_handover_export(struct wtc_tmux *tmux, int *fd);
+int wtc_tmux_handover_resume(struct wtc_tmux *tmux, int fd);
+
 /*
  * The following functions may be called at any time, regardless of the
  * connection state. However, it is recommended that they are not changed
@@ -395,6 +522,19 @@ bool wtc_tmux_is_connected(const struct wtc_tmux *tmux);
 int wtc_tmux_set_timeout(struct wtc_tmux *tmux, unsigned int timeout);
 unsigned int wtc_tmux_get_timeout(const struct wtc_tmux *tmux);
 
+/*
+ * The number of threads used to decode a single large tmux reply (such as
+ * the pane or layout listings of a server with many panes), defaults to 4.
+ * Small replies are always decoded on the calling thread, and a value of 1
+ * disables threading entirely. -EINVAL will be returned if tmux is NULL or
+ * workers is 0 or greater than 16.
+ *
+ * Passing NULL to wtc_tmux_get_decode_workers is an error and will result
+ * in NULL being dereferenced.
+ */
+int wtc_tmux_set_decode_workers(struct wtc_tmux *tmux, unsigned int workers);
+unsigned int wtc_tmux_get_decode_workers(const struct wtc_tmux *tmux);
+
 /*
  * The size of the control session defaults to 80x24. Note that each
  * window's dimensions are capped to that of the smallest connected client,
@@ -415,6 +555,27 @@ int wtc_tmux_set_size(struct wtc_tmux *tmux, unsigned int w, unsigned int h);
 unsigned int wtc_tmux_get_width(const struct wtc_tmux *tmux);
 unsigned int wtc_tmux_get_height(const struct wtc_tmux *tmux);
 
+/*
+ * Publish the server representation in the POSIX shared memory object name
+ * (e.g., "/wtc-1000"), so that other processes can follow it without
+ * talking to tmux; the layout is described in tmux_export.h. The snapshot
+ * is replaced after every refresh, and is emptied on disconnect. If the
+ * object already holds a snapshot (e.g., from before wtc_tmux_handover),
+ * it is taken over and readers are asked to wait until the first refresh
+ * replaces it. Passing NULL stops publishing and removes the object, as
+ * does destroying the tmux object.
+ *
+ * -EINVAL will be returned if tmux is NULL and -ENOMEM if the name couldn't
+ * be duplicated. -EPERM is returned if the object exists but isn't ours
+ * (owned by our user with mode 0600). Otherwise, an error opening or
+ * writing the object is returned, and nothing is published.
+ *
+ * Passing NULL to wtc_tmux_get_export_name is an error and will result in
+ * NULL being dereferenced.
+ */
+int wtc_tmux_set_export_name(struct wtc_tmux *tmux, const char *name);
+const char *wtc_tmux_get_export_name(const struct wtc_tmux *tmux);
+
 /*
  * The following callbacks will be invoked in response to various changes
  * in the tmux server. They are the primary way of reacting to the server
@@ -428,6 +589,14 @@ unsigned int wtc_tmux_get_height(const struct wtc_tmux *tmux);
  */
 int wtc_tmux_set_client_session_changed_cb(struct wtc_tmux *tmux,
 	int (*cb)(struct wtc_tmux *, const struct wtc_tmux_client *));
+/*
+ * Invoked, after the other callbacks of a change, for each client whose
+ * visible panes changed. panes holds the ids of the count panes which
+ * became visible or hidden; check which with wtc_tmux_pane_visible.
+ */
+int wtc_tmux_set_client_visibility_changed_cb(struct wtc_tmux *tmux,
+	int (*cb)(struct wtc_tmux *, const struct wtc_tmux_client *,
+	          const int *panes, size_t count));
 
 int wtc_tmux_set_new_session_cb(struct wtc_tmux *tmux,
 	int (*cb)(struct wtc_tmux *, const struct wtc_tmux_session *));
@@ -452,6 +621,67 @@ int wtc_tmux_set_pane_resized_cb(struct wtc_tmux *tmux,
 int wtc_tmux_set_pane_mode_changed_cb(struct wtc_tmux *tmux,
 	int (*cb)(struct wtc_tmux *, const struct wtc_tmux_pane *));
 
+/*
+ * Every change reported through the callbacks above is also recorded, in
+ * order, in a bounded journal. Each change is stamped with a sequence
+ * number, one greater than the previous change's, so an observer which
+ * remembers the last number it saw can later catch up on just the
+ * changes it missed. type is one of the WTC_TMUX_CHANGE_* values, each
+ * matching the callback of the same name. id is the tmux id of the pane,
+ * window or session which changed, or the pid of the client. The journal
+ * only says what changed: use the lookup functions for the details.
+ *
+ * The journal holds the most recent WTC_TMUX_JOURNAL_LEN changes. Once an
+ * observer has fallen further behind than that, it must instead start over
+ * from the current state, which it can read through the lookup functions,
+ * and continue from wtc_tmux_journal_seq. wtc_tmux_handover_resume keeps
+ * the numbering but not the changes, and reports everything it restores
+ * as new, just like the callbacks.
+ *
+ * wtc_tmux_journal_seq returns the sequence number the next change will
+ * get. wtc_tmux_journal_read copies up to len changes, starting from
+ * sequence number from, into out, and returns the number copied. -ESTALE
+ * is returned if changes from on are no longer in the journal, and
+ * -EINVAL if tmux or out is NULL or from is in the future.
+ *
+ * wtc_tmux_subscribe invokes cb with each change from sequence number from
+ * on: the ones already recorded right away, and the rest after each
+ * refresh, once the callbacks above have run. If the journal no longer
+ * goes back far enough, cb is invoked with a NULL change instead, and then
+ * with the changes from the current state on. If cb returns non-zero, the
+ * subscription is cancelled. It returns the subscription's id (a positive
+ * number) for wtc_tmux_unsubscribe, 0 if cb cancelled it while catching
+ * up, or a negative error code.
+ * wtc_tmux_unsubscribe must not be called from within a subscription
+ * callback.
+ */
+#define WTC_TMUX_CHANGE_CLIENT_SESSION_CHANGED     1
+#define WTC_TMUX_CHANGE_NEW_SESSION                2
+#define WTC_TMUX_CHANGE_SESSION_CLOSED             3
+#define WTC_TMUX_CHANGE_SESSION_WINDOW_CHANGED     4
+#define WTC_TMUX_CHANGE_NEW_WINDOW                 5
+#define WTC_TMUX_CHANGE_WINDOW_CLOSED              6
+#define WTC_TMUX_CHANGE_WINDOW_PANE_CHANGED        7
+#define WTC_TMUX_CHANGE_NEW_PANE                   8
+#define WTC_TMUX_CHANGE_PANE_CLOSED                9
+#define WTC_TMUX_CHANGE_PANE_RESIZED              10
+#define WTC_TMUX_CHANGE_PANE_MODE_CHANGED         11
+#define WTC_TMUX_CHANGE_CLIENT_VISIBILITY_CHANGED 12
+#define WTC_TMUX_JOURNAL_LEN 4096
+struct wtc_tmux_change {
+	uint64_t seq;
+	int type;
+	int id;
+};
+
+uint64_t wtc_tmux_journal_seq(const struct wtc_tmux *tmux);
+int wtc_tmux_journal_read(const struct wtc_tmux *tmux, uint64_t from,
+                          struct wtc_tmux_change *out, size_t len);
+int wtc_tmux_subscribe(struct wtc_tmux *tmux, uint64_t from,
+	int (*cb)(struct wtc_tmux *, const struct wtc_tmux_change *, void *),
+	void *userdata);
+void wtc_tmux_unsubscribe(struct wtc_tmux *tmux, int id);
+
 /*
  * The following lookup functions can be used after a connection has been
  * established to gain information about the current tmux state.
@@ -469,9 +699,106 @@ wtc_tmux_lookup_window(const struct wtc_tmux *tmux, int id);
 const struct wtc_tmux_pane *
 wtc_tmux_lookup_pane(const struct wtc_tmux *tmux, int id);
 
+/*
+ * Statistics on the refresh cycles, which is where the server
+ * representation is reloaded and all the callbacks are run. Stores the id
+ * of the most recent refresh cycle to run its callbacks in id (ids count
+ * up from 1; 0 means there hasn't been one) and the total time spent in
+ * refresh cycles, reloads included, in nanoseconds, in cb_ns. Either may
+ * be NULL. Comparing the values before and after something tells which
+ * refresh cycles ran in between, and for how long.
+ *
+ * wtc_tmux_refresh_queued returns when refresh cycle id was first asked
+ * for (CLOCK_MONOTONIC, in nanoseconds), or 0 if it hasn't run or is too
+ * old to be remembered.
+ */
+void wtc_tmux_refresh_stats(const struct wtc_tmux *tmux, unsigned long *id,
+                            uint64_t *cb_ns);
+uint64_t wtc_tmux_refresh_queued(const struct wtc_tmux *tmux,
+                                 unsigned long id);
+
+/*
+ * How noisy sess is. Stores the rate (per second) at which its control
+ * client has recently been sending notifications which need a refresh in
+ * rate, and whether the session is refreshed by polling (because that
+ * rate is too high) rather than on every notification in polled. Either
+ * may be NULL. Returns 0, or -ENOENT if sess has no control client.
+ */
+int wtc_tmux_session_rate(const struct wtc_tmux *tmux,
+                          const struct wtc_tmux_session *sess,
+                          unsigned long *rate, bool *polled);
+
+/*
+ * Whether client currently shows pane. This is a set lookup; the set is
+ * kept up to date as the server changes.
+ */
+bool wtc_tmux_pane_visible(const struct wtc_tmux_client *client,
+                           const struct wtc_tmux_pane *pane);
+
 const struct wtc_tmux_key_table *
 wtc_tmux_lookup_key_table(const struct wtc_tmux *tmux, const char *name);
 
+/*
+ * The key tables are only loaded (with list-keys) once they are needed, so
+ * connecting and session changes don't have to wait on them. Call this
+ * before stepping through the key tables; it loads them the first time
+ * after connecting and does nothing after that.
+ *
+ * Returns 0 on success (including when not connected, in which case there
+ * are no key tables), or a negative error code, in which case loading is
+ * tried again next time.
+ */
+int wtc_tmux_load_key_binds(struct wtc_tmux *tmux);
+
+/*
+ * Hint that tmux's key bindings may have changed (e.g., after running a
+ * binding which rebinds). If the key tables have been loaded, they are
+ * reloaded in the background, on the next refresh; otherwise there is
+ * nothing to do, as they will be loaded fresh when first needed. Changes
+ * we aren't told about are picked up by a reload queued after sessions or
+ * clients come and go.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int wtc_tmux_invalidate_key_binds(struct wtc_tmux *tmux);
+
+/*
+ * Run the key table state machine for a key press on a client attached to
+ * sess. *table is the client's current key table (NULL is interpreted as
+ * the root table) and will be updated to the table the client is in after
+ * the key press. Like tmux, the key is first looked up in the current
+ * table; failing that, the prefix keys of sess transition from the root
+ * table into the prefix table and any other key returns to the root table.
+ *
+ * If the key triggers a binding, it is stored in *bind (otherwise *bind is
+ * set to NULL). Only bindings with an action of WTC_TMUX_KEY_BIND_COMMAND
+ * need to be sent to tmux; everything else has been fully handled.
+ *
+ * Returns true if the key press was consumed by the key tables (i.e., it
+ * triggered a binding or entered the prefix table) and false if it should
+ * be passed through to the focused application.
+ */
+bool wtc_tmux_key_table_step(const struct wtc_tmux *tmux,
+                             const struct wtc_tmux_session *sess,
+                             const struct wtc_tmux_key_table **table,
+                             key_code code,
+                             const struct wtc_tmux_key_bind **bind);
+
+/*
+ * Find the pane tmux's "select-pane -L/-R/-U/-D" will move to from pane,
+ * using the pane extents from the most recent refresh. Like tmux, a pane
+ * is a neighbor if it shares the border in the given direction and the
+ * search wraps around the edges of the window. When there are several
+ * candidates, the window's last pane is preferred. Returns pane itself
+ * if it has no neighbor and NULL if pane is NULL or dir is invalid.
+ */
+#define WTC_TMUX_PANE_LEFT  0
+#define WTC_TMUX_PANE_RIGHT 1
+#define WTC_TMUX_PANE_UP    2
+#define WTC_TMUX_PANE_DOWN  3
+const struct wtc_tmux_pane *
+wtc_tmux_pane_neighbor(const struct wtc_tmux_pane *pane, int dir);
+
 /*
  * Get the first session in the linked list associated with this tmux
  * object.
@@ -526,4 +853,43 @@ int wtc_tmux_session_exec(struct wtc_tmux *tmux,
                           const struct wtc_tmux_session *sess,
                           const char *text, char **out, char **err);
 
+/*
+ * Like wtc_tmux_session_exec, but returns as soon as the command has been
+ * handed to the session's control client instead of waiting for tmux to
+ * answer. The reply is discarded; an error reply is only logged, so the
+ * caller has to find out what happened from the callbacks.
+ */
+int wtc_tmux_session_send(struct wtc_tmux *tmux,
+                          const struct wtc_tmux_session *sess,
+                          const char *text);
+
+/*
+ * Command templates, for commands which are run often with different
+ * targets. wtc_tmux_cmd_compile takes cmds in the same form as
+ * wtc_tmux_exec, except that the arguments may contain the placeholders:
+ *
+ *   %P  a pane, given by its id (e.g., 3 becomes %3)
+ *   %W  a window, given by its id (@3)
+ *   %S  a session, given by its id ($3)
+ *   %d  an int
+ *   %s  a string
+ *   %%  a literal %
+ *
+ * The command line is quoted and escaped once, when it's compiled, so
+ * wtc_tmux_cmd_exec only has to fill in the placeholders, from its
+ * variadic arguments (an int for each of %P, %W, %S and %d, and a const
+ * char * for %s, in order), straight into the buffer which is written to
+ * tmux. This doesn't allocate unless the output does (or there is no
+ * control client to run it on). Otherwise, wtc_tmux_cmd_exec behaves just
+ * like wtc_tmux_exec.
+ *
+ * wtc_tmux_cmd_compile returns 0 on success, -EINVAL if cmds or out is
+ * NULL or cmds contains an unknown placeholder, or -ENOMEM.
+ */
+struct wtc_tmux_cmd;
+int wtc_tmux_cmd_compile(const char *const *cmds, struct wtc_tmux_cmd **out);
+void wtc_tmux_cmd_free(struct wtc_tmux_cmd *cmd);
+int wtc_tmux_cmd_exec(struct wtc_tmux *tmux, const struct wtc_tmux_cmd *cmd,
+                      char **out, char **err, ...);
+
 #endif // !WTC_TMUX_H
@@ -0,0 +1,341 @@
+/*
+ * wtc - tmux_export.c
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * wtc_tmux - Model Export
+ *
+ * This file publishes the server representation in shared memory, in the
+ * layout described by tmux_export.h, so other processes can follow tmux
+ * without running commands of their own.
+ *
+ * A snapshot is written after every refresh, once the model has settled.
+ * The region is guarded by a sequence lock rather than double buffered:
+ * there is only one writer, a write is a single pass over the model, and
+ * readers never block it, so the cost of a torn read is just a retry.
+ */
+
+#define _GNU_SOURCE
+
+#include "tmux_internal.h"
+#include "tmux_export.h"
+
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int export_open(struct wtc_tmux *tmux)
+{
+	struct wtc_export_header *header;
+	struct stat st;
+	size_t len;
+	int fd;
+	int r;
+
+	fd = shm_open(tmux->export_name, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		warn("export_open: Couldn't open %s: %d", tmux->export_name,
+		     errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st)) {
+		r = -errno;
+		warn("export_open: Couldn't stat %s: %d", tmux->export_name,
+		     errno);
+		goto err_fd;
+	}
+
+	// Anybody could have created the name before us. Don't publish into,
+	// or trust, an object which isn't private to us.
+	if (st.st_uid != getuid() || (st.st_mode & 0777) != 0600) {
+		warn("export_open: %s isn't ours; refusing to use it",
+		     tmux->export_name);
+		r = -EPERM;
+		goto err_fd;
+	}
+
+	// Never shrink the object: a reader may still have all of it mapped.
+	len = sysconf(_SC_PAGESIZE);
+	if ((size_t) st.st_size > len)
+		len = st.st_size;
+	if ((size_t) st.st_size < len && ftruncate(fd, len)) {
+		r = -errno;
+		warn("export_open: Couldn't size %s: %d", tmux->export_name,
+		     errno);
+		goto err_fd;
+	}
+
+	header = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		r = -errno;
+		warn("export_open: Couldn't map %s: %d", tmux->export_name,
+		     errno);
+		goto err_fd;
+	}
+
+	// Pick up where the last writer (e.g., the process image we were
+	// upgraded from) left off, so readers never see seq go backwards. What
+	// it left may be torn, so seq stays odd until our first snapshot.
+	if (header->magic == WTC_EXPORT_MAGIC &&
+	    header->version == WTC_EXPORT_VERSION) {
+		__atomic_store_n(&header->seq, header->seq | 1, __ATOMIC_RELEASE);
+	} else {
+		memset(header, 0, sizeof(*header));
+		header->version = WTC_EXPORT_VERSION;
+		header->size = sizeof(*header);
+		header->seq = 1;
+		__atomic_store_n(&header->magic, WTC_EXPORT_MAGIC,
+		                 __ATOMIC_RELEASE);
+	}
+
+	tmux->export_fd = fd;
+	tmux->export_map = header;
+	tmux->export_len = len;
+	return 0;
+
+err_fd:
+	close(fd);
+	return r;
+}
+
+void wtc_tmux_export_close(struct wtc_tmux *tmux, bool unlink)
+{
+	if (tmux->export_fd < 0)
+		return;
+
+	if (munmap(tmux->export_map, tmux->export_len))
+		warn("wtc_tmux_export_close: Error unmapping: %d", errno);
+	if (close(tmux->export_fd))
+		warn("wtc_tmux_export_close: Error closing: %d", errno);
+	if (unlink && shm_unlink(tmux->export_name))
+		warn("wtc_tmux_export_close: Error unlinking %s: %d",
+		     tmux->export_name, errno);
+
+	tmux->export_fd = -1;
+	tmux->export_map = NULL;
+	tmux->export_len = 0;
+}
+
+/*
+ * Make the region at least size bytes long. The object grows in powers of
+ * two so a steadily growing server doesn't resize it on every refresh.
+ */
+static int export_reserve(struct wtc_tmux *tmux, size_t size)
+{
+	size_t len = tmux->export_len;
+	void *map;
+
+	if (size <= len)
+		return 0;
+
+	while (len < size)
+		len *= 2;
+
+	if (ftruncate(tmux->export_fd, len)) {
+		warn("export_reserve: Couldn't grow to %zu: %d", len, errno);
+		return -errno;
+	}
+
+	map = mremap(tmux->export_map, tmux->export_len, len, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED) {
+		warn("export_reserve: Couldn't remap to %zu: %d", len, errno);
+		return -errno;
+	}
+
+	tmux->export_map = map;
+	tmux->export_len = len;
+	return 0;
+}
+
+int wtc_tmux_export_update(struct wtc_tmux *tmux)
+{
+	struct wtc_export_header *header, counts = { 0 };
+	struct wtc_export_session *es;
+	struct wtc_export_window *ew;
+	struct wtc_export_pane *ep;
+	struct wtc_export_client *ec;
+	int32_t *links;
+	char *strings;
+	struct wtc_tmux_session *sess, *stmp;
+	struct wtc_tmux_window *wind, *wtmp;
+	struct wtc_tmux_pane *pane, *ptmp;
+	struct wtc_tmux_client *client, *ctmp;
+	size_t size, slen = 0, n;
+	uint32_t seq, link = 0;
+	int r;
+
+	if (tmux->export_fd < 0)
+		return 0;
+
+	counts.session_count = HASH_COUNT(tmux->sessions);
+	counts.window_count = HASH_COUNT(tmux->windows);
+	counts.pane_count = HASH_COUNT(tmux->panes);
+	counts.client_count = HASH_COUNT(tmux->clients);
+	HASH_ITER(hh, tmux->sessions, sess, stmp)
+		counts.link_count += sess->window_count;
+	HASH_ITER(hh, tmux->clients, client, ctmp)
+		slen += strlen(client->name) + 1;
+
+	size = sizeof(counts);
+	counts.sessions = size;
+	size += counts.session_count * sizeof(*es);
+	counts.windows = size;
+	size += counts.window_count * sizeof(*ew);
+	counts.panes = size;
+	size += counts.pane_count * sizeof(*ep);
+	counts.clients = size;
+	size += counts.client_count * sizeof(*ec);
+	counts.links = size;
+	size += counts.link_count * sizeof(*links);
+	counts.strings = size;
+	size += slen;
+	counts.size = size;
+
+	r = export_reserve(tmux, size);
+	if (r < 0)
+		return r;
+
+	header = tmux->export_map;
+	es = (void *) ((char *) header + counts.sessions);
+	ew = (void *) ((char *) header + counts.windows);
+	ep = (void *) ((char *) header + counts.panes);
+	ec = (void *) ((char *) header + counts.clients);
+	links = (void *) ((char *) header + counts.links);
+	strings = (char *) header + counts.strings;
+
+	// Readers treat an odd seq as "come back later". It's already odd
+	// until the first snapshot is out. The fence keeps the writes below
+	// from being seen before it.
+	seq = header->seq | 1;
+	__atomic_store_n(&header->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	// magic and version never change once the object is set up.
+	memcpy(&header->size, &counts.size,
+	       sizeof(counts) - offsetof(struct wtc_export_header, size));
+
+	HASH_ITER(hh, tmux->sessions, sess, stmp) {
+		es->id = sess->id;
+		es->active_window = sess->active_window ?
+		                     sess->active_window->id : -1;
+		es->statusbar = sess->statusbar;
+		es->first_link = link;
+		es->window_count = sess->window_count;
+		for (int i = 0; i < sess->window_count; ++i)
+			links[link++] = sess->windows[i]->id;
+		++es;
+	}
+
+	HASH_ITER(hh, tmux->windows, wind, wtmp) {
+		ew->id = wind->id;
+		ew->active_pane = wind->active_pane ? wind->active_pane->id : -1;
+		ew->last_pane = wind->last_pane ? wind->last_pane->id : -1;
+		ew->pane_count = wind->pane_count;
+		++ew;
+	}
+
+	HASH_ITER(hh, tmux->panes, pane, ptmp) {
+		ep->id = pane->id;
+		ep->pid = pane->pid;
+		ep->window = pane->window ? pane->window->id : -1;
+		ep->x = pane->x;
+		ep->y = pane->y;
+		ep->w = pane->w;
+		ep->h = pane->h;
+		ep->flags = (pane->active ? WTC_EXPORT_PANE_ACTIVE : 0) |
+		            (pane->in_mode ? WTC_EXPORT_PANE_IN_MODE : 0);
+		++ep;
+	}
+
+	n = 0;
+	HASH_ITER(hh, tmux->clients, client, ctmp) {
+		ec->pid = client->pid;
+		ec->session = client->session ? client->session->id : -1;
+		ec->name = n;
+		strcpy(strings + n, client->name);
+		n += strlen(client->name) + 1;
+		++ec;
+	}
+
+	__atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int wtc_tmux_set_export_name(struct wtc_tmux *tmux, const char *name)
+{
+	char *dup = NULL;
+	int r;
+
+	if (!tmux)
+		return -EINVAL;
+
+	if (name) {
+		dup = strdup(name);
+		if (!dup) {
+			crit("wtc_tmux_set_export_name: Couldn't duplicate name!");
+			return -ENOMEM;
+		}
+	}
+
+	wtc_tmux_export_close(tmux, true);
+	free(tmux->export_name);
+	tmux->export_name = dup;
+	if (!dup)
+		return 0;
+
+	r = export_open(tmux);
+	if (r < 0)
+		goto err_name;
+
+	// Otherwise, readers are held off until the first refresh rather than
+	// shown an empty model, so it doesn't vanish across an upgrade.
+	if (!tmux->connected)
+		return 0;
+
+	r = wtc_tmux_export_update(tmux);
+	if (r < 0)
+		goto err_export;
+
+	return 0;
+
+err_export:
+	wtc_tmux_export_close(tmux, true);
+err_name:
+	free(tmux->export_name);
+	tmux->export_name = NULL;
+	return r;
+}
+
+const char *wtc_tmux_get_export_name(const struct wtc_tmux *tmux)
+{
+	return tmux->export_name;
+}
@@ -0,0 +1,166 @@
+/*
+ * wtc - tmux_export.h
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * wtc - Tmux Model Export
+ *
+ * This file describes the snapshot of the server representation which
+ * wtc_tmux publishes in shared memory (see wtc_tmux_set_export_name). It
+ * only depends on the standard headers so that other programs (status
+ * bars, launchers, monitors...) can include it to follow tmux without
+ * running tmux themselves.
+ *
+ * The region starts with a wtc_export_header. Every other part is an array
+ * found at an offset (in bytes, from the start of the region) given in the
+ * header:
+ *
+ *   sessions: session_count wtc_export_sessions
+ *   windows:  window_count wtc_export_windows
+ *   panes:    pane_count wtc_export_panes
+ *   clients:  client_count wtc_export_clients
+ *   links:    link_count int32_t window ids. Session i's windows are
+ *             links[sessions[i].first_link] onwards, in tmux's order.
+ *   strings:  NUL terminated strings, referenced by offset from strings.
+ *
+ * References to other objects are tmux ids, or -1 for none.
+ *
+ * The region is protected by a sequence lock: seq is odd while wtc is
+ * writing, and from the time wtc takes the region over until it has
+ * published its first snapshot. To read, use wtc_export_read_begin, copy
+ * out what you need, and start over if wtc_export_read_retry says the copy
+ * was torn. Reading
+ * takes no system calls, unless the region has grown beyond the length
+ * you've mapped (size), in which case map it again and start over. The
+ * region never shrinks.
+ *
+ * The object lives as long as wtc does, including across live upgrades. A
+ * wtc which isn't connected publishes an empty model.
+ */
+
+#ifndef WTC_TMUX_EXPORT_H
+#define WTC_TMUX_EXPORT_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WTC_EXPORT_MAGIC 0x58435457 /* "WTCX" */
+#define WTC_EXPORT_VERSION 1
+
+struct wtc_export_header {
+	uint32_t magic;
+	uint32_t version;
+	/* The sequence lock. Odd while the snapshot is being replaced. */
+	uint32_t seq;
+	/* The number of bytes in use, from the start of the region. */
+	uint32_t size;
+
+	uint32_t session_count;
+	uint32_t window_count;
+	uint32_t pane_count;
+	uint32_t client_count;
+	uint32_t link_count;
+
+	uint32_t sessions;
+	uint32_t windows;
+	uint32_t panes;
+	uint32_t clients;
+	uint32_t links;
+	uint32_t strings;
+};
+
+struct wtc_export_session {
+	int32_t id;
+	int32_t active_window;
+	/* One of the WTC_TMUX_SESSION_* status bar positions. */
+	int32_t statusbar;
+	uint32_t first_link;
+	uint32_t window_count;
+};
+
+struct wtc_export_window {
+	int32_t id;
+	int32_t active_pane;
+	int32_t last_pane;
+	uint32_t pane_count;
+};
+
+struct wtc_export_pane {
+	int32_t id;
+	int32_t pid;
+	int32_t window;
+	int32_t x;
+	int32_t y;
+	int32_t w;
+	int32_t h;
+	uint32_t flags;
+#define WTC_EXPORT_PANE_ACTIVE  (1<<0)
+#define WTC_EXPORT_PANE_IN_MODE (1<<1)
+};
+
+struct wtc_export_client {
+	int32_t pid;
+	int32_t session;
+	/* The client's name, as an offset into the strings. */
+	uint32_t name;
+};
+
+/*
+ * How many times wtc_export_read_begin checks for a write in progress to
+ * finish before giving up. A write takes microseconds, so running out
+ * means wtc died mid-write or hasn't published a snapshot yet.
+ */
+#define WTC_EXPORT_READ_SPINS 100000
+
+/*
+ * Start reading a snapshot, waiting out a write in progress. On success,
+ * stores the sequence number to hand to wtc_export_read_retry in *seq and
+ * returns 0. Returns -EBUSY if the snapshot stays mid-write; try again
+ * later.
+ */
+static inline int wtc_export_read_begin(const struct wtc_export_header *header,
+                                        uint32_t *seq)
+{
+	for (int i = 0; i < WTC_EXPORT_READ_SPINS; ++i) {
+		*seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+		if (!(*seq & 1))
+			return 0;
+	}
+
+	return -EBUSY;
+}
+
+/*
+ * Returns true if the snapshot changed while it was being read, so what was
+ * read must be thrown away.
+ */
+static inline bool wtc_export_read_retry(
+		const struct wtc_export_header *header, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&header->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif // !WTC_TMUX_EXPORT_H
@@ -0,0 +1,661 @@
+/*
+ * wtc - tmux_handover.c
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * wtc_tmux - Connection Handover
+ *
+ * This file contains the functions of the wtc_tmux interface dedicated to
+ * passing a live connection across exec (see wtc_tmux_handover_export).
+ *
+ * The state is written as text, one object per line:
+ *
+ *   wtc_tmux_handover <version>
+ *   refresh <flags>
+ *   version <tmux version>
+ *   journal <next change's sequence number>
+ *   pane <id> <pid> <active> <in_mode> <x> <y> <w> <h>
+ *   window <id> <active pane> <last pane> <count> <pane ids...>
+ *   session <id> <statusbar> <prefix> <prefix2> <active window> <count>
+ *           <window ids...>
+ *   client <pid> <session> <name>
+ *   cc <pid> <fin> <fout> <session> <compensate> <unanswered> <len>
+ *   <len bytes of unprocessed output>
+ *   end
+ *
+ * Missing references are written as -1. Objects only reference objects of
+ * the kinds listed before them, so the state can be restored in one pass.
+ */
+
+#define _GNU_SOURCE
+
+#include "tmux_internal.h"
+
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wait.h>
+#include <wayland-server-core.h>
+#include <wlc/wlc.h>
+
+#define HANDOVER_VERSION 3
+
+static int write_state(struct wtc_tmux *tmux, FILE *f, const int *fds)
+{
+	const struct wtc_tmux_pane *pane;
+	const struct wtc_tmux_window *wind;
+	const struct wtc_tmux_session *sess;
+	const struct wtc_tmux_client *client;
+	struct wtc_tmux_cc *cc;
+	struct iovec ivc[2];
+	size_t sz, pos, len;
+	int count, i, refresh;
+	char val;
+
+	fprintf(f, "wtc_tmux_handover %d\n", HANDOVER_VERSION);
+	// Which windows are pending isn't handed over, so the new process
+	// reloads every pane instead.
+	refresh = tmux->refresh;
+	if (refresh & WTC_TMUX_REFRESH_PENDING)
+		refresh = (refresh & ~WTC_TMUX_REFRESH_PENDING) |
+		          WTC_TMUX_REFRESH_PANES;
+	fprintf(f, "refresh %d\n", refresh);
+	fprintf(f, "version %d\n", tmux->version);
+	fprintf(f, "journal %" PRIu64 "\n", tmux->journal_seq);
+
+	for (pane = tmux->panes; pane; pane = pane->hh.next)
+		fprintf(f, "pane %d %d %d %d %d %d %d %d\n", pane->id, pane->pid,
+		        pane->active, pane->in_mode, pane->x, pane->y, pane->w,
+		        pane->h);
+
+	for (wind = tmux->windows; wind; wind = wind->hh.next) {
+		count = 0;
+		for (pane = wind->panes; pane; pane = pane->next)
+			++count;
+
+		fprintf(f, "window %d %d %d %d", wind->id,
+		        wind->active_pane ? wind->active_pane->id : -1,
+		        wind->last_pane ? wind->last_pane->id : -1, count);
+		for (pane = wind->panes; pane; pane = pane->next)
+			fprintf(f, " %d", pane->id);
+		fprintf(f, "\n");
+	}
+
+	for (sess = tmux->sessions; sess; sess = sess->hh.next) {
+		fprintf(f, "session %d %d %llu %llu %d %d", sess->id,
+		        sess->statusbar, sess->prefix, sess->prefix2,
+		        sess->active_window ? sess->active_window->id : -1,
+		        sess->window_count);
+		for (i = 0; i < sess->window_count; ++i)
+			fprintf(f, " %d", sess->windows[i]->id);
+		fprintf(f, "\n");
+	}
+
+	for (client = tmux->clients; client; client = client->hh.next)
+		fprintf(f, "client %d %d %s\n", client->pid,
+		        client->session ? client->session->id : -1, client->name);
+
+	for (cc = tmux->ccs, i = 0; cc; cc = cc->next, i += 2) {
+		// The '\0's are only read_available's separators.
+		len = 0;
+		SHL_RING_ITERATE(&cc->buf, val, ivc, sz, pos)
+			if (val != '\0')
+				++len;
+
+		fprintf(f, "cc %d %d %d %d %d %u %zu\n", cc->pid, fds[i],
+		        fds[i + 1], cc->session ? cc->session->id : -1,
+		        cc->compensate, cc->unanswered, len);
+		SHL_RING_ITERATE(&cc->buf, val, ivc, sz, pos)
+			if (val != '\0')
+				fputc(val, f);
+		fprintf(f, "\n");
+	}
+
+	fprintf(f, "end\n");
+
+	if (ferror(f)) {
+		warn("write_state: Error writing state!");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int wtc_tmux_handover_export(struct wtc_tmux *tmux, int *fd)
+{
+	struct wtc_tmux_cc *cc;
+	int *fds = NULL;
+	int count = 0, nfds, mfd, tfd;
+	FILE *f;
+	int r = 0;
+
+	if (!tmux || !fd || !tmux->connected)
+		return -EINVAL;
+
+	for (cc = tmux->ccs; cc; cc = cc->next)
+		++count;
+
+	// Duplicates don't inherit FD_CLOEXEC, so these survive exec.
+	nfds = 2 * count;
+	fds = calloc(nfds + 1, sizeof(int));
+	if (!fds) {
+		crit("wtc_tmux_handover_export: Couldn't allocate fds!");
+		return -ENOMEM;
+	}
+	for (int i = 0; i < nfds; ++i)
+		fds[i] = -1;
+
+	int i = 0;
+	for (cc = tmux->ccs; cc; cc = cc->next, i += 2) {
+		fds[i] = dup(cc->fin);
+		fds[i + 1] = dup(cc->fout);
+		if (fds[i] < 0 || fds[i + 1] < 0) {
+			warn("wtc_tmux_handover_export: Couldn't duplicate pipes: %d",
+			     errno);
+			r = -errno;
+			goto err_fds;
+		}
+	}
+
+	mfd = memfd_create("wtc_tmux_handover", 0);
+	if (mfd < 0) {
+		warn("wtc_tmux_handover_export: Couldn't create state file: %d",
+		     errno);
+		r = -errno;
+		goto err_fds;
+	}
+
+	tfd = dup(mfd);
+	f = tfd < 0 ? NULL : fdopen(tfd, "w");
+	if (!f) {
+		warn("wtc_tmux_handover_export: Couldn't open state file: %d",
+		     errno);
+		r = -errno;
+		if (tfd >= 0)
+			close(tfd);
+		goto err_mfd;
+	}
+
+	r = write_state(tmux, f, fds);
+	if (fclose(f) && !r) {
+		warn("wtc_tmux_handover_export: Error closing state file: %d",
+		     errno);
+		r = -errno;
+	}
+	if (r < 0)
+		goto err_mfd;
+
+	if (lseek(mfd, 0, SEEK_SET) < 0) {
+		warn("wtc_tmux_handover_export: Couldn't rewind state file: %d",
+		     errno);
+		r = -errno;
+		goto err_mfd;
+	}
+
+	// Let go of everything without detaching: the control clients now
+	// belong to whoever inherits fds.
+	while ((cc = tmux->ccs)) {
+		tmux->ccs = cc->next;
+		if (cc->outs) {
+			wlc_event_source_remove(cc->outs);
+			cc->outs = NULL;
+			wtc_tmux_cc_unref(cc);
+		}
+		wtc_tmux_cc_unref(cc);
+	}
+
+	wtc_tmux_clear_closures(tmux);
+	wtc_tmux_teardown_loop(tmux);
+	wtc_tmux_clear_model(tmux);
+	tmux->connected = false;
+
+	info("wtc_tmux_handover_export: Exported %d control clients", count);
+
+	free(fds);
+	*fd = mfd;
+	return 0;
+
+err_mfd:
+	close(mfd);
+err_fds:
+	for (i = 0; i < nfds; ++i)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	free(fds);
+	return r;
+}
+
+static int read_ids(const char **pos, int count, int *ids)
+{
+	int n;
+
+	for (int i = 0; i < count; ++i) {
+		if (sscanf(*pos, " %d%n", &ids[i], &n) != 1)
+			return -EINVAL;
+		*pos += n;
+	}
+
+	return 0;
+}
+
+static int add_closure(struct wtc_tmux *tmux, int fid, void *value)
+{
+	struct wtc_tmux_cb_closure cb;
+
+	cb.fid = fid;
+	cb.tmux = tmux;
+	cb.value.pane = value;
+	cb.free_after_use = false;
+	return wtc_tmux_add_closure(tmux, cb);
+}
+
+static int resume_pane(struct wtc_tmux *tmux, const char *line)
+{
+	struct wtc_tmux_pane *pane;
+	int id, pid, active, mode, x, y, w, h;
+
+	if (sscanf(line, "%d %d %d %d %d %d %d %d", &id, &pid, &active, &mode,
+	           &x, &y, &w, &h) != 8)
+		return -EINVAL;
+
+	pane = calloc(1, sizeof(struct wtc_tmux_pane));
+	if (!pane) {
+		crit("resume_pane: Couldn't create pane!");
+		return -ENOMEM;
+	}
+	pane->id = id;
+	pane->pid = pid;
+	pane->active = active;
+	pane->in_mode = mode;
+	pane->x = x;
+	pane->y = y;
+	pane->w = w;
+	pane->h = h;
+	HASH_ADD_INT(tmux->panes, id, pane);
+
+	return add_closure(tmux, WTC_TMUX_CB_NEW_PANE, pane);
+}
+
+static int resume_window(struct wtc_tmux *tmux, const char *line)
+{
+	struct wtc_tmux_window *wind;
+	struct wtc_tmux_pane *pane, *prev = NULL;
+	int id, active, last, count, pid, n;
+
+	if (sscanf(line, "%d %d %d %d%n", &id, &active, &last, &count,
+	           &n) != 4 || count < 0)
+		return -EINVAL;
+	line += n;
+
+	wind = calloc(1, sizeof(struct wtc_tmux_window));
+	if (!wind) {
+		crit("resume_window: Couldn't create window!");
+		return -ENOMEM;
+	}
+	wind->id = id;
+	HASH_ADD_INT(tmux->windows, id, wind);
+
+	for (int i = 0; i < count; ++i) {
+		if (read_ids(&line, 1, &pid))
+			return -EINVAL;
+
+		HASH_FIND_INT(tmux->panes, &pid, pane);
+		if (!pane || pane->window)
+			return -EINVAL;
+
+		pane->window = wind;
+		if (prev) {
+			prev->next = pane;
+			pane->previous = prev;
+		} else {
+			wind->panes = pane;
+		}
+		prev = pane;
+		wind->pane_count++;
+	}
+
+	HASH_FIND_INT(tmux->panes, &active, wind->active_pane);
+	HASH_FIND_INT(tmux->panes, &last, wind->last_pane);
+
+	return add_closure(tmux, WTC_TMUX_CB_NEW_WINDOW, wind);
+}
+
+static int resume_session(struct wtc_tmux *tmux, const char *line)
+{
+	struct wtc_tmux_session *sess;
+	unsigned long long prefix, prefix2;
+	int id, status, active, count, wid, n, r;
+
+	if (sscanf(line, "%d %d %llu %llu %d %d%n", &id, &status, &prefix,
+	           &prefix2, &active, &count, &n) != 6 || count < 0)
+		return -EINVAL;
+	line += n;
+
+	sess = calloc(1, sizeof(struct wtc_tmux_session));
+	if (!sess) {
+		crit("resume_session: Couldn't create session!");
+		return -ENOMEM;
+	}
+	sess->id = id;
+	sess->statusbar = status;
+	sess->prefix = prefix;
+	sess->prefix2 = prefix2;
+	HASH_ADD_INT(tmux->sessions, id, sess);
+
+	if (count) {
+		sess->windows = calloc(count, sizeof(struct wtc_tmux_window *));
+		if (!sess->windows) {
+			crit("resume_session: Couldn't create windows!");
+			return -ENOMEM;
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (read_ids(&line, 1, &wid))
+			return -EINVAL;
+
+		HASH_FIND_INT(tmux->windows, &wid, sess->windows[i]);
+		if (!sess->windows[i])
+			return -EINVAL;
+		sess->window_count++;
+
+		r = wtc_tmux_window_link(sess->windows[i], sess);
+		if (r < 0)
+			return r;
+	}
+
+	HASH_FIND_INT(tmux->windows, &active, sess->active_window);
+
+	return add_closure(tmux, WTC_TMUX_CB_NEW_SESSION, sess);
+}
+
+static int resume_client(struct wtc_tmux *tmux, const char *line)
+{
+	struct wtc_tmux_client *client;
+	struct wtc_tmux_session *sess;
+	const char *end;
+	int pid, sid, n;
+
+	if (sscanf(line, "%d %d %n", &pid, &sid, &n) != 2)
+		return -EINVAL;
+	line += n;
+
+	end = strchr(line, '\n');
+	if (!end || end == line)
+		return -EINVAL;
+
+	client = calloc(1, sizeof(struct wtc_tmux_client));
+	if (!client) {
+		crit("resume_client: Couldn't create client!");
+		return -ENOMEM;
+	}
+	client->pid = pid;
+	client->name = wtc_tmux_intern_len(tmux, line, end - line);
+	if (!client->name) {
+		crit("resume_client: Couldn't create client name!");
+		free(client);
+		return -ENOMEM;
+	}
+	HASH_ADD_PTR(tmux->clients, name, client);
+
+	HASH_FIND_INT(tmux->sessions, &sid, sess);
+	if (!sess)
+		return 0;
+
+	client->session = sess;
+	client->next = sess->clients;
+	if (sess->clients)
+		sess->clients->previous = client;
+	sess->clients = client;
+
+	return add_closure(tmux, WTC_TMUX_CB_CLIENT_SESSION_CHANGED, client);
+}
+
+/*
+ * Restore a control client. *line points at the rest of the cc line. Once
+ * the client's pipes have been taken (adopted or closed), *line is advanced
+ * past its buffered output; if it wasn't advanced, the pipes are still the
+ * caller's to close.
+ */
+static int resume_cc(struct wtc_tmux *tmux, const char **line)
+{
+	struct wtc_tmux_session *sess = NULL;
+	struct wtc_tmux_cc *cc;
+	int pid, fin, fout, sid, comp, n, r;
+	unsigned int unanswered;
+	size_t len;
+
+	if (sscanf(*line, "%d %d %d %d %d %u %zu%n", &pid, &fin, &fout, &sid,
+	           &comp, &unanswered, &len, &n) != 7 || (*line)[n] != '\n' ||
+	    strnlen(*line + n + 1, len + 1) < len + 1 ||
+	    (*line)[n + 1 + len] != '\n')
+		return -EINVAL;
+
+	if (sid >= 0) {
+		HASH_FIND_INT(tmux->sessions, &sid, sess);
+		if (!sess)
+			return -EINVAL;
+	}
+
+	// The client may have exited while we were exec'ing.
+	if (waitpid(pid, NULL, WNOHANG) != 0) {
+		info("resume_cc: Control client %d is gone", pid);
+		close(fin);
+		close(fout);
+		*line += n + 1 + len + 1;
+		wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_SESSIONS);
+		return 0;
+	}
+
+	if (fcntl(fin, F_SETFD, FD_CLOEXEC) < 0 ||
+	    fcntl(fout, F_SETFD, FD_CLOEXEC) < 0) {
+		warn("resume_cc: Couldn't set FD_CLOEXEC: %d", errno);
+		return -errno;
+	}
+
+	r = wtc_tmux_cc_adopt(tmux, sess, pid, fin, fout, &cc);
+	if (r < 0)
+		return r;
+
+	cc->compensate = comp;
+	cc->unanswered = unanswered;
+	r = shl_ring_push(&cc->buf, *line + n + 1, len);
+	*line += n + 1 + len + 1;
+	return r;
+}
+
+/*
+ * Close the pipes of every control client handed over from pos on. This
+ * is used when resuming fails, so that the pipes don't leak into our
+ * children and the clients exit instead of staying attached. The entries
+ * aren't validated beyond what's needed to find the pipes.
+ */
+static void close_handover_fds(const char *pos)
+{
+	int pid, fin, fout, sid, comp, n, r;
+	unsigned int unanswered;
+	size_t len;
+
+	while (pos && *pos) {
+		if (strncmp(pos, "cc ", 3) == 0) {
+			r = sscanf(pos + 3, "%d %d %d %d %d %u %zu%n", &pid,
+			           &fin, &fout, &sid, &comp, &unanswered, &len,
+			           &n);
+			if (r >= 2 && fin >= 0)
+				close(fin);
+			if (r >= 3 && fout >= 0)
+				close(fout);
+
+			// Skip the buffered output, which can contain anything.
+			if (r == 7 && pos[3 + n] == '\n') {
+				pos += 3 + n + 1;
+				if (strnlen(pos, len) < len)
+					return;
+				pos += len;
+			}
+		}
+
+		pos = strchr(pos, '\n');
+		if (pos)
+			++pos;
+	}
+}
+
+int wtc_tmux_handover_resume(struct wtc_tmux *tmux, int fd)
+{
+	struct wtc_tmux_cc *cc;
+	const char *pos, *line;
+	char *state = NULL;
+	char kw[16];
+	int refresh = 0, version, n;
+	int r = 0;
+
+	if (!tmux || tmux->connected) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	r = read_available(fd, WTC_RDAVL_CSTRING | WTC_RDAVL_BUF, NULL, &state);
+	if (close(fd))
+		warn("wtc_tmux_handover_resume: Error closing state: %d", errno);
+	if (r < 0)
+		return r;
+
+	if (sscanf(state, "wtc_tmux_handover %d\n%n", &version, &n) != 1 ||
+	    version != HANDOVER_VERSION) {
+		warn("wtc_tmux_handover_resume: Unknown state format!");
+		r = -EINVAL;
+		line = state;
+		goto err_fds;
+	}
+	pos = state + n;
+	line = pos;
+
+	r = wtc_tmux_setup_loop(tmux);
+	if (r < 0)
+		goto err_fds;
+
+	while (true) {
+		// The pipes of the ccs from line on haven't been taken yet.
+		line = pos;
+		if (sscanf(pos, "%15s%n", kw, &n) != 1) {
+			r = -EINVAL;
+			goto err_model;
+		}
+		pos += n;
+
+		if (strcmp(kw, "end") == 0)
+			break;
+
+		if (strcmp(kw, "refresh") == 0)
+			r = sscanf(pos, "%d", &refresh) == 1 ? 0 : -EINVAL;
+		else if (strcmp(kw, "version") == 0)
+			r = sscanf(pos, "%d", &tmux->version) == 1 ? 0 : -EINVAL;
+		else if (strcmp(kw, "journal") == 0)
+			r = sscanf(pos, "%" SCNu64, &tmux->journal_seq) == 1 ?
+			    0 : -EINVAL;
+		else if (strcmp(kw, "pane") == 0)
+			r = resume_pane(tmux, pos);
+		else if (strcmp(kw, "window") == 0)
+			r = resume_window(tmux, pos);
+		else if (strcmp(kw, "session") == 0)
+			r = resume_session(tmux, pos);
+		else if (strcmp(kw, "client") == 0)
+			r = resume_client(tmux, pos);
+		else if (strcmp(kw, "cc") == 0) {
+			r = resume_cc(tmux, &pos);
+			if (pos != line + n)
+				line = pos;
+		} else {
+			r = -EINVAL;
+		}
+		if (r < 0) {
+			warn("wtc_tmux_handover_resume: Bad %s entry: %d", kw, r);
+			goto err_model;
+		}
+
+		// resume_cc leaves us at the start of the next line.
+		if (strcmp(kw, "cc") != 0) {
+			pos = strchr(pos, '\n');
+			if (!pos) {
+				r = -EINVAL;
+				goto err_model;
+			}
+			++pos;
+		}
+	}
+
+	line = NULL;
+
+	// Catch up on what tmux told the old process image that it didn't get
+	// a chance to handle.
+	for (cc = tmux->ccs; cc; cc = cc->next) {
+		if (shl_ring_empty(&cc->buf))
+			continue;
+
+		r = wtc_tmux_cc_process_output(cc);
+		if (r < 0)
+			goto err_model;
+	}
+
+	// This also runs the closures queued above.
+	r = wtc_tmux_queue_refresh(tmux, refresh);
+	if (r < 0)
+		goto err_model;
+
+	info("wtc_tmux_handover_resume: Resumed %u sessions",
+	     HASH_COUNT(tmux->sessions));
+
+	tmux->connected = true;
+	wtc_tmux_set_connect_state(tmux, WTC_TMUX_CONNECT_READY);
+	free(state);
+	return 0;
+
+err_model:
+	// Nothing else references the adopted ccs yet. Closing fin makes the
+	// control clients exit.
+	while ((cc = tmux->ccs)) {
+		tmux->ccs = cc->next;
+		if (cc->outs)
+			wlc_event_source_remove(cc->outs);
+		close(cc->fin);
+		close(cc->fout);
+		free(cc->buf.buf);
+		free(cc);
+	}
+
+	wtc_tmux_clear_closures(tmux);
+	wtc_tmux_teardown_loop(tmux);
+	wtc_tmux_clear_model(tmux);
+err_fds:
+	close_handover_fds(line);
+	free(state);
+	return r;
+}
@@ -37,19 +37,49 @@
 
 #include "shl_ring.h"
 
+#include <limits.h>
 #include <signal.h>
 
 #define WTC_TMUX_TEMP_SESSION_NAME "__wtc_tmux_tmp"
 
+/*
+ * How many seconds a pane's output may lag before tmux pauses the pane (on
+ * servers which support flow control).
+ */
+#define WTC_TMUX_PAUSE_AFTER 1
+
+/*
+ * How many milliseconds control clients which ignored detach-client are
+ * given to exit after SIGTERM before they are killed outright.
+ */
+#define WTC_TMUX_TERM_GRACE 250
+
 struct wtc_tmux_cc;
 
+/*
+ * An interned string. Each distinct string is stored once per wtc_tmux and
+ * handed out as a canonical pointer to str, so equal strings compare equal
+ * as pointers and can key pointer hashes. refs counts the holders; the atom
+ * is freed when the last one lets go.
+ */
+struct wtc_tmux_atom {
+	unsigned long refs;
+	UT_hash_handle hh;
+	char str[];
+};
+
 /*
  * wtc_tmux_cbs is a wrapper for the callback functions to keep the actual
  * wtc_tmux definition simpler.
  */
 struct wtc_tmux_cbs {
+	int (*connect)(struct wtc_tmux *tmux, int state);
+
 	int (*client_session_changed)(struct wtc_tmux *tmux,
 	                              const struct wtc_tmux_client *client);
+	int (*client_visibility_changed)(struct wtc_tmux *tmux,
+	                                 const struct wtc_tmux_client *client,
+	                                 const int *panes, size_t count);
 
 	int (*new_session)(struct wtc_tmux *tmux,
 	                   const struct wtc_tmux_session *session);
@@ -76,7 +106,17 @@ struct wtc_tmux_cbs {
 };
 
 /*
- * Contains all the necessary information to invoke a callback.
+ * A member of a client's set of visible panes.
+ */
+struct wtc_tmux_pane_ref {
+	int id;
+	UT_hash_handle hh;
+};
+
+/*
+ * Contains all the necessary information to invoke a callback. The fids
+ * double as the journal's change types, so they must match the
+ * WTC_TMUX_CHANGE_* values.
  */
 struct wtc_tmux_cb_closure {
 	int fid;
@@ -92,6 +132,7 @@ struct wtc_tmux_cb_closure {
 #define WTC_TMUX_CB_PANE_CLOSED             9
 #define WTC_TMUX_CB_PANE_RESIZED           10
 #define WTC_TMUX_CB_PANE_MODE_CHANGED      11
+#define WTC_TMUX_CB_CLIENT_VISIBILITY_CHANGED 12
 	struct wtc_tmux *tmux;
 	union {
 		struct wtc_tmux_pane *pane;
@@ -102,6 +143,53 @@ struct wtc_tmux_cb_closure {
 	bool free_after_use;
 };
 
+/*
+ * A compiled command template (see wtc_tmux_cmd_compile). line is the
+ * quoted command line, ending in a newline, with a hole at each of the
+ * offsets in holes. The prefixes of %P, %W and %S are already in line, so
+ * every hole is either an int ('d') or a string ('s'). argv keeps the
+ * template as given, for running it without a control client.
+ */
+struct wtc_tmux_cmd_hole {
+	size_t off;
+	char type;
+};
+
+struct wtc_tmux_cmd {
+	char **argv;
+	char *line;
+	size_t len;
+	int hole_count;
+	struct wtc_tmux_cmd_hole *holes;
+};
+
+/*
+ * A subscription to the journal (see wtc_tmux_subscribe). seq is the
+ * sequence number of the next change to deliver.
+ */
+struct wtc_tmux_subscriber {
+	int id;
+	uint64_t seq;
+	int (*cb)(struct wtc_tmux *, const struct wtc_tmux_change *, void *);
+	void *userdata;
+
+	struct wtc_tmux_subscriber *next;
+};
+
+/*
+ * The commands wtc_tmux runs most often, which get compiled templates (see
+ * wtc_tmux_tmpl).
+ */
+#define WTC_TMUX_TMPL_OPTION_SERVER         0
+#define WTC_TMUX_TMPL_OPTION_SESSION_GLOBAL 1
+#define WTC_TMUX_TMPL_OPTION_SESSION        2
+#define WTC_TMUX_TMPL_OPTION_WINDOW_GLOBAL  3
+#define WTC_TMUX_TMPL_OPTION_WINDOW         4
+#define WTC_TMUX_TMPL_CLIENT_SIZE           5
+#define WTC_TMUX_TMPL_CLIENT_FLAGS          6
+#define WTC_TMUX_TMPL_WINDOW_PANES          7
+#define WTC_TMUX_TMPL_COUNT                 8
+
 /*
  * The actual wtc_tmux definition.
  */
@@ -113,6 +201,20 @@ struct wtc_tmux {
 	struct wtc_tmux_session *sessions;
 	struct wtc_tmux_client *clients;
 	struct wtc_tmux_key_table *tables;
+	/* Client names, key table names and binding commands. */
+	struct wtc_tmux_atom *atoms;
+	/* Counts pane reloads, to tell which windows a reload has seen. */
+	unsigned long reload_pass;
+	/* Cached here to save a string lookup on every key press. */
+	struct wtc_tmux_key_table *root_table;
+	struct wtc_tmux_key_table *prefix_table;
+	/*
+	 * Whether the key tables have been loaded since connecting, and a hash
+	 * of the list-keys output they were loaded from, so reloads which find
+	 * nothing changed are cheap.
+	 */
+	bool keys_loaded;
+	uint64_t keys_hash;
 
 	struct sigaction restore;
 	struct wlc_event_source *sigc;
@@ -123,8 +225,57 @@ struct wtc_tmux {
 #define WTC_TMUX_REFRESH_WINDOWS  (1<<1)
 #define WTC_TMUX_REFRESH_SESSIONS (1<<2)
 #define WTC_TMUX_REFRESH_CLIENTS  (1<<3)
+/* Load or drop the windows marked pending. */
+#define WTC_TMUX_REFRESH_PENDING  (1<<4)
+/* Reload the key tables, if they have been loaded. */
+#define WTC_TMUX_REFRESH_KEYS     (1<<5)
+/* Launch the control clients the initial load left to later passes. */
+#define WTC_TMUX_REFRESH_LAUNCH   (1<<6)
+	/*
+	 * The global session options, kept by the initial load for the passes
+	 * which look up each session's own options as they launch its control
+	 * client.
+	 */
+	struct {
+		bool status, top;
+		key_code prefix, prefix2;
+	} load_options;
+	/*
+	 * How many times the refresh in progress has been superseded by
+	 * notifications and restarted. Capped at WTC_TMUX_REFRESH_RESTARTS so
+	 * a steady stream of notifications can't hold off the callbacks.
+	 */
+	int refresh_restarts;
+#define WTC_TMUX_REFRESH_RESTARTS 4
+/*
+ * A session whose rate of refresh notifications reaches
+ * WTC_TMUX_POLL_ENTER per second (measured over at least
+ * WTC_TMUX_RATE_WINDOW_MS) is switched to refreshing every
+ * WTC_TMUX_POLL_MS, until its rate drops to WTC_TMUX_POLL_EXIT.
+ */
+#define WTC_TMUX_RATE_WINDOW_MS 1000
+#define WTC_TMUX_POLL_ENTER 50
+#define WTC_TMUX_POLL_EXIT 10
+#define WTC_TMUX_POLL_MS 1000
 	int refreshfd;
 	struct wlc_event_source *rfev;
+	/*
+	 * The id of the last refresh cycle to run its callbacks, and the
+	 * total time spent in refresh cycles (ns). See wtc_tmux_refresh_stats.
+	 * refresh_queued_ns is when the refresh which hasn't started yet was
+	 * first queued (0 if none is waiting), and refresh_queued holds that
+	 * time for the last WTC_TMUX_REFRESH_HISTORY cycles, by id.
+	 */
+	unsigned long refresh_id;
+	uint64_t refresh_cb_ns;
+	uint64_t refresh_queued_ns;
+#define WTC_TMUX_REFRESH_HISTORY 64
+	uint64_t refresh_queued[WTC_TMUX_REFRESH_HISTORY];
+	/*
+	 * The timer which polls while any session is polled (see
+	 * WTC_TMUX_POLL_MS).
+	 */
+	struct wlc_event_source *poll_timer;
 
 	char *bin;
 	char *socket;
@@ -134,7 +285,31 @@ struct wtc_tmux {
 	int cmdlen;
 
 	bool connected;
+	int connect_state;
+	/* The version probe, while it's running. */
+	struct wlc_event_source *probe;
+	pid_t probe_pid;
+	char probe_out[64];
+	size_t probe_len;
+	/*
+	 * A failed initial load is retried from connect_timer, backing off
+	 * from WTC_TMUX_CONNECT_RETRY_MS, up to WTC_TMUX_CONNECT_TRIES times
+	 * before the connection fails.
+	 */
+	struct wlc_event_source *connect_timer;
+	unsigned int connect_tries;
+#define WTC_TMUX_CONNECT_TRIES 5
+#define WTC_TMUX_CONNECT_RETRY_MS 250
+	/*
+	 * The server's version as WTC_TMUX_VERSION(major, minor), or
+	 * WTC_TMUX_VERSION_MASTER for a build from master (or a "next-"
+	 * build), which is assumed to support everything. 0 if unknown.
+	 */
+	int version;
+#define WTC_TMUX_VERSION(major, minor) ((major) * 100 + (minor))
+#define WTC_TMUX_VERSION_MASTER INT_MAX
 	unsigned int timeout;
+	unsigned int workers;
 	unsigned int w;
 	unsigned int h;
 
@@ -143,6 +318,47 @@ struct wtc_tmux {
 	struct wtc_tmux_cb_closure *closures;
 	size_t closure_size; /* Amount used by closures */
 	size_t closure_len; /* Amount allocated for closures */
+	/*
+	 * References dropped from the clients' visible sets, chained through
+	 * hh.next, for set_visible to reuse instead of allocating on every
+	 * flip.
+	 */
+	struct wtc_tmux_pane_ref *spare_refs;
+
+	/*
+	 * Scratch space which is reused so that, once it has grown large
+	 * enough, refreshing doesn't allocate. cmdbuf holds the command line
+	 * being sent to a control client, qbuf the output of the last
+	 * wtc_tmux_query, and ibuf the integers parsed out of it. The _len
+	 * fields are the amount allocated; these buffers never shrink.
+	 */
+	char *cmdbuf;
+	size_t cmdbuf_len;
+	char *qbuf;
+	size_t qbuf_len;
+	int *ibuf;
+	size_t ibuf_len;
+
+	/* Compiled on first use by wtc_tmux_tmpl. */
+	struct wtc_tmux_cmd *tmpls[WTC_TMUX_TMPL_COUNT];
+
+	/*
+	 * The journal of changes, a ring of WTC_TMUX_JOURNAL_LEN entries which
+	 * is allocated on first use. journal_seq is the sequence number of the
+	 * next change, and journal_base that of the first change recorded in
+	 * this process, since the ring starts out empty after a handover.
+	 */
+	struct wtc_tmux_change *journal;
+	uint64_t journal_seq;
+	uint64_t journal_base;
+	struct wtc_tmux_subscriber *subscribers;
+	int subscriber_id;
+
+	/* The shared memory object the model is published in, if any. */
+	char *export_name;
+	int export_fd;
+	void *export_map;
+	size_t export_len;
 };
 
 /*
@@ -160,10 +376,38 @@ struct wtc_tmux_cc {
 	int fout; // This will be closed automatically when removing outs
 	struct wlc_event_source *outs;
 	struct shl_ring buf;
+	/*
+	 * Set while dropping the rest of a pane output line which hadn't fully
+	 * arrived, so output never piles up in buf.
+	 */
+	bool discarding;
+
+	/*
+	 * How noisy the session is: rate is the number of notifications per
+	 * second which asked for a refresh, measured over the window which
+	 * ended at rate_start (ms), and rate_count counts them since. While
+	 * polled is set, the session is too noisy to refresh on every
+	 * notification and its refreshes are held in poll_refresh until the
+	 * next poll. poll_pending is set if anything was held, as poll_refresh
+	 * may be 0 when only callbacks need to run.
+	 */
+	unsigned long rate;
+	unsigned long rate_count;
+	long rate_start;
+	bool polled;
+	int poll_refresh;
+	bool poll_pending;
 
 	struct wtc_tmux_cc *previous;
 	struct wtc_tmux_cc *next;
 
+	/*
+	 * The number of replies still due to commands sent with
+	 * wtc_tmux_session_send. tmux answers in order, so these come before
+	 * the reply to any command sent after them, and are dropped.
+	 */
+	unsigned int unanswered;
+
 	/* 
 	 * This callback is invoked when the control process responds to
 	 * a command. This should probably not be used directly. Instead,
@@ -178,12 +422,55 @@ struct wtc_tmux_cc {
  * The following functions are implemented in tmux.c
  */
 
+/*
+ * Ask for the refresh a notification about cc's own session needs (flags
+ * may be 0, to just run the queued callbacks), counting it towards the
+ * session's rate. If the session is being polled, the refresh waits for
+ * the next poll.
+ */
+int wtc_tmux_notify_refresh(struct wtc_tmux_cc *cc, int flags);
+
 void wtc_tmux_pane_free(struct wtc_tmux_pane *pane);
 void wtc_tmux_window_free(struct wtc_tmux_window *window);
 void wtc_tmux_session_free(struct wtc_tmux_session *sess);
-void wtc_tmux_client_free(struct wtc_tmux_client *client);
-void wtc_tmux_key_table_free(struct wtc_tmux_key_table *table);
-void wtc_tmux_key_bind_free(struct wtc_tmux_key_bind *bind);
+void wtc_tmux_client_free(struct wtc_tmux *tmux,
+                          struct wtc_tmux_client *client);
+void wtc_tmux_key_table_free(struct wtc_tmux *tmux,
+                             struct wtc_tmux_key_table *table);
+void wtc_tmux_key_bind_free(struct wtc_tmux *tmux,
+                            struct wtc_tmux_key_bind *bind);
+
+/*
+ * Record in wind->sessions that wind is linked into sess, if it isn't
+ * already there.
+ */
+int wtc_tmux_window_link(struct wtc_tmux_window *wind,
+                         struct wtc_tmux_session *sess);
+/*
+ * Remove sess from wind->sessions.
+ */
+void wtc_tmux_window_unlink(struct wtc_tmux_window *wind,
+                            struct wtc_tmux_session *sess);
+
+/*
+ * Intern the first len characters of str, returning the canonical copy
+ * with a new reference (or NULL if out of memory). wtc_tmux_intern interns
+ * all of str.
+ */
+const char *wtc_tmux_intern_len(struct wtc_tmux *tmux, const char *str,
+                                size_t len);
+const char *wtc_tmux_intern(struct wtc_tmux *tmux, const char *str);
+
+/*
+ * Find the canonical copy of str without taking a reference. Returns NULL
+ * if str hasn't been interned, in which case nothing keyed by it exists.
+ */
+const char *wtc_tmux_atom_find(const struct wtc_tmux *tmux, const char *str);
+
+/*
+ * Drop a reference to an interned string. NULL is ignored.
+ */
+void wtc_tmux_atom_put(struct wtc_tmux *tmux, const char *atom);
 
 /*
  * A specialized version of waitpid that will, after the timeout value in
@@ -195,7 +482,41 @@ void wtc_tmux_key_bind_free(struct wtc_tmux_key_bind *bind);
  */
 int wtc_tmux_waitpid(struct wtc_tmux *tmux, pid_t pid, int *stat, int opt);
 
+/*
+ * Move the connection to the given stage and tell the connect callback.
+ */
+void wtc_tmux_set_connect_state(struct wtc_tmux *tmux, int state);
+
+/*
+ * Called when a refresh fails while the connection is still loading.
+ * Schedules another attempt, or fails the connection once the attempts
+ * have run out.
+ */
+void wtc_tmux_connect_retry(struct wtc_tmux *tmux);
+
+/*
+ * Set up (and tear down) everything needed to follow tmux from the event
+ * loop: the refresh and SIGCHLD pipes, the SIGCHLD handler, and the tmux
+ * command prefix. These are the parts of wtc_tmux_connect and
+ * wtc_tmux_disconnect which don't talk to the server.
+ */
+int wtc_tmux_setup_loop(struct wtc_tmux *tmux);
+void wtc_tmux_teardown_loop(struct wtc_tmux *tmux);
+
+/*
+ * Free the entire server representation (sessions, windows, panes, clients
+ * and key tables).
+ */
+void wtc_tmux_clear_model(struct wtc_tmux *tmux);
+
 int wtc_tmux_add_closure(struct wtc_tmux *, struct wtc_tmux_cb_closure);
+/*
+ * Bring the clients' visible pane sets up to date with the changes
+ * described by the queued closures, then queue a client visibility
+ * changed closure for every client whose set changed. This only looks at
+ * the panes and clients the queued changes touch.
+ */
+int wtc_tmux_update_visibility(struct wtc_tmux *tmux);
 /*
  * Run the specified closure. Returns 0 on success and 1 on failure.
  * On success, fid will be set to WTC_TMUX_CB_EMPTY. Furthermore, if
@@ -224,6 +545,23 @@ void wtc_tmux_cc_unref(struct wtc_tmux_cc *cc);
  */
 int wtc_tmux_cc_launch(struct wtc_tmux *tmux, struct wtc_tmux_session *s);
 
+/*
+ * Take over a control client which is already running (i.e., one handed
+ * over by wtc_tmux_handover_export). fin and fout are the client's stdin
+ * and stdout; they will be owned by the new wtc_tmux_cc, which is appended
+ * to tmux->ccs and stored in *out. Unlike wtc_tmux_cc_launch, no commands
+ * are sent to the client.
+ */
+int wtc_tmux_cc_adopt(struct wtc_tmux *tmux, struct wtc_tmux_session *sess,
+                      pid_t pid, int fin, int fout, struct wtc_tmux_cc **out);
+
+/*
+ * Process whatever the control clients have already written, without
+ * waiting. This lets a refresh see the notifications which arrived while
+ * it was running. Hangups are left for the event loop.
+ */
+void wtc_tmux_cc_drain(struct wtc_tmux *tmux);
+
 /*
  * Adjust the size of the control client per the linked tmux's setting.
  */
@@ -250,6 +588,31 @@ int wtc_tmux_fork(struct wtc_tmux *tmux, const char *const *cmds,
 int wtc_tmux_cc_exec(struct wtc_tmux_cc *cc, const char *const *cmds,
                      char **out, char **err);
 
+/*
+ * Like wtc_tmux_cmd_exec, except the command is run on the specified
+ * wtc_tmux_cc.
+ */
+int wtc_tmux_cmd_cc_exec(struct wtc_tmux_cc *cc,
+                         const struct wtc_tmux_cmd *cmd,
+                         char **out, char **err, ...);
+
+/*
+ * Returns the compiled template number which (one of WTC_TMUX_TMPL_*),
+ * compiling it if this is the first use, or NULL if it can't be compiled.
+ */
+const struct wtc_tmux_cmd *wtc_tmux_tmpl(struct wtc_tmux *tmux, int which);
+
+/*
+ * Like wtc_tmux_exec, except the output is stored in tmux->qbuf and *out
+ * is pointed at it, so it is only valid until the next query (although it
+ * may be modified until then). As long as
+ * there is a control client and qbuf is large enough, this doesn't
+ * allocate. stderr is ignored. If tmux answers with an error, *out is
+ * empty and 1 is returned, as tmux itself would exit with.
+ */
+int wtc_tmux_query(struct wtc_tmux *tmux, const char *const *cmds,
+                   char **out);
+
 /*
  * Retrieve the value of the option specified by name. The trailing newline
  * will be omitted in *out. Mode can be a bitwise or of several of the
@@ -273,11 +636,12 @@ int wtc_tmux_get_option(struct wtc_tmux *tmux, const char *name,
  */
 
 /*
- * Ensures the version of tmux is new enough to support the needed messages.
- * Returns 1 if the versions is new enough and 0 if it is not. Will return
- * a negative error code if something goes wrong checking the version.
+ * Ensures the version of tmux is new enough to support the needed messages,
+ * given the output of tmux -V, and records it in tmux->version. Returns 1
+ * if the versions is new enough and 0 if it is not. Will return a negative
+ * error code if the output can't be understood.
  */
-int wtc_tmux_version_check(struct wtc_tmux *tmux);
+int wtc_tmux_version_check(struct wtc_tmux *tmux, const char *out);
 
 /*
  * Reload the panes on the server. Note that, when calling this, it is
@@ -290,12 +654,34 @@ int wtc_tmux_version_check(struct wtc_tmux *tmux);
  */
 int wtc_tmux_reload_panes(struct wtc_tmux *tmux);
 
+/*
+ * Apply the pane geometry in out, which holds one window layout per line
+ * (as listed by wtc_tmux_reload_panes), to the panes on the server. Each
+ * pane found is marked by negating its pid. out is modified.
+ *
+ * Large outputs are split between tmux->workers threads, each of which
+ * collects the geometry of its panes; these are then applied in order on
+ * the calling thread, as applying them modifies the model.
+ */
+int wtc_tmux_decode_layouts(struct wtc_tmux *tmux, char *out);
+
+/*
+ * Load the panes of wind, which a notification has just introduced and
+ * which has none yet, with a single query for that window alone. If the
+ * window turns out to be gone already, it is closed. If one of its panes
+ * is already known (it was moved here from another window), a full pane
+ * reload is queued instead.
+ */
+int wtc_tmux_reload_window(struct wtc_tmux *tmux,
+                           struct wtc_tmux_window *wind);
+
 /*
  * Reload the windows on the server. Note that, when calling this, it is
  * imperative that the sessions are already up to date. Depending on where
  * this fails, the server representation may be left in a corrupted state
  * and the only viable method of recovery is to retry this function. As a
- * result of calling this function, the panes will be reloaded as well.
+ * result of calling this function, the panes will be reloaded as well,
+ * except during the initial load (which reloads them on a pass of its own).
  *
  * WARNING: There is a race condition because there is no synchronization
  * between multiple calls to tmux. This function itself only needs one
@@ -317,9 +703,11 @@ int wtc_tmux_reload_clients(struct wtc_tmux *tmux);
 /*
  * Reload the sessions on the server. Note that as a result of calling this,
  * the entire representation gets updated as the sessions are the root node
- * of the representation tree. Note that depending on where this fails, the
- * server representation may be left in a corrupted state and the only
- * viable method of recovery is to try the entire process again.
+ * of the representation tree, and a control client is launched for every
+ * new session. During the initial load, only the sessions are reloaded;
+ * the rest is left to later passes. Note that depending on where this
+ * fails, the server representation may be left in a corrupted state and
+ * the only viable method of recovery is to try the entire process again.
  *
  * WARNING: There is a race condition. This function relies on many
  * sequential calls to the server with no guarantees of atomicity. If
@@ -360,4 +748,45 @@ int wtc_tmux_refresh_cb(int fd, uint32_t mask, void *userdata);
  */
 int wtc_tmux_queue_refresh(struct wtc_tmux *tmux, int flags);
 
+/*
+ * The following functions are implemented in tmux_journal.c
+ */
+
+/*
+ * Record the changes described by the queued closures in the journal. This
+ * should be called once the model has settled, before the closures run. If
+ * the journal can't be allocated, the changes are numbered but dropped, so
+ * observers learn that they have to start over.
+ */
+void wtc_tmux_journal_record(struct wtc_tmux *tmux);
+
+/*
+ * Deliver the changes recorded since the last call to the subscribers.
+ */
+void wtc_tmux_journal_deliver(struct wtc_tmux *tmux);
+
+/*
+ * Free the journal and cancel every subscription.
+ */
+void wtc_tmux_journal_free(struct wtc_tmux *tmux);
+
+/*
+ * The following functions are implemented in tmux_export.c
+ */
+
+/*
+ * Publish the current model in the shared memory object, if one has been
+ * set up with wtc_tmux_set_export_name. Returns 0 on success or a negative
+ * error code, in which case the previous snapshot is left in place.
+ */
+int wtc_tmux_export_update(struct wtc_tmux *tmux);
+
+/*
+ * Unmap and close the shared memory object, if it's open. If unlink is
+ * true, the object is removed as well; otherwise, readers keep the last
+ * snapshot and a later wtc_tmux_set_export_name (e.g., after exec) picks
+ * it back up.
+ */
+void wtc_tmux_export_close(struct wtc_tmux *tmux, bool unlink);
+
 #endif // !WTC_TMUX_INTERNAL_H
@@ -0,0 +1,232 @@
+/*
+ * wtc - tmux_journal.c
+ *
+ * Copyright (c) 2017 Joshua Brot <jbrot@umich.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * wtc_tmux - Change Journal
+ *
+ * This file records the changes the callbacks report in a ring of the
+ * last WTC_TMUX_JOURNAL_LEN changes, and replays them to subscribers (see
+ * wtc_tmux_subscribe). The change with sequence number seq lives in slot
+ * seq % WTC_TMUX_JOURNAL_LEN, so the ring needs no head or tail: the
+ * changes still held are the last min(journal_seq - journal_base,
+ * WTC_TMUX_JOURNAL_LEN) before journal_seq.
+ */
+
+#include "tmux_internal.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+/*
+ * The sequence number of the oldest change still in the journal.
+ */
+static uint64_t journal_oldest(const struct wtc_tmux *tmux)
+{
+	uint64_t held = tmux->journal_seq - tmux->journal_base;
+
+	if (!tmux->journal)
+		held = 0;
+	if (held > WTC_TMUX_JOURNAL_LEN)
+		held = WTC_TMUX_JOURNAL_LEN;
+	return tmux->journal_seq - held;
+}
+
+static int closure_id(const struct wtc_tmux_cb_closure *cl)
+{
+	switch (cl->fid) {
+	case WTC_TMUX_CB_CLIENT_SESSION_CHANGED:
+	case WTC_TMUX_CB_CLIENT_VISIBILITY_CHANGED:
+		return cl->value.client->pid;
+	case WTC_TMUX_CB_NEW_SESSION:
+	case WTC_TMUX_CB_SESSION_CLOSED:
+	case WTC_TMUX_CB_SESSION_WINDOW_CHANGED:
+		return cl->value.session->id;
+	case WTC_TMUX_CB_NEW_WINDOW:
+	case WTC_TMUX_CB_WINDOW_CLOSED:
+	case WTC_TMUX_CB_WINDOW_PANE_CHANGED:
+		return cl->value.window->id;
+	default:
+		return cl->value.pane->id;
+	}
+}
+
+void wtc_tmux_journal_record(struct wtc_tmux *tmux)
+{
+	struct wtc_tmux_cb_closure *cl;
+	struct wtc_tmux_change *change;
+
+	if (!tmux->journal) {
+		tmux->journal = calloc(WTC_TMUX_JOURNAL_LEN,
+		                       sizeof(struct wtc_tmux_change));
+		if (!tmux->journal)
+			crit("wtc_tmux_journal_record: Couldn't allocate journal!");
+		tmux->journal_base = tmux->journal_seq;
+	}
+
+	for (size_t i = 0; i < tmux->closure_size; ++i) {
+		cl = &tmux->closures[i];
+		if (cl->fid == WTC_TMUX_CB_EMPTY)
+			continue;
+
+		if (tmux->journal) {
+			change = &tmux->journal[tmux->journal_seq %
+			                        WTC_TMUX_JOURNAL_LEN];
+			change->seq = tmux->journal_seq;
+			change->type = cl->fid;
+			change->id = closure_id(cl);
+		}
+		tmux->journal_seq++;
+	}
+
+	// Without a journal, make sure everyone sees they've missed these.
+	if (!tmux->journal)
+		tmux->journal_base = tmux->journal_seq;
+}
+
+uint64_t wtc_tmux_journal_seq(const struct wtc_tmux *tmux)
+{
+	return tmux->journal_seq;
+}
+
+int wtc_tmux_journal_read(const struct wtc_tmux *tmux, uint64_t from,
+                          struct wtc_tmux_change *out, size_t len)
+{
+	size_t i;
+
+	if (!tmux || !out || from > tmux->journal_seq)
+		return -EINVAL;
+
+	if (from < journal_oldest(tmux))
+		return -ESTALE;
+
+	for (i = 0; i < len && from + i < tmux->journal_seq; ++i)
+		out[i] = tmux->journal[(from + i) % WTC_TMUX_JOURNAL_LEN];
+
+	return i;
+}
+
+/*
+ * Bring sub up to date. Returns non-zero if the subscription should be
+ * cancelled.
+ */
+static int deliver(struct wtc_tmux *tmux, struct wtc_tmux_subscriber *sub)
+{
+	const struct wtc_tmux_change *change;
+
+	if (sub->seq < journal_oldest(tmux)) {
+		debug("deliver: Subscription %d fell behind", sub->id);
+		sub->seq = tmux->journal_seq;
+		if (sub->cb(tmux, NULL, sub->userdata))
+			return 1;
+	}
+
+	while (sub->seq < tmux->journal_seq) {
+		change = &tmux->journal[sub->seq % WTC_TMUX_JOURNAL_LEN];
+		sub->seq++;
+		if (sub->cb(tmux, change, sub->userdata))
+			return 1;
+	}
+
+	return 0;
+}
+
+void wtc_tmux_journal_deliver(struct wtc_tmux *tmux)
+{
+	struct wtc_tmux_subscriber **sub = &tmux->subscribers, *cancel;
+
+	while (*sub) {
+		if (!deliver(tmux, *sub)) {
+			sub = &(*sub)->next;
+			continue;
+		}
+
+		cancel = *sub;
+		*sub = cancel->next;
+		free(cancel);
+	}
+}
+
+int wtc_tmux_subscribe(struct wtc_tmux *tmux, uint64_t from,
+	int (*cb)(struct wtc_tmux *, const struct wtc_tmux_change *, void *),
+	void *userdata)
+{
+	struct wtc_tmux_subscriber *sub;
+
+	if (!tmux || !cb || from > tmux->journal_seq)
+		return -EINVAL;
+
+	sub = calloc(1, sizeof(*sub));
+	if (!sub) {
+		crit("wtc_tmux_subscribe: Couldn't allocate subscriber!");
+		return -ENOMEM;
+	}
+
+	sub->id = ++tmux->subscriber_id;
+	sub->seq = from;
+	sub->cb = cb;
+	sub->userdata = userdata;
+
+	if (deliver(tmux, sub)) {
+		free(sub);
+		return 0;
+	}
+
+	sub->next = tmux->subscribers;
+	tmux->subscribers = sub;
+	return sub->id;
+}
+
+void wtc_tmux_unsubscribe(struct wtc_tmux *tmux, int id)
+{
+	struct wtc_tmux_subscriber **sub, *cancel;
+
+	if (!tmux)
+		return;
+
+	for (sub = &tmux->subscribers; *sub; sub = &(*sub)->next) {
+		if ((*sub)->id != id)
+			continue;
+
+		cancel = *sub;
+		*sub = cancel->next;
+		free(cancel);
+		return;
+	}
+}
+
+void wtc_tmux_journal_free(struct wtc_tmux *tmux)
+{
+	struct wtc_tmux_subscriber *sub;
+
+	while ((sub = tmux->subscribers)) {
+		tmux->subscribers = sub->next;
+		free(sub);
+	}
+
+	free(tmux->journal);
+	tmux->journal = NULL;
+}
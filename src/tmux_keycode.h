@@ -147,4 +147,11 @@ enum {
 
 /* key_string.c */
 key_code key_string_lookup_string(const char *string);
-key_code key_code_from_xkb_key_char(uint32_t key, uint32_t chr);
+/*
+ * Translate an xkb keysym and the character it produces into a tmux key
+ * code. mods is a bitwise or of KEYC_CTRL, KEYC_ESCAPE, and KEYC_SHIFT
+ * describing the held modifiers. They are folded into the key code per the
+ * rules used by key_string_lookup_string.
+ */
+key_code key_code_from_xkb_key_char(uint32_t key, uint32_t chr,
+                                    key_code mods);
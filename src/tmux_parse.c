@@ -38,45 +38,41 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
-int wtc_tmux_version_check(struct wtc_tmux *tmux)
+int wtc_tmux_version_check(struct wtc_tmux *tmux, const char *out)
 {
-	int r = 0;
-	const char *const cmd[] = { "-V", NULL };
-	char *out = NULL;
-	r = wtc_tmux_exec(tmux, cmd, &out, NULL);
-	if (r != 0)
-		goto done;
-
 	// We have a guarantee from the source that the version
 	// string contains a space separating the program name
 	// from the version. We assume here the version has no
 	// space in it.
-	char *vst = strrchr(out, ' ');
+	const char *vst = strrchr(out, ' ');
 	if (!vst) {
 		warn("wtc_tmux_version_check: No space in version string!");
-		goto done;
+		return -EINVAL;
 	}
 	++vst; // To get the start of the version string
 
-	// The master branch should be good.
-	if (strncmp(vst, "master", 6) == 0) {
-		r = 1;
-		goto done;
+	// The master branch and the development builds leading up to a
+	// release (e.g., "next-3.4") should be good.
+	if (strncmp(vst, "master", 6) == 0 || strncmp(vst, "next-", 5) == 0) {
+		tmux->version = WTC_TMUX_VERSION_MASTER;
+		return 1;
 	}
 
-	// Process the version as a double. This may not process the entire
-	// version but it should give us a good enough guess to ensure we're
-	// past version 2.4. As future versions come out, we may need more cases
-	// here.
-	double version = atof(vst);
-	if (version > 2.4)
-		r = 1;
+	// Releases are <major>.<minor>, optionally followed by a patch letter
+	// (e.g., "3.3a"), which doesn't change what's supported.
+	int major, minor;
+	if (sscanf(vst, "%d.%d", &major, &minor) != 2) {
+		warn("wtc_tmux_version_check: Unrecognized version: %s", vst);
+		tmux->version = 0;
+		return -EINVAL;
+	}
 
-done:
-	free(out);
-	return r;
+	tmux->version = WTC_TMUX_VERSION(major, minor);
+	return tmux->version > WTC_TMUX_VERSION(2, 4);
 }
 
 /*
@@ -277,6 +273,28 @@ static int process_layout(char *layout, void *userdata,
 	return 0;
 }
 
+/*
+ * Whether any of flags has been dirtied again since the refresh started, in
+ * which case the reload checking should give up with -EAGAIN: the rest of
+ * its work would be based on stale data. Once the refresh has restarted
+ * WTC_TMUX_REFRESH_RESTARTS times, reloads run to completion regardless.
+ */
+static bool superseded(struct wtc_tmux *tmux, int flags)
+{
+	return tmux->refresh_restarts < WTC_TMUX_REFRESH_RESTARTS &&
+	       (tmux->refresh & flags);
+}
+
+/*
+ * Whether the initial load is underway. It is split into passes through the
+ * event loop (see wtc_tmux_refresh_cb), so the reloads leave the stages
+ * which would otherwise follow them to later passes.
+ */
+static bool loading(const struct wtc_tmux *tmux)
+{
+	return tmux->connect_state == WTC_TMUX_CONNECT_LOADING;
+}
+
 static int reload_panes_cb(int pid, int x, int y, int w, int h, void *ud)
 {
 	struct wtc_tmux *tmux = ud;
@@ -312,6 +330,98 @@ static int reload_panes_cb(int pid, int x, int y, int w, int h, void *ud)
 	return wtc_tmux_add_closure(tmux, cb);
 }
 
+/*
+ * A pane's geometry as decoded from a layout, for applying later.
+ */
+struct layout_rec {
+	int id, x, y, w, h;
+};
+
+struct layout_job {
+	struct wtc_chunk chunk;
+	struct layout_rec *recs;
+	size_t len;
+	size_t cap;
+};
+
+static int layout_job_cb(int pid, int x, int y, int w, int h, void *ud)
+{
+	struct layout_job *job = ud;
+	struct layout_rec *tmp;
+
+	if (job->len == job->cap) {
+		size_t cap = job->cap ? 2 * job->cap : 64;
+		tmp = realloc(job->recs, cap * sizeof(struct layout_rec));
+		if (!tmp) {
+			crit("layout_job_cb: Couldn't grow records!");
+			return -ENOMEM;
+		}
+
+		job->recs = tmp;
+		job->cap = cap;
+	}
+
+	job->recs[job->len++] = (struct layout_rec) { pid, x, y, w, h };
+	return 0;
+}
+
+static int layout_chunk(void *data)
+{
+	struct layout_job *job = data;
+	char *saveptr;
+	char *token = strtok_r(job->chunk.str, "\n", &saveptr);
+	int r;
+	while (token != NULL) {
+		r = process_layout(token, job, layout_job_cb);
+		if (r < 0)
+			return r;
+
+		token = strtok_r(NULL, "\n", &saveptr);
+	}
+
+	return 0;
+}
+
+int wtc_tmux_decode_layouts(struct wtc_tmux *tmux, char *out)
+{
+	struct wtc_chunk chunks[WTC_MAX_WORKERS];
+	struct layout_job jobs[WTC_MAX_WORKERS];
+	char *saveptr;
+	char *token;
+	size_t len = strlen(out);
+	int r = 0;
+
+	if (tmux->workers <= 1 || len < WTC_PARALLEL_MIN) {
+		token = strtok_r(out, "\n", &saveptr);
+		while (token != NULL) {
+			r = process_layout(token, tmux, reload_panes_cb);
+			if (r < 0)
+				return r;
+
+			token = strtok_r(NULL, "\n", &saveptr);
+		}
+
+		return 0;
+	}
+
+	int n = split_lines(out, len, tmux->workers, chunks, NULL);
+	for (int i = 0; i < n; ++i)
+		jobs[i] = (struct layout_job) { .chunk = chunks[i] };
+
+	r = run_workers(layout_chunk, jobs, sizeof(struct layout_job), n);
+	for (int i = 0; i < n; ++i) {
+		for (size_t j = 0; j < jobs[i].len && r >= 0; ++j) {
+			struct layout_rec *rec = &jobs[i].recs[j];
+			r = reload_panes_cb(rec->id, rec->x, rec->y, rec->w, rec->h,
+			                    tmux);
+		}
+
+		free(jobs[i].recs);
+	}
+
+	return r;
+}
+
 /*
  * Reload the panes on the server. Note that, when calling this, it is
  * imperative that the windows are already up to date. Depending on where
@@ -329,9 +439,14 @@ int wtc_tmux_reload_panes(struct wtc_tmux *tmux)
 	                      "#{pane_id} #{window_id} #{pane_active} "
 	                      "#{pane_pid} #{pane_in_mode}", NULL };
 	char *out = NULL;
-	r = wtc_tmux_exec(tmux, cmd, &out, NULL);
+	// This runs on every layout change, so it sticks to the scratch
+	// buffers in tmux to avoid allocating.
+	r = wtc_tmux_query(tmux, cmd, &out);
 	if (r < 0) // We swallow non-zero exit to handle no server being up
-		goto err_out;
+		return r;
+	if (superseded(tmux, WTC_TMUX_REFRESH_PANES | WTC_TMUX_REFRESH_WINDOWS |
+	                     WTC_TMUX_REFRESH_SESSIONS))
+		return -EAGAIN;
 
 	int count;
 	int *pids;
@@ -339,15 +454,17 @@ int wtc_tmux_reload_panes(struct wtc_tmux *tmux)
 	int *active;
 	int *ppids;
 	int *modes;
-	r = parselniiiii("%%%u @%u %u %u %u%n", out, &count, &pids, &wids,
-	                 &active, &ppids, &modes);
+	r = parselniiiii_buf("%%%u @%u %u %u %u%n", out, tmux->workers,
+	                     &tmux->ibuf, &tmux->ibuf_len, &count, &pids,
+	                     &wids, &active, &ppids, &modes);
 	if (r < 0)
-		goto err_out;
+		return r;
 
 	// We now need to synchronize the panes list in the tmux object
 	// with the actual panes list. We also clear the linked list while
 	// we're at it.
 	struct wtc_tmux_pane *pane, *tmp;
+	struct wtc_tmux_window *wind;
 	bool found;
 	HASH_ITER(hh, tmux->panes, pane, tmp) {
 		pane->previous = NULL;
@@ -367,6 +484,9 @@ int wtc_tmux_reload_panes(struct wtc_tmux *tmux)
 			continue;
 
 		HASH_DEL(tmux->panes, pane);
+		for (wind = tmux->windows; wind; wind = wind->hh.next)
+			if (wind->last_pane == pane)
+				wind->last_pane = NULL;
 
 		cb.fid = WTC_TMUX_CB_PANE_CLOSED;
 		cb.tmux = tmux;
@@ -408,14 +528,14 @@ int wtc_tmux_reload_panes(struct wtc_tmux *tmux)
 			goto err_pids;
 	}
 
-	// Now to update the linked lists. Although the same window may be
-	// listed multiple times, unlike with windows/sessions, a pane will
-	// only be associated with one window and so the repeated entries will
-	// be identical to the first time.
+	// Now to update the linked lists. A window is listed once for every
+	// session it is linked into, but a pane only belongs to one window so
+	// the repeated listings are identical to the first. Only the first
+	// listing of each window is processed.
 	// -1 -- determine, 0 -- fill in list, 2 -- skip
 	int state;
 	struct wtc_tmux_pane *prev;
-	struct wtc_tmux_window *wind;
+	unsigned long pass = ++tmux->reload_pass;
 	for (int i = 0; i < count; ++i) {
 		if (i == 0 || wids[i] != wids[i - 1]) {
 			HASH_FIND_INT(tmux->windows, &wids[i], wind);
@@ -426,8 +546,14 @@ int wtc_tmux_reload_panes(struct wtc_tmux *tmux)
 				goto err_pids;
 			}
 
-			state = -1;
 			prev = NULL;
+			if (wind->reload_pass == pass) {
+				state = 2;
+				continue;
+			}
+			wind->reload_pass = pass;
+			wind->pending = false;
+			state = -1;
 		}
 
 		if (state == 2)
@@ -440,14 +566,11 @@ int wtc_tmux_reload_panes(struct wtc_tmux *tmux)
 			goto err_pids;
 		}
 
-		// There exists a diabolical case here, that forces us to have to
-		// check this every time: due to window linking, the same window
-		// can actually appear twice in a row meaning our earlier check
-		// of wids won't detect the transition so we need to check here to
-		// prevent creating a loop. Worse yet, if this window has only one
-		// pane pane->next and pane->previous won't be set so we need to
-		// add a tertiary check for pane == prev to not miss such a repeat.
-		if (pane->next || pane->previous || pane == prev) {
+		// The same window can be listed twice in a row (linked twice into
+		// one session, or last in one session and first in the next), so
+		// the window id doesn't always change between listings. The
+		// listing order is fixed, so a repeat starts with the first pane.
+		if (state == 0 && pane == wind->panes) {
 			state = 2;
 			continue;
 		}
@@ -462,6 +585,7 @@ int wtc_tmux_reload_panes(struct wtc_tmux *tmux)
 		pane->window = wind;
 
 		if (active[i] && wind->active_pane != pane) {
+			wind->last_pane = wind->active_pane;
 			wind->active_pane = pane;
 			pane->active = true;
 
@@ -494,26 +618,29 @@ int wtc_tmux_reload_panes(struct wtc_tmux *tmux)
 		prev = pane;
 	}
 
+	// Forget last panes which have been moved to another window.
+	for (wind = tmux->windows; wind; wind = wind->hh.next)
+		if (wind->last_pane && wind->last_pane->window != wind)
+			wind->last_pane = NULL;
+
 	cmd[0] = "list-windows";
 	cmd[1] = "-aF";
 	cmd[2] = "#{window_visible_layout}";
 	cmd[3] = NULL;
-	free(out); out = NULL;
-	r = wtc_tmux_exec(tmux, cmd, &out, NULL);
+	r = wtc_tmux_query(tmux, cmd, &out);
 	if (r < 0) // We swallow non-zero exit to handle no server being up
-		goto err_pids;
+		return r;
 	r = 0; // Actually swallow as we don't necessarily have a next call
 
-	char *saveptr;
-	char *token = strtok_r(out, "\n", &saveptr);
-	while (token != NULL) {
-		r = process_layout(token, tmux, reload_panes_cb);
-		if (r < 0) {
-			warn("wtc_tmux_reload_panes: Layout processing error: %d", r);
-			goto err_layout;
-		}
+	// The layouts must match the panes we just listed.
+	if (superseded(tmux, WTC_TMUX_REFRESH_PANES | WTC_TMUX_REFRESH_WINDOWS |
+	                     WTC_TMUX_REFRESH_SESSIONS))
+		return -EAGAIN;
 
-		token = strtok_r(NULL, "\n", &saveptr);
+	r = wtc_tmux_decode_layouts(tmux, out);
+	if (r < 0) {
+		warn("wtc_tmux_reload_panes: Layout processing error: %d", r);
+		goto err_layout;
 	}
 
 	for (pane = tmux->panes; pane; pane = pane->hh.next) {
@@ -530,16 +657,178 @@ err_layout:
 		if (pane->pid < 0)
 			pane->pid *= -1;
 err_pids:
-	free(pids);
-	free(wids);
-	free(active);
-	free(ppids);
-	free(modes);
+	return r;
+}
+
+/*
+ * Drop wind, which is no longer linked into any session, along with its
+ * panes. Panes which have been moved elsewhere by a reload are kept, so
+ * this goes by pane->window rather than the (possibly stale) wind->panes.
+ */
+static int close_window(struct wtc_tmux *tmux, struct wtc_tmux_window *wind)
+{
+	struct wtc_tmux_cb_closure cb;
+	struct wtc_tmux_session *sess;
+	struct wtc_tmux_window *other;
+	struct wtc_tmux_pane *pane, *tmp;
+	int r;
+
+	HASH_DEL(tmux->windows, wind);
+	for (sess = tmux->sessions; sess; sess = sess->hh.next)
+		if (sess->active_window == wind)
+			sess->active_window = NULL;
+	for (other = tmux->windows; other; other = other->hh.next)
+		if (other->last_pane && other->last_pane->window == wind)
+			other->last_pane = NULL;
+
+	cb.tmux = tmux;
+	cb.free_after_use = true;
+	HASH_ITER(hh, tmux->panes, pane, tmp) {
+		if (pane->window != wind)
+			continue;
+
+		HASH_DEL(tmux->panes, pane);
+
+		cb.fid = WTC_TMUX_CB_PANE_CLOSED;
+		cb.value.pane = pane;
+		r = wtc_tmux_add_closure(tmux, cb);
+		if (r < 0)
+			return r;
+	}
+
+	cb.fid = WTC_TMUX_CB_WINDOW_CLOSED;
+	cb.value.window = wind;
+	return wtc_tmux_add_closure(tmux, cb);
+}
+
+int wtc_tmux_reload_window(struct wtc_tmux *tmux,
+                           struct wtc_tmux_window *wind)
+{
+	int r = 0;
+	struct wtc_tmux_cb_closure cb;
+	const struct wtc_tmux_cmd *cmd;
+	char *out = NULL;
+
+	wind->pending = false;
+
+	cmd = wtc_tmux_tmpl(tmux, WTC_TMUX_TMPL_WINDOW_PANES);
+	if (!cmd)
+		return -ENOMEM;
+
+	r = wtc_tmux_cmd_exec(tmux, cmd, &out, NULL, wind->id);
+	if (r < 0)
+		goto err_out;
+
+	struct wtc_tmux_pane *pane, *prev = NULL;
+	char *line, *layout = NULL, *saveptr;
+	int id, active, pid, mode, n;
+	line = out ? strtok_r(out, "\n", &saveptr) : NULL;
+	for ( ; line; line = strtok_r(NULL, "\n", &saveptr)) {
+		if (sscanf(line, "%%%u %u %u %u %n", &id, &active, &pid, &mode,
+		           &n) != 4) {
+			warn("wtc_tmux_reload_window: Invalid pane: %s", line);
+			r = -EINVAL;
+			goto err_out;
+		}
+		if (!layout)
+			layout = line + n;
+
+		HASH_FIND_INT(tmux->panes, &id, pane);
+		if (pane) {
+			r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_PANES);
+			goto err_out;
+		}
+
+		pane = calloc(1, sizeof(struct wtc_tmux_pane));
+		if (!pane) {
+			crit("wtc_tmux_reload_window: Couldn't create pane!");
+			r = -ENOMEM;
+			goto err_out;
+		}
+		pane->id = id;
+		pane->pid = pid;
+		pane->in_mode = mode;
+		pane->window = wind;
+		HASH_ADD_INT(tmux->panes, id, pane);
+
+		if (prev) {
+			prev->next = pane;
+			pane->previous = prev;
+		} else {
+			wind->panes = pane;
+		}
+		prev = pane;
+		wind->pane_count++;
+
+		cb.fid = WTC_TMUX_CB_NEW_PANE;
+		cb.tmux = tmux;
+		cb.value.pane = pane;
+		cb.free_after_use = false;
+		r = wtc_tmux_add_closure(tmux, cb);
+		if (r < 0)
+			goto err_out;
+
+		if (active) {
+			wind->active_pane = pane;
+			pane->active = true;
+
+			cb.fid = WTC_TMUX_CB_WINDOW_PANE_CHANGED;
+			cb.value.window = wind;
+			r = wtc_tmux_add_closure(tmux, cb);
+			if (r < 0)
+				goto err_out;
+		}
+	}
+
+	// No panes means the window was gone before we got to it.
+	if (!layout) {
+		r = close_window(tmux, wind);
+		goto err_out;
+	}
+
+	r = process_layout(layout, tmux, reload_panes_cb);
+	for (pane = wind->panes; pane; pane = pane->next)
+		if (pane->pid < 0)
+			pane->pid *= -1;
+	if (r < 0)
+		warn("wtc_tmux_reload_window: Layout processing error: %d", r);
+
 err_out:
 	free(out);
 	return r;
 }
 
+/*
+ * Settle the windows notifications have marked pending: load the ones which
+ * are new and drop the ones which are no longer in any session. Every
+ * control client is caught up first, so a window which moved between
+ * sessions has been relinked by now.
+ */
+static int reload_pending_windows(struct wtc_tmux *tmux)
+{
+	struct wtc_tmux_window *wind, *tmp;
+	int r = 0;
+
+	wtc_tmux_cc_drain(tmux);
+
+	HASH_ITER(hh, tmux->windows, wind, tmp) {
+		if (!wind->pending)
+			continue;
+
+		wind->pending = false;
+		// A window which isn't in any session by now is gone, even one
+		// we've only just heard of.
+		if (wind->session_count == 0)
+			r = close_window(tmux, wind);
+		else if (!wind->panes)
+			r = wtc_tmux_reload_window(tmux, wind);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
 int wtc_tmux_reload_windows(struct wtc_tmux *tmux)
 {
 	int r = 0;
@@ -551,6 +840,11 @@ int wtc_tmux_reload_windows(struct wtc_tmux *tmux)
 	r = wtc_tmux_exec(tmux, cmd, &out, NULL);
 	if (r < 0) // We swallow non-zero exit to handle no server being up
 		goto err_out;
+	if (superseded(tmux, WTC_TMUX_REFRESH_WINDOWS |
+	                     WTC_TMUX_REFRESH_SESSIONS)) {
+		r = -EAGAIN;
+		goto err_out;
+	}
 
 	int count;
 	int *wids;
@@ -566,6 +860,8 @@ int wtc_tmux_reload_windows(struct wtc_tmux *tmux)
 	struct wtc_tmux_window *wind, *tmp;
 	bool found;
 	HASH_ITER(hh, tmux->windows, wind, tmp) {
+		wind->session_count = 0;
+
 		found = false;
 		for (int i = 0; i < count; ++i) {
 			// We don't have a uniqueness guarantee so we need to keep going
@@ -659,6 +955,11 @@ int wtc_tmux_reload_windows(struct wtc_tmux *tmux)
 		}
 		windows[sess->window_count] = wind;
 		sess->window_count++;
+
+		r = wtc_tmux_window_link(wind, sess);
+		if (r < 0)
+			goto err_windows;
+
 		if (active[i] && sess->active_window != wind) {
 			sess->active_window = wind;
 
@@ -689,7 +990,8 @@ int wtc_tmux_reload_windows(struct wtc_tmux *tmux)
 		windows = NULL;
 	}
 
-	r = wtc_tmux_reload_panes(tmux);
+	if (!loading(tmux))
+		r = wtc_tmux_reload_panes(tmux);
 
 err_windows:
 	free(windows);
@@ -713,6 +1015,11 @@ int wtc_tmux_reload_clients(struct wtc_tmux *tmux)
 	r = wtc_tmux_exec(tmux, cmd, &out, NULL);
 	if (r < 0) // We swallow non-zero exit to handle no server being up
 		goto err_out;
+	if (superseded(tmux, WTC_TMUX_REFRESH_CLIENTS |
+	                     WTC_TMUX_REFRESH_SESSIONS)) {
+		r = -EAGAIN;
+		goto err_out;
+	}
 
 	int count;
 	int *sids;
@@ -738,7 +1045,7 @@ int wtc_tmux_reload_clients(struct wtc_tmux *tmux)
 		}
 
 		HASH_DEL(tmux->clients, client);
-		wtc_tmux_client_free(client);
+		wtc_tmux_client_free(tmux, client);
 
 		icont: ;
 	}
@@ -754,14 +1061,14 @@ int wtc_tmux_reload_clients(struct wtc_tmux *tmux)
 			goto err_ids;
 		}
 		client->pid = cpids[i];
-		client->name = strdup(names[i]);
+		client->name = wtc_tmux_intern(tmux, names[i]);
 		if (!client->name) {
 			crit("wtc_tmux_reload_clients: Couldn't create client name!");
+			free(client);
 			r = -ENOMEM;
 			goto err_ids;
 		}
-		HASH_ADD_KEYPTR(hh, tmux->clients, client->name,
-		                strlen(client->name), client);
+		HASH_ADD_PTR(tmux->clients, name, client);
 	}
 
 	// Now to update the linked lists.
@@ -772,8 +1079,12 @@ int wtc_tmux_reload_clients(struct wtc_tmux *tmux)
 		sess->clients = NULL;
 	// Now fill in the new ones (unlike with the other types, clients aren't
 	// sorted by session)
+	const char *atom;
 	for (int i = 0; i < count; ++i) {
-		HASH_FIND(hh, tmux->clients, names[i], strlen(names[i]), client);
+		client = NULL;
+		atom = wtc_tmux_atom_find(tmux, names[i]);
+		if (atom)
+			HASH_FIND_PTR(tmux->clients, &atom, client);
 		if (!client) {
 			warn("wtc_tmux_reload_clients: Couldn't find client \"%s\"!",
 			     names[i]);
@@ -841,6 +1152,10 @@ int wtc_tmux_reload_sessions(struct wtc_tmux *tmux)
 	r = wtc_tmux_exec(tmux, cmd, &out, NULL);
 	if (r < 0) // We swallow non-zero exit to handle no server being up
 		goto err_out;
+	if (superseded(tmux, WTC_TMUX_REFRESH_SESSIONS)) {
+		r = -EAGAIN;
+		goto err_out;
+	}
 
 	int count;
 	int *sids;
@@ -961,6 +1276,20 @@ int wtc_tmux_reload_sessions(struct wtc_tmux *tmux)
 			goto err_sids;
 		}
 	}
+	if (superseded(tmux, WTC_TMUX_REFRESH_SESSIONS)) {
+		r = -EAGAIN;
+		goto err_sids;
+	}
+
+	// The initial load looks up each session's options as it launches
+	// the session's control client (see launch_next).
+	if (loading(tmux)) {
+		tmux->load_options.status = gstatus;
+		tmux->load_options.top = gstop;
+		tmux->load_options.prefix = gprefix;
+		tmux->load_options.prefix2 = gprefix2;
+		goto err_sids;
+	}
 
 	// Update options and ensure a control client.
 	struct wtc_tmux_cc *cc;
@@ -989,10 +1318,6 @@ int wtc_tmux_reload_sessions(struct wtc_tmux *tmux)
 	if (r)
 		goto err_sids;
 
-	r = wtc_tmux_reload_key_binds(tmux);
-	if (r)
-		goto err_sids;
-
 	// If we have no sessions, start a temporary session.
 	if (!tmux->sessions)
 		r = wtc_tmux_cc_launch(tmux, NULL);
@@ -1113,8 +1438,10 @@ out:
 static int get_table(struct wtc_tmux *tmux, const char *name,
                      struct wtc_tmux_key_table **out)
 {
-	struct wtc_tmux_key_table *table;
-	HASH_FIND(hh, tmux->tables, name, strlen(name), table);
+	struct wtc_tmux_key_table *table = NULL;
+	const char *atom = wtc_tmux_atom_find(tmux, name);
+	if (atom)
+		HASH_FIND_PTR(tmux->tables, &atom, table);
 
 	if (table) {
 		*out = table;
@@ -1127,15 +1454,14 @@ static int get_table(struct wtc_tmux *tmux, const char *name,
 		return -ENOMEM;
 	}
 
-	table->name = strdup(name);
+	table->name = wtc_tmux_intern(tmux, name);
 	if (!table->name) {
 		crit("get_table: Couldn't allocate table name!");
 		free(table);
 		return -ENOMEM;
 	}
 
-	HASH_ADD_KEYPTR(hh, tmux->tables, table->name, strlen(table->name),
-	                table);
+	HASH_ADD_PTR(tmux->tables, name, table);
 
 	*out = table;
 	return 0;
@@ -1164,54 +1490,262 @@ static int get_bind(struct wtc_tmux_key_table *table, key_code code,
 	return 0;
 }
 
-int wtc_tmux_reload_key_binds(struct wtc_tmux *tmux)
+/*
+ * Determine the key table a binding's command switches into. If the
+ * command is exactly a "switch-client -T <table>" (so tmux would do
+ * nothing besides changing the key table), the table name is copied into
+ * name (which has room for len characters) and 1 is returned. Otherwise 0
+ * is returned and the command has to be run by tmux.
+ */
+static int parse_bind_switch(const char *cmd, char *name, size_t len)
 {
-	const int repeat_pos = strlen("bind-key -");
-	const int table_pos  = strlen("bind-key -r -T ");
-	const char *cmd[] = { "list-keys", NULL };
-	int r = 0;
-
-	char *out = NULL;
-	r = wtc_tmux_exec(tmux, cmd, &out, NULL);
-	if (r < 0) // We swallow non-zero exit to handle no server being up
-		goto err_out;
+	const char *tok, *end;
+	bool found = false;
+	size_t tlen;
+	int state = 0; // 0 - command, 1 - flag, 2 - table name
+
+	for (tok = cmd; *tok; tok = end) {
+		while (*tok == ' ' || *tok == '\t' || *tok == '\n')
+			++tok;
+		if (!*tok)
+			break;
 
-	int keyp, cmdp;
-	r = find_offsets(out, &keyp, &cmdp);
-	if (r < 0)
-		goto err_out;
+		for (end = tok; *end && *end != ' ' && *end != '\t' &&
+		                *end != '\n'; ++end) ;
+		tlen = end - tok;
 
-	// Mark all the existing key bindings so we'll know who to delete.
-	struct wtc_tmux_key_table *table;
-	struct wtc_tmux_key_bind *bind;
-	for (table = tmux->tables; table; table = table->hh.next)
-		for (bind = table->binds; bind; bind = bind->hh.next)
-			bind->table = NULL;
+		switch (state) {
+		case 0:
+			if ((tlen != strlen("switch-client") ||
+			     strncmp(tok, "switch-client", tlen) != 0) &&
+			    (tlen != strlen("switchc") ||
+			     strncmp(tok, "switchc", tlen) != 0))
+				return 0;
+			state = 1;
+			break;
+		case 1:
+			if (found || tlen != 2 || strncmp(tok, "-T", 2) != 0)
+				return 0;
+			state = 2;
+			break;
+		case 2:
+			// tmux quotes names with special characters.
+			if (tlen >= 2 && (*tok == '"' || *tok == '\'') &&
+			    tok[tlen - 1] == *tok) {
+				++tok;
+				tlen -= 2;
+			}
+			if (tlen == 0 || tlen >= len)
+				return 0;
+			memcpy(name, tok, tlen);
+			name[tlen] = '\0';
+			found = true;
+			state = 1;
+			break;
+		}
+	}
 
-	struct wtc_tmux_key_table *root;
-	r = get_table(tmux, "root", &root);
-	if (r < 0)
-		goto err_clean;
+	return found && state == 1;
+}
 
-	int ll = 0;
-	key_code code;
+/*
+ * Determine whether a binding's command only moves the active pane, i.e.,
+ * it is exactly "select-pane -L/-R/-U/-D" or "last-pane" (or their
+ * aliases). Returns the matching WTC_TMUX_KEY_BIND_* action, storing the
+ * direction in dir for WTC_TMUX_KEY_BIND_SELECT_PANE, or
+ * WTC_TMUX_KEY_BIND_COMMAND if the command is anything else.
+ */
+static int parse_bind_pane(const char *cmd, int *dir)
+{
+	// Indexed by WTC_TMUX_PANE_*
+	static const char flags[] = { 'L', 'R', 'U', 'D' };
+	const char *tok, *end;
+	size_t tlen;
+	int state = 0; // 0 - command, 1 - flag, 2 - done
+	int action = WTC_TMUX_KEY_BIND_COMMAND;
+
+	for (tok = cmd; *tok; tok = end) {
+		while (*tok == ' ' || *tok == '\t' || *tok == '\n')
+			++tok;
+		if (!*tok)
+			break;
+
+		for (end = tok; *end && *end != ' ' && *end != '\t' &&
+		                *end != '\n'; ++end) ;
+		tlen = end - tok;
+
+		switch (state) {
+		case 0:
+			if ((tlen == strlen("select-pane") &&
+			     strncmp(tok, "select-pane", tlen) == 0) ||
+			    (tlen == strlen("selectp") &&
+			     strncmp(tok, "selectp", tlen) == 0)) {
+				action = WTC_TMUX_KEY_BIND_SELECT_PANE;
+				state = 1;
+			} else if ((tlen == strlen("last-pane") &&
+			            strncmp(tok, "last-pane", tlen) == 0) ||
+			           (tlen == strlen("lastp") &&
+			            strncmp(tok, "lastp", tlen) == 0)) {
+				action = WTC_TMUX_KEY_BIND_LAST_PANE;
+				state = 2;
+			} else {
+				return WTC_TMUX_KEY_BIND_COMMAND;
+			}
+			break;
+		case 1:
+			if (tlen != 2 || tok[0] != '-')
+				return WTC_TMUX_KEY_BIND_COMMAND;
+			for (*dir = 0; *dir < (int) sizeof(flags); ++*dir)
+				if (tok[1] == flags[*dir])
+					break;
+			if (*dir == (int) sizeof(flags))
+				return WTC_TMUX_KEY_BIND_COMMAND;
+			state = 2;
+			break;
+		case 2:
+			// Anything else (a target, -Z, a second command, ...) means
+			// we can't be sure what tmux will do.
+			return WTC_TMUX_KEY_BIND_COMMAND;
+		}
+	}
+
+	return state == 2 ? action : WTC_TMUX_KEY_BIND_COMMAND;
+}
+
+/*
+ * Determine whether cmd may change the key bindings, i.e., whether any of
+ * its words is bind-key, unbind-key or source-file (or their aliases), or
+ * a command which runs commands we can't see (command-prompt, run-shell
+ * and display-popup). This errs on the side of yes: a false positive only
+ * costs a reload.
+ */
+static bool parse_bind_rebinds(const char *cmd)
+{
+	static const char *const names[] = { "bind-key", "bind", "unbind-key",
+	                                     "unbind", "source-file", "source",
+	                                     "command-prompt", "run-shell", "run",
+	                                     "display-popup", "popup" };
+	const char *tok, *end;
+	size_t tlen;
+
+	for (tok = cmd; *tok; tok = end) {
+		while (*tok == ' ' || *tok == '\t' || *tok == '\n' || *tok == ';')
+			++tok;
+		if (!*tok)
+			break;
+
+		for (end = tok; *end && *end != ' ' && *end != '\t' &&
+		                *end != '\n' && *end != ';'; ++end) ;
+		tlen = end - tok;
+
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+			if (tlen == strlen(names[i]) &&
+			    strncmp(tok, names[i], tlen) == 0)
+				return true;
+	}
+
+	return false;
+}
+
+/*
+ * Work out what bind->cmd does.
+ */
+static int parse_bind(struct wtc_tmux *tmux, struct wtc_tmux_key_bind *bind,
+                      struct wtc_tmux_key_table *root)
+{
+	struct wtc_tmux_key_table *next;
+	char tname[256];
+	int r;
+
+	bind->action = parse_bind_pane(bind->cmd, &bind->direction);
+	bind->rebinds = parse_bind_rebinds(bind->cmd);
+	bind->next_table = root;
+	if (parse_bind_switch(bind->cmd, tname, sizeof(tname))) {
+		r = get_table(tmux, tname, &next);
+		if (r < 0)
+			return r;
+
+		bind->action = WTC_TMUX_KEY_BIND_SWITCH;
+		bind->next_table = next;
+	}
+
+	return 0;
+}
+
+int wtc_tmux_reload_key_binds(struct wtc_tmux *tmux)
+{
+	const int repeat_pos = strlen("bind-key -");
+	const int table_pos  = strlen("bind-key -r -T ");
+	const char *cmd[] = { "list-keys", NULL };
+	int r = 0;
+
+	char *out = NULL;
+	r = wtc_tmux_exec(tmux, cmd, &out, NULL);
+	if (r < 0) // We swallow non-zero exit to handle no server being up
+		goto err_out;
+
+	// Most reloads are only checks, which find nothing has changed.
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a
+	for (const char *c = out ? out : ""; *c; ++c)
+		hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+	if (tmux->keys_loaded && hash == tmux->keys_hash) {
+		r = 0;
+		goto err_out;
+	}
+
+	int keyp, cmdp;
+	r = find_offsets(out, &keyp, &cmdp);
+	if (r < 0)
+		goto err_out;
+
+	// Mark all the existing key bindings so we'll know who to delete.
+	struct wtc_tmux_key_table *table;
+	struct wtc_tmux_key_bind *bind;
+	for (table = tmux->tables; table; table = table->hh.next)
+		for (bind = table->binds; bind; bind = bind->hh.next)
+			bind->table = NULL;
+
+	struct wtc_tmux_key_table *root;
+	r = get_table(tmux, "root", &root);
+	if (r < 0)
+		goto err_clean;
+	tmux->root_table = root;
+
+	r = get_table(tmux, "prefix", &tmux->prefix_table);
+	if (r < 0)
+		goto err_clean;
+
+	int ll = 0;
+	key_code code;
 	char *start, *end;
 	bool repeat = false, in = false;
 	for (int i = 0; out[i]; ++i) {
 		if (out[i] == '\n') {
 			if (in && bind) {
 				start = &out[i + (cmdp - ll)];
-				out[++i] = '\0';
-				free((void *) bind->cmd); bind->cmd = NULL;
-				bind->cmd = strdup(start);
-				if (!bind->cmd)
+				// The command keeps its newline; the next line (if any)
+				// gives up its first character for the terminator.
+				if (out[i + 1])
+					out[++i] = '\0';
+				const char *bcmd = wtc_tmux_intern(tmux, start);
+				if (!bcmd)
 					goto err_clean;
 
 				bind->table = table;
 				bind->repeat = repeat;
-				
-				// TODO Parse next table from bind->cmd
-				bind->next_table = root;
+
+				// An unchanged command keeps its parsed action. Either
+				// way, one of the two references is dropped, but only
+				// once the atoms have been compared.
+				if (bcmd == bind->cmd) {
+					wtc_tmux_atom_put(tmux, bcmd);
+				} else {
+					wtc_tmux_atom_put(tmux, bind->cmd);
+					bind->cmd = bcmd;
+					r = parse_bind(tmux, bind, root);
+					if (r < 0)
+						goto err_clean;
+				}
 				ll = 1;
 			} else {
 				ll = 0;
@@ -1263,24 +1797,22 @@ int wtc_tmux_reload_key_binds(struct wtc_tmux *tmux)
 		++ll;
 	}
 
+	tmux->keys_loaded = true;
+	tmux->keys_hash = hash;
+
 err_clean: ;
-	// Clean up existing bindings.
-	struct wtc_tmux_key_table *ttbl;
+	// Clean up existing bindings. Empty tables are deliberately kept around
+	// so that any references to them (e.g., a client's current table)
+	// remain valid.
 	struct wtc_tmux_key_bind *tbnd;
-	HASH_ITER(hh, tmux->tables, table, ttbl) {
+	for (table = tmux->tables; table; table = table->hh.next) {
 		HASH_ITER(hh, table->binds, bind, tbnd) {
 			if (bind->table)
 				continue;
 
 			HASH_DEL(table->binds, bind);
-			wtc_tmux_key_bind_free(bind);
+			wtc_tmux_key_bind_free(tmux, bind);
 		}
-
-		if (table->binds)
-			continue;
-
-		HASH_DEL(tmux->tables, table);
-		wtc_tmux_key_table_free(table);
 	}
 err_out:
 	free(out);
@@ -1306,9 +1838,62 @@ static void print_status(struct wtc_tmux *tmux)
 	}
 }
 
+/*
+ * Look up the options of the first session without a control client and
+ * launch one for it, or launch one for the temporary session if there are
+ * no sessions. Returns 1 if there are more to launch, 0 if not, or a
+ * negative error code.
+ */
+static int launch_next(struct wtc_tmux *tmux)
+{
+	struct wtc_tmux_session *sess;
+	struct wtc_tmux_cc *cc;
+	bool launched = false;
+	int r;
+
+	if (!tmux->sessions)
+		return wtc_tmux_cc_launch(tmux, NULL);
+
+	for (sess = tmux->sessions; sess; sess = sess->hh.next) {
+		for (cc = tmux->ccs; cc; cc = cc->next)
+			if (cc->session == sess)
+				break;
+		if (cc)
+			continue;
+		if (launched)
+			return 1;
+
+		r = update_session_options(tmux, sess, tmux->load_options.status,
+		                           tmux->load_options.top,
+		                           tmux->load_options.prefix,
+		                           tmux->load_options.prefix2);
+		if (r)
+			return r;
+
+		r = wtc_tmux_cc_launch(tmux, sess);
+		if (r)
+			return r;
+		launched = true;
+	}
+
+	return 0;
+}
+
+/*
+ * CLOCK_MONOTONIC, in nanoseconds.
+ */
+static uint64_t refresh_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 int wtc_tmux_refresh_cb(int fd, uint32_t mask, void *userdata)
 {
 	struct wtc_tmux *tmux = userdata;
+	uint64_t start = refresh_now();
 
 	int r = read_available(fd, WTC_RDAVL_DISCARD, NULL, NULL);
 	if (r < 0) {
@@ -1318,59 +1903,187 @@ int wtc_tmux_refresh_cb(int fd, uint32_t mask, void *userdata)
 
 	// We make a copy so that when executing commands that might 
 	// inadvertantly change the value, we don't contaminate our list of
-	// things to refresh.
+	// things to refresh. Notifications which arrive in the meantime land
+	// in tmux->refresh; if they dirty something already being reloaded,
+	// that reload gives up with -EAGAIN and we start over from the
+	// earliest dirty stage. The closures queued so far are kept, so the
+	// callbacks still run once, on the final state.
+	// The initial load is too much to do in one go without stalling the
+	// event loop, so it does one stage per pass and requeues the rest (see
+	// yield below).
 	int refresh = tmux->refresh;
+	uint64_t queued = tmux->refresh_queued_ns ? tmux->refresh_queued_ns :
+	                  start;
 	tmux->refresh = 0;
+	tmux->refresh_queued_ns = 0;
+	tmux->refresh_restarts = 0;
+	bool churn = false;
 
+restart:
 	if (refresh & WTC_TMUX_REFRESH_SESSIONS) {
 		r = wtc_tmux_reload_sessions(tmux);
+		if (r == -EAGAIN)
+			goto again;
 		if (r < 0)
 			goto exit;
 
-		refresh = 0;
+		churn = true;
+		refresh &= WTC_TMUX_REFRESH_KEYS;
+		if (loading(tmux)) {
+			refresh |= WTC_TMUX_REFRESH_WINDOWS | WTC_TMUX_REFRESH_PANES |
+			           WTC_TMUX_REFRESH_CLIENTS | WTC_TMUX_REFRESH_LAUNCH;
+			goto yield;
+		}
 	}
 
 	if (refresh & WTC_TMUX_REFRESH_WINDOWS) {
 		r = wtc_tmux_reload_windows(tmux);
+		if (r == -EAGAIN)
+			goto again;
 		if (r < 0)
 			goto exit;
 
-		refresh &= ~(WTC_TMUX_REFRESH_WINDOWS | WTC_TMUX_REFRESH_PANES);
+		refresh &= ~WTC_TMUX_REFRESH_WINDOWS;
+		if (!loading(tmux))
+			refresh &= ~WTC_TMUX_REFRESH_PANES;
+		else if (refresh)
+			goto yield;
 	}
 
 	if (refresh & WTC_TMUX_REFRESH_PANES) {
 		r = wtc_tmux_reload_panes(tmux);
+		if (r == -EAGAIN)
+			goto again;
 		if (r < 0)
 			goto exit;
 
 		refresh &= ~WTC_TMUX_REFRESH_PANES;
+		if (loading(tmux) && refresh)
+			goto yield;
+	}
+
+	if (refresh & WTC_TMUX_REFRESH_PENDING) {
+		r = reload_pending_windows(tmux);
+		if (r < 0)
+			goto exit;
+
+		refresh &= ~WTC_TMUX_REFRESH_PENDING;
 	}
 
 	if (refresh & WTC_TMUX_REFRESH_CLIENTS) {
 		r = wtc_tmux_reload_clients(tmux);
+		if (r == -EAGAIN)
+			goto again;
 		if (r < 0)
 			goto exit;
 
+		churn = true;
 		refresh &= ~WTC_TMUX_REFRESH_CLIENTS;
+		if (loading(tmux) && refresh)
+			goto yield;
+	}
+
+	// Only the initial load leaves launches for later, one per pass.
+	if (refresh & WTC_TMUX_REFRESH_LAUNCH) {
+		r = launch_next(tmux);
+		if (r < 0)
+			goto exit;
+
+		if (r == 0)
+			refresh &= ~WTC_TMUX_REFRESH_LAUNCH;
+		if (loading(tmux) && refresh)
+			goto yield;
+	}
+
+	// Nothing waits on this, so it comes last. Key tables which haven't
+	// been loaded yet will be loaded fresh when they are first needed.
+	if (refresh & WTC_TMUX_REFRESH_KEYS) {
+		if (tmux->keys_loaded) {
+			r = wtc_tmux_reload_key_binds(tmux);
+			if (r < 0)
+				goto exit;
+		}
+
+		refresh &= ~WTC_TMUX_REFRESH_KEYS;
 	}
 
 	assert(refresh == 0);
 
+	// Catch up on anything that came in while we were reloading before
+	// telling anyone about the result.
+	wtc_tmux_cc_drain(tmux);
+	if (tmux->refresh && tmux->refresh_restarts < WTC_TMUX_REFRESH_RESTARTS)
+		goto again;
+
 	print_status(tmux);
 
+	tmux->refresh_id++;
+	tmux->refresh_queued[tmux->refresh_id % WTC_TMUX_REFRESH_HISTORY] =
+		queued;
+	debug("wtc_tmux_refresh_cb: Refresh %lu: %zu callbacks", tmux->refresh_id,
+	      tmux->closure_size);
+
+	r = wtc_tmux_update_visibility(tmux);
+	if (r < 0)
+		goto exit;
+
+	// The model has settled, so this is the time to publish it. Readers
+	// falling behind isn't worth failing the refresh over.
+	if (wtc_tmux_export_update(tmux) < 0)
+		warn("wtc_tmux_refresh_cb: Couldn't publish the model");
+	wtc_tmux_journal_record(tmux);
+
 	for (size_t i = 0; i < tmux->closure_size; ++i) {
 		r = wtc_tmux_closure_invoke(&(tmux->closures[i]));
 		if (r)
 			break;
 	}
 
+	wtc_tmux_journal_deliver(tmux);
+
+	// Sessions and clients coming and going hint that the key bindings may
+	// have been changed from outside (e.g., a new client's config file).
+	// The check gets a refresh of its own so it never holds up the above.
+	if (churn && tmux->keys_loaded)
+		wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_KEYS);
+
+	// The model is in place even if a callback failed, so the connection
+	// is usable either way.
+	if (tmux->connect_state == WTC_TMUX_CONNECT_LOADING)
+		wtc_tmux_set_connect_state(tmux, WTC_TMUX_CONNECT_READY);
+
 exit:
+	// The reloads block on tmux, so they're counted along with the
+	// callbacks.
+	tmux->refresh_cb_ns += refresh_now() - start;
 	// If there's an error, ensure what we missed gets taken care of next
 	// time.
-	if (refresh)
+	if (refresh) {
 		tmux->refresh |= refresh;
+		if (!tmux->refresh_queued_ns)
+			tmux->refresh_queued_ns = queued;
+	}
+	// Nothing else will try again while the initial load is failing.
+	if (r < 0 && tmux->connect_state == WTC_TMUX_CONNECT_LOADING)
+		wtc_tmux_connect_retry(tmux);
 	wtc_tmux_clear_closures(tmux);
 	return r;
+
+again:
+	debug("wtc_tmux_refresh_cb: Restarting for %d", tmux->refresh);
+	refresh |= tmux->refresh;
+	tmux->refresh = 0;
+	tmux->refresh_queued_ns = 0;
+	tmux->refresh_restarts++;
+	goto restart;
+
+yield:
+	// Frames get drawn before the next stage. The closures are kept for
+	// the pass which finishes the load.
+	tmux->refresh_cb_ns += refresh_now() - start;
+	if (!tmux->refresh_queued_ns)
+		tmux->refresh_queued_ns = queued;
+	return wtc_tmux_queue_refresh(tmux, refresh);
 }
 
 int wtc_tmux_queue_refresh(struct wtc_tmux *tmux, int flags)
@@ -1378,6 +2091,8 @@ int wtc_tmux_queue_refresh(struct wtc_tmux *tmux, int flags)
 	int r;
 
 	tmux->refresh |= flags;
+	if (!tmux->refresh_queued_ns)
+		tmux->refresh_queued_ns = refresh_now();
 	r = write(tmux->refreshfd, "", 1);
 	if (r < 0) {
 		warn("wtc_tmux_queue_refresh: Error writing to pipe: %d", errno);
@@ -1406,6 +2121,9 @@ int wtc_tmux_queue_refresh(struct wtc_tmux *tmux, int flags)
 #define TMUX_CC_WINDOW_CLOSE            16
 #define TMUX_CC_WINDOW_PANE_CHANGED     17
 #define TMUX_CC_WINDOW_RENAMED          18
+#define TMUX_CC_CONTINUE                19
+#define TMUX_CC_EXTENDED_OUTPUT         20
+#define TMUX_CC_PAUSE                   21
 
 /*
  * The names of all of the commands, omitting the starting %.
@@ -1416,7 +2134,8 @@ static const char * const CC_NAMES[] = { "begin", "end",
 	"pane-mode-changed", "session-changed", "session-renamed",
 	"session-window-changed", "sessions-changed", "unlinked-window-add",
 	"unlinked-window-close", "unlinked-window-renamed", "window-add", 
-	"window-close", "window-pane-changed", "window-renamed" };
+	"window-close", "window-pane-changed", "window-renamed", "continue",
+	"extended-output", "pause" };
 static const int CC_NAMES_LEN = sizeof(CC_NAMES) / sizeof(*CC_NAMES);
 
 /*
@@ -1500,6 +2219,390 @@ static int consume_line(struct wtc_tmux_cc *cc)
 	return 0;
 }
 
+/*
+ * Drop the line at the start of the buffer without waiting for all of it to
+ * arrive. If it's incomplete, cc->discarding is set and the rest is dropped
+ * as it comes in. Returns true once the whole line is gone.
+ */
+static bool discard_line(struct wtc_tmux_cc *cc)
+{
+	struct shl_ring *ring = &(cc->buf);
+
+	struct iovec vecs[2];
+	size_t size, pos;
+	char val;
+
+	SHL_RING_ITERATE(ring, val, vecs, size, pos) {
+		if (val != '\n')
+			continue;
+
+		shl_ring_pop(ring, pos + 1);
+		cc->discarding = false;
+		return true;
+	}
+
+	shl_ring_pop(ring, ring->size);
+	cc->discarding = true;
+	return false;
+}
+
+/*
+ * Copy the line at the start of the buffer into buf, without the newline
+ * and truncated to fit, and remove it. Returns 0 if there is not a complete
+ * line, otherwise returns the number of characters removed.
+ */
+static int take_line(struct wtc_tmux_cc *cc, char *buf, size_t len)
+{
+	struct shl_ring *ring = &(cc->buf);
+
+	struct iovec vecs[2];
+	size_t size, pos, i = 0;
+	char val;
+
+	SHL_RING_ITERATE(ring, val, vecs, size, pos) {
+		if (val == '\0')
+			continue;
+
+		if (val == '\n') {
+			buf[i] = '\0';
+			shl_ring_pop(ring, pos + 1);
+			return pos + 1;
+		}
+
+		if (i < len - 1)
+			buf[i++] = val;
+	}
+
+	return 0;
+}
+
+/*
+ * Add a window we hadn't heard of. Its panes are loaded on the next
+ * refresh.
+ */
+static int new_window(struct wtc_tmux *tmux, int id,
+                      struct wtc_tmux_window **out)
+{
+	struct wtc_tmux_cb_closure cb;
+	struct wtc_tmux_window *wind;
+	int r;
+
+	wind = calloc(1, sizeof(struct wtc_tmux_window));
+	if (!wind) {
+		crit("new_window: Couldn't allocate window!");
+		return -ENOMEM;
+	}
+	wind->id = id;
+	wind->pending = true;
+	HASH_ADD_INT(tmux->windows, id, wind);
+
+	cb.fid = WTC_TMUX_CB_NEW_WINDOW;
+	cb.tmux = tmux;
+	cb.value.window = wind;
+	cb.free_after_use = false;
+	r = wtc_tmux_add_closure(tmux, cb);
+	if (r < 0)
+		return r;
+
+	*out = wind;
+	return wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_PENDING);
+}
+
+/*
+ * Make sure wind is in sess->windows. tmux doesn't say where it goes, so
+ * it's added at the end.
+ */
+static int add_to_session(struct wtc_tmux_window *wind,
+                          struct wtc_tmux_session *sess)
+{
+	struct wtc_tmux_window **windows;
+
+	for (int i = 0; i < sess->window_count; ++i)
+		if (sess->windows[i] == wind)
+			return 0;
+
+	windows = realloc(sess->windows,
+	                  (sess->window_count + 1) * sizeof(*windows));
+	if (!windows) {
+		crit("add_to_session: Couldn't resize windows list!");
+		return -ENOMEM;
+	}
+	sess->windows = windows;
+	sess->windows[sess->window_count++] = wind;
+
+	return wtc_tmux_window_link(wind, sess);
+}
+
+/*
+ * Take every link to wind out of sess->windows. If it was the active window,
+ * tmux follows up with %session-window-changed. Returns whether wind was
+ * linked into sess.
+ */
+static bool remove_from_session(struct wtc_tmux_window *wind,
+                                struct wtc_tmux_session *sess)
+{
+	int j = 0, count = sess->window_count;
+
+	for (int i = 0; i < sess->window_count; ++i)
+		if (sess->windows[i] != wind)
+			sess->windows[j++] = sess->windows[i];
+	sess->window_count = j;
+
+	wtc_tmux_window_unlink(wind, sess);
+	if (sess->active_window == wind)
+		sess->active_window = NULL;
+
+	return j != count;
+}
+
+/*
+ * Ask for the refresh a notification from cc about wind needs. Most
+ * notifications about a window reach the control client of every session,
+ * so only the clients of the sessions it's linked into count them towards
+ * their rate, and the others leave them to those. Windows we don't know,
+ * or which no client of ours speaks for, are refreshed for directly.
+ */
+static int refresh_window(struct wtc_tmux_cc *cc,
+                          struct wtc_tmux_window *wind, int flags)
+{
+	struct wtc_tmux_cc *other;
+	int i;
+
+	if (!wind)
+		return wtc_tmux_queue_refresh(cc->tmux, flags);
+
+	for (i = 0; i < wind->session_count; ++i)
+		if (cc->session && wind->sessions[i] == cc->session)
+			return wtc_tmux_notify_refresh(cc, flags);
+
+	for (other = cc->tmux->ccs; other; other = other->next)
+		for (i = 0; other->session && i < wind->session_count; ++i)
+			if (wind->sessions[i] == other->session)
+				return 0;
+
+	return wtc_tmux_queue_refresh(cc->tmux, flags);
+}
+
+/*
+ * Apply %window-add, %window-close and their %unlinked- counterparts. tmux
+ * sends one of these to every control client, and which one says whether
+ * the window is linked into that client's session afterwards; it doesn't
+ * say which session actually changed. So each client only speaks for its
+ * own session, and a window which has left its last session is gone.
+ *
+ * Returns the length of the line consumed, 0 if it hasn't all arrived, or a
+ * negative error code.
+ */
+static int notify_window(struct wtc_tmux_cc *cc, int cmd)
+{
+	struct wtc_tmux *tmux = cc->tmux;
+	struct wtc_tmux_session *sess = cc->session;
+	struct wtc_tmux_window *wind;
+	char line[64];
+	int n, id, flags = 0, r = 0;
+	bool unlinked;
+
+	bool linked = cmd == TMUX_CC_WINDOW_ADD || cmd == TMUX_CC_WINDOW_CLOSE;
+	bool closed = cmd == TMUX_CC_WINDOW_CLOSE ||
+	              cmd == TMUX_CC_UNLINKED_WINDOW_CLOSE;
+
+	n = take_line(cc, line, sizeof(line));
+	if (n <= 0)
+		return n;
+
+	// The temporary session's client has no session to speak for.
+	if (!sess || sscanf(line, "%*s @%d", &id) != 1) {
+		r = wtc_tmux_notify_refresh(cc, WTC_TMUX_REFRESH_WINDOWS);
+		return r < 0 ? r : n;
+	}
+
+	HASH_FIND_INT(tmux->windows, &id, wind);
+	if (!wind) {
+		if (closed)
+			return n;
+
+		r = new_window(tmux, id, &wind);
+		if (r < 0)
+			return r;
+	}
+
+	if (linked) {
+		r = add_to_session(wind, sess);
+		if (r < 0)
+			return r;
+
+		r = wtc_tmux_notify_refresh(cc, 0);
+		return r < 0 ? r : n;
+	}
+
+	// Only an unlink from our own session is ours to count.
+	unlinked = remove_from_session(wind, sess);
+	// It may only be moving to a session whose client hasn't told us yet,
+	// so this is settled on the next refresh.
+	if (closed && wind->session_count == 0 && !wind->pending) {
+		wind->pending = true;
+		flags = WTC_TMUX_REFRESH_PENDING;
+	}
+
+	if (unlinked)
+		r = wtc_tmux_notify_refresh(cc, flags);
+	else
+		r = refresh_window(cc, wind, flags);
+	return r < 0 ? r : n;
+}
+
+/*
+ * Apply %layout-change, %window-pane-changed and %pane-mode-changed, all of
+ * which need the panes reloaded.
+ */
+static int notify_panes(struct wtc_tmux_cc *cc, int cmd)
+{
+	struct wtc_tmux *tmux = cc->tmux;
+	struct wtc_tmux_window *wind = NULL;
+	struct wtc_tmux_pane *pane;
+	char line[64];
+	int n, id, r;
+
+	n = take_line(cc, line, sizeof(line));
+	if (n <= 0)
+		return n;
+
+	if (cmd == TMUX_CC_PANE_MODE_CHANGED) {
+		if (sscanf(line, "%*s %%%d", &id) == 1) {
+			HASH_FIND_INT(tmux->panes, &id, pane);
+			wind = pane ? pane->window : NULL;
+		}
+	} else if (sscanf(line, "%*s @%d", &id) == 1) {
+		HASH_FIND_INT(tmux->windows, &id, wind);
+	}
+
+	r = refresh_window(cc, wind, WTC_TMUX_REFRESH_PANES);
+	return r < 0 ? r : n;
+}
+
+/*
+ * Apply %session-window-changed. Every control client hears about every
+ * session, but only the one attached to the session is taken at its word
+ * so that the changes for a session are applied in order.
+ */
+static int notify_session_window(struct wtc_tmux_cc *cc)
+{
+	struct wtc_tmux *tmux = cc->tmux;
+	struct wtc_tmux_session *sess = cc->session;
+	struct wtc_tmux_window *wind;
+	struct wtc_tmux_cb_closure cb;
+	char line[64];
+	int n, sid, wid, r;
+
+	n = take_line(cc, line, sizeof(line));
+	if (n <= 0)
+		return n;
+
+	if (sscanf(line, "%*s $%d @%d", &sid, &wid) != 2) {
+		warn("notify_session_window: Invalid notification: %s", line);
+		r = wtc_tmux_notify_refresh(cc, WTC_TMUX_REFRESH_WINDOWS);
+		return r < 0 ? r : n;
+	}
+	if (!sess || sess->id != sid)
+		return n;
+
+	HASH_FIND_INT(tmux->windows, &wid, wind);
+	if (!wind) {
+		r = new_window(tmux, wid, &wind);
+		if (r < 0)
+			return r;
+	}
+
+	r = add_to_session(wind, sess);
+	if (r < 0)
+		return r;
+
+	if (sess->active_window == wind)
+		return n;
+	sess->active_window = wind;
+
+	cb.fid = WTC_TMUX_CB_SESSION_WINDOW_CHANGED;
+	cb.tmux = tmux;
+	cb.value.session = sess;
+	cb.free_after_use = false;
+	r = wtc_tmux_add_closure(tmux, cb);
+	if (r < 0)
+		return r;
+
+	r = wtc_tmux_notify_refresh(cc, 0);
+	return r < 0 ? r : n;
+}
+
+/*
+ * Apply %client-session-changed. Every control client hears about every
+ * client, so only the first of ours is listened to, which keeps the moves
+ * of a client in order. Clients we haven't seen yet are picked up by
+ * listing the clients.
+ */
+static int notify_client_session(struct wtc_tmux_cc *cc)
+{
+	struct wtc_tmux *tmux = cc->tmux;
+	struct wtc_tmux_client *client = NULL;
+	struct wtc_tmux_session *sess, *old;
+	struct wtc_tmux_cb_closure cb;
+	const char *atom;
+	char line[320], name[256];
+	int n, sid, r;
+
+	n = take_line(cc, line, sizeof(line));
+	if (n <= 0 || cc != tmux->ccs)
+		return n;
+
+	if (sscanf(line, "%*s %255s $%d", name, &sid) != 2) {
+		warn("notify_client_session: Invalid notification: %s", line);
+		r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_CLIENTS);
+		return r < 0 ? r : n;
+	}
+
+	HASH_FIND_INT(tmux->sessions, &sid, sess);
+	if (!sess) {
+		r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_SESSIONS);
+		return r < 0 ? r : n;
+	}
+
+	atom = wtc_tmux_atom_find(tmux, name);
+	if (atom)
+		HASH_FIND_PTR(tmux->clients, &atom, client);
+	if (!client) {
+		r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_CLIENTS);
+		return r < 0 ? r : n;
+	}
+
+	old = client->session;
+	if (old == sess)
+		return n;
+
+	if (client->previous)
+		client->previous->next = client->next;
+	else if (old)
+		old->clients = client->next;
+	if (client->next)
+		client->next->previous = client->previous;
+
+	client->previous = NULL;
+	client->next = sess->clients;
+	if (sess->clients)
+		sess->clients->previous = client;
+	sess->clients = client;
+	client->session = sess;
+
+	cb.fid = WTC_TMUX_CB_CLIENT_SESSION_CHANGED;
+	cb.tmux = tmux;
+	cb.value.client = client;
+	cb.free_after_use = false;
+	r = wtc_tmux_add_closure(tmux, cb);
+	if (r < 0)
+		return r;
+
+	r = wtc_tmux_queue_refresh(tmux, 0);
+	return r < 0 ? r : n;
+}
+
 static int process_cmd_begin(struct wtc_tmux_cc *cc)
 {
 	struct shl_ring *ring = &(cc->buf);
@@ -1598,8 +2701,14 @@ static int process_cmd_begin(struct wtc_tmux_cc *cc)
 					wloge(DEBUG);
 
 					int r = 0;
-					if (cc->cmd_cb)
+					if (cc->unanswered) {
+						--cc->unanswered;
+						if (match == error)
+							warn("process_cmd_begin: "
+							     "Unwaited command failed");
+					} else if (cc->cmd_cb) {
 						r = cc->cmd_cb(cc, start, len, match == error);
+					}
 					shl_ring_pop(ring, pos + 1);
 					return r < 0 ? r : pos + 1;
 				}
@@ -1654,6 +2763,9 @@ int wtc_tmux_cc_process_output(struct wtc_tmux_cc *cc)
 
 	int cmd = 0;
 	int r = 0;
+	if (cc->discarding && !discard_line(cc))
+		return 0;
+
 	while ((cmd = identify_command(cc)) > 0) {
 		debug("wtc_tmux_cc_process_output: Identified command: %d",
 		      cmd);
@@ -1664,22 +2776,16 @@ int wtc_tmux_cc_process_output(struct wtc_tmux_cc *cc)
 				return r;
 			break;
 		case TMUX_CC_CLIENT_SESSION_CHANGED:
-			r = consume_line(cc);
+			r = notify_client_session(cc);
 			if (r <= 0)
 				return r;
-			r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_CLIENTS);
-			if (r < 0)
-				return r;
 			break;
 		case TMUX_CC_LAYOUT_CHANGE:
 		case TMUX_CC_PANE_MODE_CHANGED:
 		case TMUX_CC_WINDOW_PANE_CHANGED:
-			r = consume_line(cc);
+			r = notify_panes(cc, cmd);
 			if (r <= 0)
 				return r;
-			r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_PANES);
-			if (r < 0)
-				return r;
 			break;
 		case TMUX_CC_SESSIONS_CHANGED:
 			r = consume_line(cc);
@@ -1690,19 +2796,34 @@ int wtc_tmux_cc_process_output(struct wtc_tmux_cc *cc)
 				return r;
 			break;
 		case TMUX_CC_SESSION_WINDOW_CHANGED:
+			r = notify_session_window(cc);
+			if (r <= 0)
+				return r;
+			break;
 		case TMUX_CC_WINDOW_ADD:
 		case TMUX_CC_WINDOW_CLOSE:
 		case TMUX_CC_UNLINKED_WINDOW_ADD:
 		case TMUX_CC_UNLINKED_WINDOW_CLOSE:
-			r = consume_line(cc);
+			r = notify_window(cc, cmd);
 			if (r <= 0)
 				return r;
-			r = wtc_tmux_queue_refresh(tmux, WTC_TMUX_REFRESH_WINDOWS);
-			if (r < 0)
-				return r;
 			break;
-		case TMUX_CC_END: // This should be consumed when processing begin
 		case TMUX_CC_OUTPUT:
+		case TMUX_CC_EXTENDED_OUTPUT:
+			// Nothing here uses pane output, and it can be arbitrarily
+			// long, so it's dropped as it arrives.
+			if (!discard_line(cc))
+				return 0;
+			break;
+		case TMUX_CC_PAUSE:
+			// We never ask for a paused pane to continue: its output
+			// would only be thrown away.
+			debug("wtc_tmux_cc_process_output: Pane paused");
+			if (!consume_line(cc))
+				return 0;
+			break;
+		case TMUX_CC_END: // This should be consumed when processing begin
+		case TMUX_CC_CONTINUE:
 		case TMUX_CC_SESSION_CHANGED:
 		case TMUX_CC_SESSION_RENAMED:
 		case TMUX_CC_UNLINKED_WINDOW_RENAMED:
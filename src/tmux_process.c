@@ -40,6 +40,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <wayland-server-core.h>
 #include <wait.h>
@@ -116,6 +117,49 @@ static int cc_cb(int fd, uint32_t mask, void *userdata)
 	return 0;
 }
 
+void wtc_tmux_cc_drain(struct wtc_tmux *tmux)
+{
+	struct wtc_tmux_cc *cc;
+	struct pollfd pol;
+	int r;
+
+	for (cc = tmux->ccs; cc; cc = cc->next) {
+		if (!cc->outs)
+			continue;
+
+		pol.fd = cc->fout;
+		pol.events = POLLIN;
+		pol.revents = 0;
+		while ((r = poll(&pol, 1, 0)) == -1 && errno == EINTR) ;
+		if (r <= 0 || !(pol.revents & POLLIN))
+			continue;
+
+		r = cc_cb(cc->fout, WL_EVENT_READABLE, cc);
+		if (r < 0)
+			warn("wtc_tmux_cc_drain: Error processing output: %d", r);
+	}
+}
+
+/*
+ * Turn on control mode flow control, where the server supports it (tmux 3.2
+ * and newer). We never look at pane output, so we ask for none at all and,
+ * in case any is still queued, have tmux pause a pane which falls
+ * WTC_TMUX_PAUSE_AFTER seconds behind rather than buffer its output for us.
+ */
+static int cc_set_flags(struct wtc_tmux_cc *cc)
+{
+	const struct wtc_tmux_cmd *cmd;
+
+	if (cc->tmux->version < WTC_TMUX_VERSION(3, 2))
+		return 0;
+
+	cmd = wtc_tmux_tmpl(cc->tmux, WTC_TMUX_TMPL_CLIENT_FLAGS);
+	if (!cmd)
+		return -ENOMEM;
+
+	return wtc_tmux_cmd_cc_exec(cc, cmd, NULL, NULL, WTC_TMUX_PAUSE_AFTER);
+}
+
 /*
  * Launch a control client on the specified session.
  */
@@ -170,6 +214,12 @@ int wtc_tmux_cc_launch(struct wtc_tmux *tmux, struct wtc_tmux_session *sess)
 		goto err_pid;
 	}
 
+	// Without flow control we still cope, just less efficiently.
+	r = cc_set_flags(cc);
+	if (r < 0)
+		warn("wtc_tmux_cc_launch: Couldn't set flags: %d", r);
+	r = 0;
+
 	cc->outs = wlc_event_loop_add_fd(fout, WL_EVENT_READABLE, cc_cb, cc);
 	if (!cc->outs) {
 		warn("wtc_tmux_cc_launch: Couldn't add fout to event loop!");
@@ -220,24 +270,61 @@ err_cmd:
 	return r;
 }
 
+int wtc_tmux_cc_adopt(struct wtc_tmux *tmux, struct wtc_tmux_session *sess,
+                      pid_t pid, int fin, int fout, struct wtc_tmux_cc **out)
+{
+	struct wtc_tmux_cc *cc, *tmp;
+
+	if (!tmux || pid <= 0 || fin < 0 || fout < 0 || !out)
+		return -EINVAL;
+
+	cc = calloc(1, sizeof(struct wtc_tmux_cc));
+	if (!cc) {
+		crit("wtc_tmux_cc_adopt: Couldn't allocate cc!");
+		return -ENOMEM;
+	}
+
+	cc->ref = 2; // outs and tmux.
+	cc->tmux = tmux;
+	cc->session = sess;
+
+	cc->pid = pid;
+	cc->temp = !sess;
+	cc->fin = fin;
+	cc->fout = fout;
+
+	cc->outs = wlc_event_loop_add_fd(fout, WL_EVENT_READABLE, cc_cb, cc);
+	if (!cc->outs) {
+		warn("wtc_tmux_cc_adopt: Couldn't add fout to event loop!");
+		free(cc);
+		return -1;
+	}
+
+	if (tmux->ccs) {
+		for (tmp = tmux->ccs; tmp->next; tmp = tmp->next) ;
+		tmp->next = cc;
+		cc->previous = tmp;
+	} else {
+		tmux->ccs = cc;
+	}
+
+	*out = cc;
+	return 0;
+}
+
 int wtc_tmux_cc_update_size(struct wtc_tmux_cc *cc)
 {
-	const char *cmd[] = { "refresh-client", "-C", NULL, NULL };
-	char *dyn = NULL;
-	int r;
+	const struct wtc_tmux_cmd *cmd;
 
 	if (!cc || !cc->tmux)
 		return -EINVAL;
 
-	r = bprintf(&dyn, "%d,%d", cc->tmux->w, cc->tmux->h);
-	if (r < 0)
-		return r;
-	cmd[2] = dyn;
-
-	r = wtc_tmux_cc_exec(cc, cmd, NULL, NULL);
+	cmd = wtc_tmux_tmpl(cc->tmux, WTC_TMUX_TMPL_CLIENT_SIZE);
+	if (!cmd)
+		return -ENOMEM;
 
-	free(dyn);
-	return r;
+	return wtc_tmux_cmd_cc_exec(cc, cmd, NULL, NULL, (int) cc->tmux->w,
+	                            (int) cc->tmux->h);
 }
 
 int wtc_tmux_fork(struct wtc_tmux *tmux, const char *const *cmds,
@@ -354,6 +441,14 @@ struct cb_dat {
 	bool handled;
 	char **out;
 	char **err;
+	/*
+	 * If not NULL, *out is a reusable buffer of this size which gets
+	 * overwritten (and only reallocated if it's too small) instead of
+	 * appended to.
+	 */
+	size_t *cap;
+	/* Set if tmux answered with %error. */
+	bool failed;
 };
 
 static int exec_cc_cb(struct wtc_tmux_cc *cc, size_t start,
@@ -370,22 +465,40 @@ static int exec_cc_cb(struct wtc_tmux_cc *cc, size_t start,
 		return 0;
 	}
 
+	dat->failed = err;
 	if (!out) {
 		dat->handled = true;
 		return 0;
 	}
 
-	size_t i = 0;
-	if (*out) {
-		i = strlen(*out);
-		len += i;
-	}
-
 	struct iovec vecs[2];
 	size_t size, pos;
 	char val;
 
-	char *buf = calloc(len + 1, sizeof(char)); // + 1 for end '\0'
+	size_t i = 0;
+	char *buf;
+	if (dat->cap && !err) {
+		if (len + 1 > *dat->cap) {
+			size_t ncap = *dat->cap ? *dat->cap : 128;
+			while (ncap < len + 1)
+				ncap *= 2;
+
+			buf = realloc(*out, ncap);
+			if (!buf) {
+				crit("exec_cc_cb: Couldn't grow buffer!");
+				return -ENOMEM;
+			}
+			*out = buf;
+			*dat->cap = ncap;
+		}
+		buf = *out;
+		goto copy;
+	}
+
+	if (*out)
+		i = strlen(*out);
+
+	buf = calloc(i + len + 1, sizeof(char)); // + 1 for end '\0'
 	if (!buf) {
 		crit("exec_cc_cb: Couldn't allocate buffer!");
 		return -ENOMEM;
@@ -394,6 +507,7 @@ static int exec_cc_cb(struct wtc_tmux_cc *cc, size_t start,
 	if (*out)
 		memcpy(buf, *out, i);
 
+copy:
 	SHL_RING_ITERATE(ring, val, vecs, size, pos) {
 		if (pos < start) {
 			pos = start - 1;
@@ -410,30 +524,27 @@ static int exec_cc_cb(struct wtc_tmux_cc *cc, size_t start,
 	}
 	buf[i] = '\0';
 
-	if (*out)
+	if (*out != buf) {
 		free(*out);
-	*out = buf;
+		*out = buf;
+	}
 	dat->handled = true;
 
 	return 0;
 }
 
-static int wtc_tmux_cc_exec_str(struct wtc_tmux_cc *cc, const char *cmd,
-                                char **out, char **err)
+static int cc_write(struct wtc_tmux_cc *cc, const char *cmd)
 {
 	int r = 0;
 
-	if (!cc || !cmd)
-		return -EINVAL;
-
-	debug("wtc_tmux_cc_exec_str: Command: %s", cmd);
+	debug("cc_write: Command: %s", cmd);
 
 	int pos = 0, len = strlen(cmd);
 	while (r = write(cc->fin, cmd + pos, len - pos)) {
 		if (r == -1) {
 			if (errno == EINTR)
 				continue;
-			warn("wtc_tmux_cc_exec_str: Error while writing: %d", errno);
+			warn("cc_write: Error while writing: %d", errno);
 			return -errno;
 		}
 
@@ -442,11 +553,25 @@ static int wtc_tmux_cc_exec_str(struct wtc_tmux_cc *cc, const char *cmd,
 			break;
 	}
 
+	return 0;
+}
+
+static int cc_exec_dat(struct wtc_tmux_cc *cc, const char *cmd,
+                       struct cb_dat *dat)
+{
+	int r = 0;
+
+	if (!cc || !cmd)
+		return -EINVAL;
+
+	r = cc_write(cc, cmd);
+	if (r < 0)
+		return r;
+
 	void *ud_bak = cc->userdata;
 	int (*cmd_bak)(struct wtc_tmux_cc *, size_t, size_t, bool) = cc->cmd_cb;
-	struct cb_dat dat = { false, out, err};
 
-	cc->userdata = &dat;
+	cc->userdata = dat;
 	cc->cmd_cb = exec_cc_cb;
 
 	struct pollfd pol = { .fd = cc->fout, .events = POLLIN, .revents = 0 };
@@ -474,7 +599,7 @@ static int wtc_tmux_cc_exec_str(struct wtc_tmux_cc *cc, const char *cmd,
 		r = cc_cb(pol.fd, mask, cc);
 		if (r < 0)
 			goto err_poll;
-		if (dat.handled)
+		if (dat->handled)
 			break;
 	}
 
@@ -484,60 +609,531 @@ err_poll:
 	return r;
 }
 
-int wtc_tmux_cc_exec(struct wtc_tmux_cc *cc, const char *const *cmds,
-                     char **out, char **err)
+static int wtc_tmux_cc_exec_str(struct wtc_tmux_cc *cc, const char *cmd,
+                                char **out, char **err)
 {
-	int len, pos;
-	char *buf;
-	int r = 0;
+	struct cb_dat dat = { false, out, err, NULL };
 
-	if (!cc)
-		return -EINVAL;
+	return cc_exec_dat(cc, cmd, &dat);
+}
 
-	// First, encode the command into a string.
-	len = 0;
-	for (int i = 0; cmds[i]; ++i) {
-		len += 3; // space quote ... quote
-		for (int j = 0; cmds[i][j] != '\0'; ++j) {
-			if (cmds[i][j] == '"')
-				len += 2; // \"
-			else if (cmds[i][j] == '\n')
-				len += 2; // \n
-			else
-				++len;
+/*
+ * The length of str once escaped for a double quoted tmux argument.
+ */
+static size_t escaped_len(const char *str)
+{
+	size_t len = 0;
+
+	for ( ; *str != '\0'; ++str)
+		len += *str == '"' || *str == '\n' ? 2 : 1; // \" or \n
+	return len;
+}
+
+/*
+ * Write str to buf, escaped for a double quoted tmux argument. Returns the
+ * number of characters written (i.e., escaped_len(str)).
+ */
+static size_t escape(char *buf, const char *str)
+{
+	size_t pos = 0;
+
+	for ( ; *str != '\0'; ++str) {
+		if (*str == '"') {
+			buf[pos++] = '\\';
+			buf[pos++] = '"';
+		} else if (*str == '\n') {
+			buf[pos++] = '\\';
+			buf[pos++] = 'n';
+		} else {
+			buf[pos++] = *str;
 		}
 	}
+	return pos;
+}
 
-	buf = calloc(len + 1, sizeof(char)); // For terminating \0
+/*
+ * Make sure tmux->cmdbuf can hold len characters.
+ */
+static int reserve_cmdbuf(struct wtc_tmux *tmux, size_t len)
+{
+	char *buf;
+
+	if (len <= tmux->cmdbuf_len)
+		return 0;
+
+	buf = realloc(tmux->cmdbuf, len);
 	if (!buf) {
-		crit("tmux_cc_exec: Couldn't allocate buf!");
+		crit("reserve_cmdbuf: Couldn't allocate buf!");
 		return -ENOMEM;
 	}
+	tmux->cmdbuf = buf;
+	tmux->cmdbuf_len = len;
+	return 0;
+}
+
+/*
+ * Encode cmds into a single command line in tmux->cmdbuf, growing it if
+ * necessary.
+ */
+static int encode_cmd(struct wtc_tmux *tmux, const char *const *cmds)
+{
+	size_t len, pos;
+	char *buf;
+	int r;
+
+	len = 0;
+	for (int i = 0; cmds[i]; ++i)
+		len += 3 + escaped_len(cmds[i]); // space quote ... quote
+
+	r = reserve_cmdbuf(tmux, len + 1); // For terminating \0
+	if (r < 0)
+		return r;
+	buf = tmux->cmdbuf;
 
 	pos = 0;
 	for (int i = 0; cmds[i]; ++i) {
 		if (i != 0)
 			buf[pos++] = ' ';
 		buf[pos++] = '"';
-		for (int j = 0; cmds[i][j] != '\0'; ++j) {
-			if (cmds[i][j] == '"') {
-				buf[pos++] = '\\';
-				buf[pos++] = '"';
-			} else if (cmds[i][j] == '\n') {
-				buf[pos++] = '\\';
-				buf[pos++] = 'n';
-			} else {
-				buf[pos++] = cmds[i][j];
-			}
-		}
+		pos += escape(buf + pos, cmds[i]);
 		buf[pos++] = '"';
 	}
 	buf[pos++] = '\n';
 	buf[pos++] = '\0';
 
-	r = wtc_tmux_cc_exec_str(cc, buf, out, err);
+	return 0;
+}
+
+int wtc_tmux_cc_exec(struct wtc_tmux_cc *cc, const char *const *cmds,
+                     char **out, char **err)
+{
+	int r = 0;
+
+	if (!cc)
+		return -EINVAL;
+
+	r = encode_cmd(cc->tmux, cmds);
+	if (r < 0)
+		return r;
+
+	return wtc_tmux_cc_exec_str(cc, cc->tmux->cmdbuf, out, err);
+}
+
+/*
+ * The character written before the value of the placeholder %type, 0 if
+ * there is none, or -1 if there's no such placeholder.
+ */
+static int placeholder_prefix(char type)
+{
+	switch (type) {
+	case 'P':
+		return '%';
+	case 'W':
+		return '@';
+	case 'S':
+		return '$';
+	case 'd':
+	case 's':
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+int wtc_tmux_cmd_compile(const char *const *cmds, struct wtc_tmux_cmd **out)
+{
+	struct wtc_tmux_cmd *cmd;
+	size_t len = 0, holes = 0, pos = 0;
+	char lit[2] = { '\0', '\0' };
+	int argc, prefix, h = 0;
+	int r = 0;
+
+	if (!cmds || !out)
+		return -EINVAL;
+
+	// Bound the sizes by assuming every other character is a placeholder
+	// and everything needs escaping.
+	for (argc = 0; cmds[argc]; ++argc) {
+		len += 3 + 2 * strlen(cmds[argc]);
+		holes += strlen(cmds[argc]) / 2;
+	}
+
+	cmd = calloc(1, sizeof(*cmd));
+	if (!cmd)
+		goto err_alloc;
+	cmd->argv = calloc(argc + 1, sizeof(char *));
+	cmd->line = malloc(len + 1);
+	cmd->holes = calloc(holes ? holes : 1, sizeof(*cmd->holes));
+	if (!cmd->argv || !cmd->line || !cmd->holes)
+		goto err_alloc;
+
+	for (int i = 0; i < argc; ++i) {
+		cmd->argv[i] = strdup(cmds[i]);
+		if (!cmd->argv[i])
+			goto err_alloc;
 
-	free(buf);
+		if (i != 0)
+			cmd->line[pos++] = ' ';
+		cmd->line[pos++] = '"';
+		for (const char *c = cmds[i]; *c != '\0'; ++c) {
+			if (*c != '%' || c[1] == '%') {
+				c += *c == '%';
+				lit[0] = *c;
+				pos += escape(cmd->line + pos, lit);
+				continue;
+			}
+
+			prefix = placeholder_prefix(*++c);
+			if (prefix < 0) {
+				warn("wtc_tmux_cmd_compile: Bad placeholder in %s",
+				     cmds[i]);
+				r = -EINVAL;
+				goto err_cmd;
+			}
+			if (prefix)
+				cmd->line[pos++] = prefix;
+			cmd->holes[h].off = pos;
+			cmd->holes[h++].type = *c == 's' ? 's' : 'd';
+		}
+		cmd->line[pos++] = '"';
+	}
+	cmd->line[pos++] = '\n';
+	cmd->line[pos] = '\0';
+	cmd->len = pos;
+	cmd->hole_count = h;
+
+	*out = cmd;
+	return 0;
+
+err_alloc:
+	crit("wtc_tmux_cmd_compile: Couldn't allocate command!");
+	r = -ENOMEM;
+err_cmd:
+	wtc_tmux_cmd_free(cmd);
+	return r;
+}
+
+void wtc_tmux_cmd_free(struct wtc_tmux_cmd *cmd)
+{
+	if (!cmd)
+		return;
+
+	if (cmd->argv)
+		for (int i = 0; cmd->argv[i]; ++i)
+			free(cmd->argv[i]);
+	free(cmd->argv);
+	free(cmd->line);
+	free(cmd->holes);
+	free(cmd);
+}
+
+/*
+ * Write val to buf in decimal, returning the number of characters written
+ * (at most 11).
+ */
+static size_t put_int(char *buf, int val)
+{
+	unsigned int u = val < 0 ? -(unsigned int) val : (unsigned int) val;
+	char tmp[10];
+	size_t n = 0, pos = 0;
+
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+
+	if (val < 0)
+		buf[pos++] = '-';
+	while (n)
+		buf[pos++] = tmp[--n];
+	return pos;
+}
+
+/*
+ * Fill in cmd's line with the arguments in ap, in tmux->cmdbuf.
+ */
+static int fill_cmd(struct wtc_tmux *tmux, const struct wtc_tmux_cmd *cmd,
+                    va_list ap)
+{
+	const struct wtc_tmux_cmd_hole *hole;
+	size_t len = cmd->len + 1, pos = 0, from = 0;
+	const char *str;
+	va_list aq;
+	int r;
+
+	// Only the strings' lengths aren't known up front.
+	va_copy(aq, ap);
+	for (int i = 0; i < cmd->hole_count; ++i) {
+		if (cmd->holes[i].type == 's') {
+			str = va_arg(aq, const char *);
+			len += escaped_len(str ? str : "");
+		} else {
+			va_arg(aq, int);
+			len += 11;
+		}
+	}
+	va_end(aq);
+
+	r = reserve_cmdbuf(tmux, len);
+	if (r < 0)
+		return r;
+
+	for (int i = 0; i < cmd->hole_count; ++i) {
+		hole = &cmd->holes[i];
+		memcpy(tmux->cmdbuf + pos, cmd->line + from, hole->off - from);
+		pos += hole->off - from;
+		from = hole->off;
+
+		if (hole->type == 's') {
+			str = va_arg(ap, const char *);
+			pos += escape(tmux->cmdbuf + pos, str ? str : "");
+		} else {
+			pos += put_int(tmux->cmdbuf + pos, va_arg(ap, int));
+		}
+	}
+	memcpy(tmux->cmdbuf + pos, cmd->line + from, cmd->len - from + 1);
+
+	return 0;
+}
+
+/*
+ * Fill in one of cmd's arguments with the values it takes from ap, in a new
+ * string. Returns NULL if out of memory.
+ */
+static char *fill_arg(const char *arg, va_list *ap)
+{
+	char *buf, *pos;
+	const char *str;
+	size_t len = 1;
+	int prefix;
+	va_list aq;
+
+	va_copy(aq, *ap);
+	for (const char *c = arg; *c != '\0'; ++c, ++len) {
+		if (*c != '%')
+			continue;
+		if (*++c == 's') {
+			str = va_arg(aq, const char *);
+			len += strlen(str ? str : "");
+		} else if (*c != '%') {
+			va_arg(aq, int);
+			len += 11;
+		}
+	}
+	va_end(aq);
+
+	buf = pos = malloc(len);
+	if (!buf) {
+		crit("fill_arg: Couldn't allocate argument!");
+		return NULL;
+	}
+
+	for (const char *c = arg; *c != '\0'; ++c) {
+		if (*c != '%' || c[1] == '%') {
+			c += *c == '%';
+			*pos++ = *c;
+			continue;
+		}
+
+		prefix = placeholder_prefix(*++c);
+		if (prefix)
+			*pos++ = prefix;
+		if (*c == 's') {
+			str = va_arg(*ap, const char *);
+			pos = stpcpy(pos, str ? str : "");
+		} else {
+			pos += put_int(pos, va_arg(*ap, int));
+		}
+	}
+	*pos = '\0';
+
+	return buf;
+}
+
+/*
+ * Run cmd without a control client, which means filling in each argument
+ * separately.
+ */
+static int cmd_fork_exec(struct wtc_tmux *tmux,
+                         const struct wtc_tmux_cmd *cmd,
+                         char **out, char **err, va_list ap)
+{
+	char **argv;
+	int argc, r = 0;
+	va_list aq;
+
+	for (argc = 0; cmd->argv[argc]; ++argc) ;
+	argv = calloc(argc + 1, sizeof(char *));
+	if (!argv) {
+		crit("cmd_fork_exec: Couldn't allocate argv!");
+		return -ENOMEM;
+	}
+
+	va_copy(aq, ap);
+	for (int i = 0; i < argc; ++i) {
+		argv[i] = fill_arg(cmd->argv[i], &aq);
+		if (!argv[i]) {
+			r = -ENOMEM;
+			break;
+		}
+	}
+	va_end(aq);
+
+	if (r == 0)
+		r = wtc_tmux_exec(tmux, (const char *const *) argv, out, err);
+
+	for (int i = 0; i < argc; ++i)
+		free(argv[i]);
+	free(argv);
+	return r;
+}
+
+static int cmd_cc_vexec(struct wtc_tmux_cc *cc, const struct wtc_tmux_cmd *cmd,
+                        char **out, char **err, va_list ap)
+{
+	int r = fill_cmd(cc->tmux, cmd, ap);
+	if (r < 0)
+		return r;
+
+	return wtc_tmux_cc_exec_str(cc, cc->tmux->cmdbuf, out, err);
+}
+
+int wtc_tmux_cmd_cc_exec(struct wtc_tmux_cc *cc,
+                         const struct wtc_tmux_cmd *cmd,
+                         char **out, char **err, ...)
+{
+	va_list ap;
+	int r;
+
+	if (!cc || !cmd)
+		return -EINVAL;
+
+	va_start(ap, err);
+	r = cmd_cc_vexec(cc, cmd, out, err, ap);
+	va_end(ap);
+	return r;
+}
+
+int wtc_tmux_cmd_exec(struct wtc_tmux *tmux, const struct wtc_tmux_cmd *cmd,
+                      char **out, char **err, ...)
+{
+	struct wtc_tmux_cc *cc;
+	va_list ap;
+	int r;
+
+	if (!tmux || !cmd)
+		return -EINVAL;
+
+	for (cc = tmux->ccs; cc && cc->temp; cc = cc->next) ;
+
+	va_start(ap, err);
+	if (cc)
+		r = cmd_cc_vexec(cc, cmd, out, err, ap);
+	else
+		r = cmd_fork_exec(tmux, cmd, out, err, ap);
+	va_end(ap);
+	return r;
+}
+
+static const char *const *const TEMPLATES[WTC_TMUX_TMPL_COUNT] = {
+	[WTC_TMUX_TMPL_OPTION_SERVER] = (const char *const []) {
+		"show-options", "-vs", "%s", NULL },
+	[WTC_TMUX_TMPL_OPTION_SESSION_GLOBAL] = (const char *const []) {
+		"show-options", "-vg", "%s", NULL },
+	[WTC_TMUX_TMPL_OPTION_SESSION] = (const char *const []) {
+		"show-options", "-vt", "%S", "%s", NULL },
+	[WTC_TMUX_TMPL_OPTION_WINDOW_GLOBAL] = (const char *const []) {
+		"show-options", "-vwg", "%s", NULL },
+	[WTC_TMUX_TMPL_OPTION_WINDOW] = (const char *const []) {
+		"show-options", "-vwt", "%W", "%s", NULL },
+	[WTC_TMUX_TMPL_CLIENT_SIZE] = (const char *const []) {
+		"refresh-client", "-C", "%d,%d", NULL },
+	[WTC_TMUX_TMPL_CLIENT_FLAGS] = (const char *const []) {
+		"refresh-client", "-f", "no-output,pause-after=%d", NULL },
+	[WTC_TMUX_TMPL_WINDOW_PANES] = (const char *const []) {
+		"list-panes", "-t", "%W", "-F", "#{pane_id} #{pane_active} "
+		"#{pane_pid} #{pane_in_mode} #{window_visible_layout}", NULL },
+};
+
+const struct wtc_tmux_cmd *wtc_tmux_tmpl(struct wtc_tmux *tmux, int which)
+{
+	if (!tmux->tmpls[which] &&
+	    wtc_tmux_cmd_compile(TEMPLATES[which], &tmux->tmpls[which]) < 0)
+		return NULL;
+
+	return tmux->tmpls[which];
+}
+
+/*
+ * Make tmux->qbuf hold at least len bytes, emptied.
+ */
+static int query_reserve(struct wtc_tmux *tmux, size_t len)
+{
+	char *tmp;
+
+	if (len > tmux->qbuf_len) {
+		tmp = realloc(tmux->qbuf, len);
+		if (!tmp) {
+			crit("wtc_tmux_query: Couldn't grow qbuf!");
+			return -ENOMEM;
+		}
+		tmux->qbuf = tmp;
+		tmux->qbuf_len = len;
+	}
+
+	tmux->qbuf[0] = '\0';
+	return 0;
+}
+
+int wtc_tmux_query(struct wtc_tmux *tmux, const char *const *cmds,
+                   char **out)
+{
+	struct wtc_tmux_cc *cc;
+	char *res = NULL;
+	size_t len;
+	int r = 0;
+
+	if (!tmux || !cmds || !out)
+		return -EINVAL;
+
+	// Never hand back the last query's result, whatever happens.
+	r = query_reserve(tmux, tmux->qbuf_len ? tmux->qbuf_len : 128);
+	if (r < 0)
+		return r;
+
+	for (cc = tmux->ccs; cc && cc->temp; cc = cc->next) ;
+	if (cc) {
+		struct cb_dat dat = { false, &tmux->qbuf, NULL, &tmux->qbuf_len };
+
+		r = encode_cmd(tmux, cmds);
+		if (r < 0)
+			return r;
+
+		r = cc_exec_dat(cc, tmux->cmdbuf, &dat);
+		if (r < 0)
+			return r;
+		if (!dat.handled)
+			return -EIO;
+
+		// Report it the way a tmux process would: exit status 1.
+		*out = tmux->qbuf;
+		return dat.failed ? 1 : r;
+	}
+
+	// Without a control client, there's no avoiding the allocations.
+	r = wtc_tmux_exec(tmux, cmds, &res, NULL);
+	if (r < 0)
+		return r;
+
+	len = res ? strlen(res) : 0;
+	if (query_reserve(tmux, len + 1) < 0) {
+		free(res);
+		return -ENOMEM;
+	}
+	memcpy(tmux->qbuf, res ? res : "", len + 1);
+	free(res);
+
+	*out = tmux->qbuf;
 	return r;
 }
 
@@ -559,48 +1155,69 @@ int wtc_tmux_session_exec(struct wtc_tmux *tmux,
 	return wtc_tmux_cc_exec_str(cc, text, out, err);
 }
 
+int wtc_tmux_session_send(struct wtc_tmux *tmux,
+                          const struct wtc_tmux_session *sess,
+                          const char *text)
+{
+	struct wtc_tmux_cc *cc;
+	int r;
+
+	if (!tmux || !sess || !text)
+		return -EINVAL;
+
+	for (cc = tmux->ccs; cc; cc = cc->next)
+		if (cc->session == sess)
+			break;
+
+	if (!cc)
+		return -EINVAL;
+
+	r = cc_write(cc, text);
+	if (r < 0)
+		return r;
+
+	// The reply comes back in order with everything else; it has to be
+	// kept from being taken as the reply to the next command we wait on.
+	++cc->unanswered;
+	return 0;
+}
+
 int wtc_tmux_get_option(struct wtc_tmux *tmux, const char *name,
                         int target, int mode, char **out)
 {
+	const struct wtc_tmux_cmd *cmd;
+	int which;
 	int r = 0;
+
 	if (!tmux || !out || *out)
 		return -EINVAL;
 
-	int i = 0;
-	const char *cmd[] = { "show-options", NULL, NULL, NULL, NULL };
-	char *dyn = NULL;
-	if (mode & WTC_TMUX_OPTION_SERVER) {
-		cmd[++i] = "-vs";
-	} else if (mode & WTC_TMUX_OPTION_SESSION) {
-		if (mode & WTC_TMUX_OPTION_GLOBAL) {
-			cmd[++i] = "-vg";
-		} else {
-			cmd[++i] = "-vt";
-			r = bprintf(&dyn, "$%u", target);
-			if (r < 0)
-				return r;
-			cmd[++i] = dyn;
-		}
-	} else { // WTC_TMUX_OPTION_WINDOW
-		if (mode & WTC_TMUX_OPTION_GLOBAL) {
-			cmd[++i] = "-vwg";
-		} else {
-			cmd[++i] = "-vwgt";
-			r = bprintf(&dyn, "@%u", mode);
-			if (r < 0)
-				return r;
-			cmd[++i] = dyn;
-		}
-	}
-	cmd[++i] = name;
+	if (mode & WTC_TMUX_OPTION_SERVER)
+		which = WTC_TMUX_TMPL_OPTION_SERVER;
+	else if (mode & WTC_TMUX_OPTION_SESSION)
+		which = mode & WTC_TMUX_OPTION_GLOBAL ?
+		        WTC_TMUX_TMPL_OPTION_SESSION_GLOBAL :
+		        WTC_TMUX_TMPL_OPTION_SESSION;
+	else // WTC_TMUX_OPTION_WINDOW
+		which = mode & WTC_TMUX_OPTION_GLOBAL ?
+		        WTC_TMUX_TMPL_OPTION_WINDOW_GLOBAL :
+		        WTC_TMUX_TMPL_OPTION_WINDOW;
+
+	cmd = wtc_tmux_tmpl(tmux, which);
+	if (!cmd)
+		return -ENOMEM;
 
-	r = wtc_tmux_exec(tmux, cmd, out, NULL);
+	// The global templates have no target to fill in.
+	if (which == WTC_TMUX_TMPL_OPTION_SESSION ||
+	    which == WTC_TMUX_TMPL_OPTION_WINDOW)
+		r = wtc_tmux_cmd_exec(tmux, cmd, out, NULL, target, name);
+	else
+		r = wtc_tmux_cmd_exec(tmux, cmd, out, NULL, name);
 	if (*out) {
 		int l = strlen(*out);
-		if ((*out)[l - 1] == '\n')
+		if (l > 0 && (*out)[l - 1] == '\n')
 			(*out)[l - 1] = '\0';
 	}
 
-	free(dyn);
 	return r;
 }
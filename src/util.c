@@ -32,6 +32,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -55,8 +56,17 @@ static inline unsigned int npo2(unsigned int base) {
 	return ++base;
 }
 
+/*
+ * When the data read isn't kept (WTC_RDAVL_DISCARD) or is copied into a
+ * ring (WTC_RDAVL_RING), it's read through this much stack space instead
+ * of a heap buffer, so those modes never allocate (beyond growing the
+ * ring).
+ */
+#define RDAVL_STACK_SIZE 4096
+
 int read_available(int fd, int mode, int *size, void *out)
 {
+	char stack[RDAVL_STACK_SIZE];
 	struct shl_ring *ring;
 	char *buf, *tmp;
 	int pos, len, rd;
@@ -70,7 +80,7 @@ int read_available(int fd, int mode, int *size, void *out)
 	disc = !(mode & (WTC_RDAVL_CSTRING | WTC_RDAVL_STANDARD));
 
 	if (disc) {
-		len = 128;
+		len = sizeof(stack) - 1;
 		pos = 0;
 	} else {
 		if (!out)
@@ -78,7 +88,7 @@ int read_available(int fd, int mode, int *size, void *out)
 
 		if (mode & WTC_RDAVL_RING) {
 			ring = out;
-			len = 128;
+			len = sizeof(stack) - 1;
 			pos = 0;
 		} else { // WTC_RDAVL_BUF
 			tmp = *((char **) out);
@@ -97,14 +107,18 @@ int read_available(int fd, int mode, int *size, void *out)
 		}
 	}
 
-	// The + 1 ensures we'll always have space for a '\0' terminator
-	buf = calloc(len + 1, sizeof(char));
-	if (!buf) {
-		crit("read_available: Couldn't create buf!");
-		return -ENOMEM;
+	if (disc || (mode & WTC_RDAVL_RING)) {
+		buf = stack;
+	} else {
+		// The + 1 ensures we'll always have space for a '\0' terminator
+		buf = calloc(len + 1, sizeof(char));
+		if (!buf) {
+			crit("read_available: Couldn't create buf!");
+			return -ENOMEM;
+		}
+		if (pos)
+			memcpy(buf, tmp, pos);
 	}
-	if (pos)
-		memcpy(buf, tmp, pos);
 
 	rd = 0;
 	while (true) {
@@ -187,7 +201,8 @@ err_buf:
 		else if (size)
 			*size = rd + 1;
 	}
-	free(buf);
+	if (buf != stack)
+		free(buf);
 	return r;
 }
 
@@ -449,6 +464,204 @@ err_is:
 	return r;
 }
 
+int split_lines(char *str, size_t len, int n, struct wtc_chunk *chunks,
+                size_t *total)
+{
+	size_t sum = 0;
+	char *end = str + len;
+	char *nl;
+	int c = 0;
+
+	if (n < 1)
+		n = 1;
+
+	while (str < end) {
+		char *target = str + (end - str) / (n - c);
+		if (c == n - 1 || target >= end)
+			target = end - 1;
+
+		nl = memchr(target, '\n', end - target);
+		if (!nl)
+			nl = end;
+		else
+			*nl = '\0';
+
+		// One more than the newlines within, in case the last is missing
+		chunks[c].str = str;
+		chunks[c].lines = 1;
+		for (char *p = str; (p = memchr(p, '\n', nl - p)); ++p)
+			chunks[c].lines++;
+
+		sum += chunks[c++].lines;
+		str = nl + 1;
+	}
+
+	if (c == 0) {
+		chunks[0].str = str;
+		chunks[0].lines = 0;
+		c = 1;
+	}
+
+	if (total)
+		*total = sum;
+	return c;
+}
+
+struct worker {
+	pthread_t thread;
+	bool started;
+	int (*fn)(void *);
+	void *job;
+	int r;
+};
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	w->r = w->fn(w->job);
+	return NULL;
+}
+
+int run_workers(int (*fn)(void *job), void *jobs, size_t size, int n)
+{
+	struct worker stack[8];
+	struct worker *ws = stack;
+	int r = 0;
+
+	if (n < 1)
+		return 0;
+	if (n > (int) (sizeof(stack) / sizeof(stack[0]))) {
+		ws = calloc(n, sizeof(struct worker));
+		if (!ws) // Fall back to running everything serially
+			n = -n;
+	}
+
+	if (n < 0) {
+		for (int i = 0; i < -n; ++i) {
+			int r2 = fn((char *) jobs + i * size);
+			if (r2 && !r)
+				r = r2;
+		}
+		return r;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		ws[i].fn = fn;
+		ws[i].job = (char *) jobs + i * size;
+		ws[i].started = i > 0 &&
+			!pthread_create(&ws[i].thread, NULL, worker_main, &ws[i]);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (!ws[i].started)
+			worker_main(&ws[i]);
+		else if (pthread_join(ws[i].thread, NULL))
+			crit("run_workers: Couldn't join worker %d!", i);
+	}
+
+	for (int i = 0; i < n && !r; ++i)
+		r = ws[i].r;
+
+	if (ws != stack)
+		free(ws);
+	return r;
+}
+
+struct parse5_job {
+	const char *fmt;
+	struct wtc_chunk chunk;
+	int *is[5];
+	size_t count;
+};
+
+static int parse5_chunk(void *data)
+{
+	struct parse5_job *job = data;
+	int **is = job->is;
+	int r;
+	size_t ncount = 0;
+	char *svptr = NULL;
+	char *pos = strtok_r(job->chunk.str, "\n", &svptr);
+	int linec = 0;
+	while (pos != NULL) {
+		r = sscanf(pos, job->fmt, &is[0][ncount], &is[1][ncount],
+		           &is[2][ncount], &is[3][ncount], &is[4][ncount], &linec);
+		if (r != 5 || (size_t) linec != strlen(pos)) {
+			warn("parselniiiii_buf: Parse error!");
+			return -EINVAL;
+		}
+
+		ncount++;
+		pos = strtok_r(NULL, "\n", &svptr);
+	}
+
+	job->count = ncount;
+	return 0;
+}
+
+int parselniiiii_buf(const char *fmt, char *str, int workers, int **buf,
+                     size_t *cap, int *olen, int **out, int **out2,
+                     int **out3, int **out4, int **out5)
+{
+	struct wtc_chunk chunks[WTC_MAX_WORKERS];
+	struct parse5_job jobs[WTC_MAX_WORKERS];
+	int *tmp;
+
+	if (!fmt || !str || !buf || !cap || !olen || !out || !out2 || !out3 ||
+	    !out4 || !out5)
+		return -EINVAL;
+
+	size_t len = strlen(str);
+	if (workers > WTC_MAX_WORKERS)
+		workers = WTC_MAX_WORKERS;
+	if (len < WTC_PARALLEL_MIN || workers < 1)
+		workers = 1;
+
+	size_t count;
+	int n = split_lines(str, len, workers, chunks, &count);
+
+	if (5 * count > *cap) {
+		tmp = realloc(*buf, 5 * count * sizeof(int));
+		if (!tmp) {
+			crit("parselniiiii_buf: couldn't grow buf!");
+			return -ENOMEM;
+		}
+		*buf = tmp;
+		*cap = 5 * count;
+	}
+
+	// Each chunk writes its results starting at its first line's index
+	size_t off = 0;
+	for (int i = 0; i < n; ++i) {
+		jobs[i].fmt = fmt;
+		jobs[i].chunk = chunks[i];
+		for (int j = 0; j < 5; ++j)
+			jobs[i].is[j] = *buf + j * count + off;
+		off += chunks[i].lines;
+	}
+
+	int r = run_workers(parse5_chunk, jobs, sizeof(struct parse5_job), n);
+	if (r)
+		return r;
+
+	// Close the gaps left by chunks containing blank lines
+	size_t ncount = jobs[0].count;
+	for (int i = 1; i < n; ++i) {
+		for (int j = 0; j < 5; ++j)
+			memmove(*buf + j * count + ncount, jobs[i].is[j],
+			        jobs[i].count * sizeof(int));
+		ncount += jobs[i].count;
+	}
+
+	*olen = ncount;
+	*out = *buf;
+	*out2 = *out + count;
+	*out3 = *out2 + count;
+	*out4 = *out3 + count;
+	*out5 = *out4 + count;
+	return 0;
+}
+
 int parselniis(const char *fmt, char *str, int *olen, int **out,
                int **out2, char ***out3)
 {
@@ -197,6 +197,68 @@ int parselniii(const char *fmt, char *str, int *olen, int **out,
  */
 int parselniiiii(const char *fmt, char *str, int *olen, int **out, 
                  int **out2, int **out3, int **out4, int **out5);
+/*
+ * Identical to parselniiiii, except the output arrays are carved out of
+ * *buf (which has room for *cap ints) instead of being allocated. *buf is
+ * grown (never shrunk) when there are too many lines, so reusing the same
+ * *buf makes repeated parses allocation free. The output arrays are only
+ * valid until *buf is next used, and must not be freed individually.
+ *
+ * *buf may be NULL (with *cap 0) the first time. If an error occurs, *buf
+ * and *cap remain valid, but the contents of *buf are unspecified.
+ *
+ * If workers is greater than one and str is at least WTC_PARALLEL_MIN
+ * bytes long, str is split into up to workers chunks of whole lines which
+ * are parsed concurrently. The result is identical to the serial parse.
+ */
+int parselniiiii_buf(const char *fmt, char *str, int workers, int **buf,
+                     size_t *cap, int *olen, int **out, int **out2,
+                     int **out3, int **out4, int **out5);
+
+/*
+ * Inputs shorter than this many bytes are always decoded on the calling
+ * thread; below it, starting threads costs more than it saves.
+ */
+#define WTC_PARALLEL_MIN (1 << 18)
+
+/*
+ * The largest number of chunks a single decode is split into.
+ */
+#define WTC_MAX_WORKERS 16
+
+/*
+ * A run of whole lines within a larger string, as produced by split_lines.
+ * str is NUL terminated (the newline ending the run has been overwritten)
+ * and contains at most lines lines.
+ */
+struct wtc_chunk {
+	char *str;
+	size_t lines;
+};
+
+/*
+ * Split the len bytes of str into at most n chunks of roughly equal size
+ * which only break at newlines. The trailing newline of each chunk is
+ * replaced with a NUL so that each chunk can be tokenized independently.
+ * The chunks are stored in order in chunks, which must have room for n
+ * entries. If total is not NULL, the sum of the chunks' line counts is
+ * stored in it.
+ *
+ * Returns the number of chunks created (which is at least one).
+ */
+int split_lines(char *str, size_t len, int n, struct wtc_chunk *chunks,
+                size_t *total);
+
+/*
+ * Call fn on each of the n jobs in the array jobs, whose elements are size
+ * bytes apart. All but the first job are run on their own thread, and the
+ * first on the calling thread; this function returns once every job has
+ * finished. If a thread cannot be started, its job is run on the calling
+ * thread instead.
+ *
+ * Returns the first non-zero value returned by fn, in job order, or 0.
+ */
+int run_workers(int (*fn)(void *job), void *jobs, size_t size, int n);
 
 /*
  * Parse two integers and a string per line. Note that the format should 